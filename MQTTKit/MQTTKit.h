@@ -108,6 +108,12 @@ withCompletionHandler:(MQTTSubscriptionCompletionHandler)completionHandler;
 - (void)subscribe:(NSString *)topic
           withQos:(MQTTQualityOfService)qos
 completionHandler:(MQTTSubscriptionCompletionHandler)completionHandler;
+// Messages matching topic are passed to messageHandler rather than to the
+// client's messageHandler, until the topic is unsubscribed.
+- (void)subscribe:(NSString *)topic
+          withQos:(MQTTQualityOfService)qos
+   messageHandler:(MQTTMessageHandler)messageHandler
+completionHandler:(MQTTSubscriptionCompletionHandler)completionHandler;
 - (void)unsubscribe: (NSString *)topic
 withCompletionHandler:(void (^)(void))completionHandler;
 
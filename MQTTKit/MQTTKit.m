@@ -56,6 +56,21 @@
 
 @end
 
+#pragma mark - MQTT Message Route
+
+// The user data for a per-subscription callback. Routes are kept until the
+// client is deallocated, because the network thread may still be using one
+// after its topic has been unsubscribed.
+@interface MQTTMessageRoute : NSObject
+
+@property (atomic, copy) MQTTMessageHandler messageHandler;
+
+@end
+
+@implementation MQTTMessageRoute
+
+@end
+
 #pragma mark - MQTT Client
 
 @interface MQTTClient()
@@ -65,6 +80,7 @@
 @property (nonatomic, strong) NSMutableDictionary *unsubscriptionHandlers;
 // dictionary of mid -> completion handlers for messages published with a QoS of 1 or 2
 @property (nonatomic, strong) NSMutableDictionary *publishHandlers;
+@property (nonatomic, strong) NSMutableDictionary *messageRoutes;
 @property (nonatomic, assign) BOOL connected;
 
 // dispatch queue to run the mosquitto_loop_forever.
@@ -115,19 +131,24 @@ static void on_publish(struct mosquitto *mosq, void *obj, int message_id)
     }
 }
 
+static MQTTMessage *message_from_mosquitto(const struct mosquitto_message *mosq_msg)
+{
+    NSString *topic = [NSString stringWithUTF8String: mosq_msg->topic];
+    NSData *payload = [NSData dataWithBytes:mosq_msg->payload length:mosq_msg->payloadlen];
+    return [[MQTTMessage alloc] initWithTopic:topic
+                                      payload:payload
+                                          qos:mosq_msg->qos
+                                       retain:mosq_msg->retain
+                                          mid:mosq_msg->mid];
+}
+
 static void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *mosq_msg)
 {
     // Ensure these objects are cleaned up quickly by an autorelease pool.
     // The GCD autorelease pool isn't guaranteed to clean this up in any amount of time.
     // Source: https://developer.apple.com/library/ios/DOCUMENTATION/General/Conceptual/ConcurrencyProgrammingGuide/OperationQueues/OperationQueues.html#//apple_ref/doc/uid/TP40008091-CH102-SW1
     @autoreleasepool {
-        NSString *topic = [NSString stringWithUTF8String: mosq_msg->topic];
-        NSData *payload = [NSData dataWithBytes:mosq_msg->payload length:mosq_msg->payloadlen];
-        MQTTMessage *message = [[MQTTMessage alloc] initWithTopic:topic
-                                                          payload:payload
-                                                              qos:mosq_msg->qos
-                                                           retain:mosq_msg->retain
-                                                              mid:mosq_msg->mid];
+        MQTTMessage *message = message_from_mosquitto(mosq_msg);
         MQTTClient* client = (__bridge MQTTClient*)obj;
         LogDebug(@"[%@] on message %@", client.clientID, message);
         if (client.messageHandler) {
@@ -136,6 +157,17 @@ static void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto
     }
 }
 
+static void on_route_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *mosq_msg)
+{
+    @autoreleasepool {
+        MQTTMessageRoute *route = (__bridge MQTTMessageRoute*)obj;
+        MQTTMessageHandler messageHandler = route.messageHandler;
+        if (messageHandler) {
+            messageHandler(message_from_mosquitto(mosq_msg));
+        }
+    }
+}
+
 static void on_subscribe(struct mosquitto *mosq, void *obj, int message_id, int qos_count, const int *granted_qos)
 {
     MQTTClient* client = (__bridge MQTTClient*)obj;
@@ -193,6 +225,7 @@ static void on_unsubscribe(struct mosquitto *mosq, void *obj, int message_id)
         self.subscriptionHandlers = [[NSMutableDictionary alloc] init];
         self.unsubscriptionHandlers = [[NSMutableDictionary alloc] init];
         self.publishHandlers = [[NSMutableDictionary alloc] init];
+        self.messageRoutes = [[NSMutableDictionary alloc] init];
         self.cleanSession = cleanSession;
 
         const char* cstrClientId = [self.clientID cStringUsingEncoding:NSUTF8StringEncoding];
@@ -337,11 +370,29 @@ static void on_unsubscribe(struct mosquitto *mosq, void *obj, int message_id)
 }
 
 - (void)subscribe: (NSString *)topic withQos:(MQTTQualityOfService)qos completionHandler:(MQTTSubscriptionCompletionHandler)completionHandler
+{
+    [self subscribe:topic withQos:qos messageHandler:nil completionHandler:completionHandler];
+}
+
+- (void)subscribe: (NSString *)topic withQos:(MQTTQualityOfService)qos messageHandler:(MQTTMessageHandler)messageHandler completionHandler:(MQTTSubscriptionCompletionHandler)completionHandler
 {
     const char* cstrTopic = [topic cStringUsingEncoding:NSUTF8StringEncoding];
-    int mid;
+    if (messageHandler) {
+        MQTTMessageRoute *route;
+        @synchronized(self.messageRoutes) {
+            route = [self.messageRoutes objectForKey:topic];
+            if (!route) {
+                route = [[MQTTMessageRoute alloc] init];
+                [self.messageRoutes setObject:route forKey:topic];
+            }
+        }
+        route.messageHandler = messageHandler;
+        mosquitto_message_callback_add(mosq, cstrTopic, on_route_message, (__bridge void *)route);
+    }
+    // mid stays 0 when nothing was sent, so there is no ack to wait for
+    int mid = 0;
     mosquitto_subscribe(mosq, &mid, cstrTopic, qos);
-    if (completionHandler) {
+    if (completionHandler && mid != 0) {
         [self.subscriptionHandlers setObject:[completionHandler copy] forKey:[NSNumber numberWithInteger:mid]];
     }
 }
@@ -349,9 +400,18 @@ static void on_unsubscribe(struct mosquitto *mosq, void *obj, int message_id)
 - (void)unsubscribe: (NSString *)topic withCompletionHandler:(void (^)(void))completionHandler
 {
     const char* cstrTopic = [topic cStringUsingEncoding:NSUTF8StringEncoding];
-    int mid;
+    MQTTMessageRoute *route;
+    @synchronized(self.messageRoutes) {
+        route = [self.messageRoutes objectForKey:topic];
+    }
+    if (route) {
+        route.messageHandler = nil;
+        mosquitto_message_callback_remove(mosq, cstrTopic, on_route_message, (__bridge void *)route);
+    }
+    // mid stays 0 when nothing was sent, so there is no ack to wait for
+    int mid = 0;
     mosquitto_unsubscribe(mosq, &mid, cstrTopic);
-    if (completionHandler) {
+    if (completionHandler && mid != 0) {
         [self.unsubscriptionHandlers setObject:[completionHandler copy] forKey:[NSNumber numberWithInteger:mid]];
     }
 }
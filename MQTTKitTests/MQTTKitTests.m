@@ -8,6 +8,11 @@
 
 #import <XCTest/XCTest.h>
 #import "MQTTKit.h"
+#import "mosquitto.h"
+#import <arpa/inet.h>
+#import <fcntl.h>
+#import <sys/select.h>
+#import <sys/socket.h>
 
 #define secondsToNanoseconds(t) (t * 1000000000ull) // in nanoseconds
 #define gotSignal(semaphore, timeout) ((dispatch_semaphore_wait(semaphore, dispatch_time(DISPATCH_TIME_NOW, secondsToNanoseconds(timeout)))) == 0l)
@@ -24,6 +29,254 @@
 
 #endif
 
+// The allocating mosquitto_topic_matches_sub() that mosquitto_topic_matches_sub2()
+// replaced, kept as the reference for testTopicMatchesSubEquivalence.
+static void fixSubTopic(char **subtopic)
+{
+    char *fixed, *token, *saveptr = NULL;
+
+    if (strlen(*subtopic) == 0) return;
+    fixed = calloc(strlen(*subtopic) + 2, 1);
+    if ((*subtopic)[0] == '/') {
+        fixed[0] = '/';
+    }
+    token = strtok_r(*subtopic, "/", &saveptr);
+    while (token) {
+        strcat(fixed, token);
+        strcat(fixed, "/");
+        token = strtok_r(NULL, "/", &saveptr);
+    }
+    fixed[strlen(fixed) - 1] = '\0';
+    free(*subtopic);
+    *subtopic = fixed;
+}
+
+static bool referenceTopicMatchesSub(const char *sub, const char *topic)
+{
+    char *localSub = strdup(sub), *localTopic = strdup(topic);
+    bool result = false, multilevelWildcard = false;
+    int slen, tlen, spos = 0, tpos = 0;
+
+    fixSubTopic(&localSub);
+    fixSubTopic(&localTopic);
+    slen = (int)strlen(localSub);
+    tlen = (int)strlen(localTopic);
+    while (spos < slen && tpos < tlen) {
+        if (localSub[spos] == localTopic[tpos]) {
+            spos++;
+            tpos++;
+            if (spos == slen && tpos == tlen) {
+                result = true;
+                break;
+            }
+        } else if (localSub[spos] == '+') {
+            spos++;
+            while (tpos < tlen && localTopic[tpos] != '/') {
+                tpos++;
+            }
+            if (tpos == tlen && spos == slen) {
+                result = true;
+                break;
+            }
+        } else if (localSub[spos] == '#') {
+            multilevelWildcard = true;
+            result = (spos + 1 == slen);
+            break;
+        } else {
+            result = false;
+            break;
+        }
+        if (tpos == tlen - 1 && spos == slen - 3 && localSub[spos + 1] == '/' && localSub[spos + 2] == '#') {
+            result = true;
+            multilevelWildcard = true;
+            break;
+        }
+    }
+    if (!multilevelWildcard && (tpos < tlen || spos < slen)) {
+        result = false;
+    }
+    free(localSub);
+    free(localTopic);
+    return result;
+}
+
+static void randomTopic(char *buffer, const char *alphabet)
+{
+    size_t length = arc4random_uniform(10), count = strlen(alphabet);
+    for (size_t i = 0; i < length; i++) {
+        buffer[i] = alphabet[arc4random_uniform((uint32_t)count)];
+    }
+    buffer[length] = '\0';
+}
+
+// Whether the first count levels found by mosquitto_sub_topic_tokenise_view()
+// describe the same strings as the tokens from mosquitto_sub_topic_tokenise(),
+// where a NULL token is an empty level.
+static bool levelsMatchTokens(const char *subtopic, const struct mosquitto_topic_level *levels, char **tokens, int count)
+{
+    for (int i = 0; i < count; i++) {
+        size_t length = tokens[i] ? strlen(tokens[i]) : 0;
+        if ((size_t)levels[i].len != length || strncmp(subtopic + levels[i].offset, tokens[i] ? tokens[i] : "", length)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The MQTT specification's matching rules over the levels from
+// mosquitto_sub_topic_tokenise_view(), the reference for the filter set tests:
+// "+" matches one level, a final "#" matches any number of levels including
+// none, and a wildcard first level doesn't match a topic starting with "$".
+static bool specTopicMatchesFilter(const char *filter, const char *topic)
+{
+    struct mosquitto_topic_level filterLevels[16], topicLevels[16];
+    int filterCount, topicCount;
+
+    mosquitto_sub_topic_tokenise_view(filter, filterLevels, 16, &filterCount);
+    mosquitto_sub_topic_tokenise_view(topic, topicLevels, 16, &topicCount);
+    if (topic[0] == '$' && (filter[0] == '+' || filter[0] == '#')) {
+        return false;
+    }
+    for (int i = 0; i < filterCount; i++) {
+        const char *level = filter + filterLevels[i].offset;
+        if (filterLevels[i].len == 1 && level[0] == '#') {
+            return true;
+        }
+        if (i == topicCount) {
+            return false;
+        }
+        if (filterLevels[i].len == 1 && level[0] == '+') {
+            continue;
+        }
+        if (filterLevels[i].len != topicLevels[i].len || memcmp(level, topic + topicLevels[i].offset, filterLevels[i].len)) {
+            return false;
+        }
+    }
+    return filterCount == topicCount;
+}
+
+// Up to four levels from a small set, so that leading slashes, "$" and
+// overlapping wildcards come up often. Wildcards only appear in filters.
+static void randomLevels(char *buffer, bool wildcards)
+{
+    const char *names[] = {"a", "b", "$a", "", "+", "#"};
+
+    do {
+        int count = 1 + arc4random_uniform(4);
+        buffer[0] = '\0';
+        for (int i = 0; i < count; i++) {
+            const char *level = names[arc4random_uniform(wildcards ? 6 : 4)];
+            if (i > 0) {
+                strcat(buffer, "/");
+            }
+            strcat(buffer, level);
+            if (level[0] == '#') {
+                break;
+            }
+        }
+    } while (!buffer[0]);
+}
+
+// Counts down the PUBACKs that testPublishQos1Performance is waiting for.
+static int32_t publishedRemaining;
+static dispatch_semaphore_t publishedAll;
+
+static void countPublished(struct mosquitto *mosq, void *obj, int mid)
+{
+    if (__sync_sub_and_fetch(&publishedRemaining, 1) == 0) {
+        dispatch_semaphore_signal(publishedAll);
+    }
+}
+
+static void countMessage(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message)
+{
+    (*(int *)obj)++;
+}
+
+// Listens on an ephemeral port on 127.0.0.1 for the tests that play the
+// broker themselves.
+static int listenOnLoopback(uint16_t *port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = {0};
+    socklen_t addressLength = sizeof(address);
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sock, (struct sockaddr *)&address, sizeof(address)) || listen(sock, 4)) {
+        close(sock);
+        return -1;
+    }
+    getsockname(sock, (struct sockaddr *)&address, &addressLength);
+    *port = ntohs(address.sin_port);
+    return sock;
+}
+
+// Accepts one client on listener, answers its CONNECT and then reads and
+// discards everything it sends until it disconnects.
+static void runSink(int listener)
+{
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        int sock = accept(listener, NULL, NULL);
+        unsigned char buffer[65536];
+        const unsigned char connack[] = {0x20, 2, 0, 0};
+        recv(sock, buffer, sizeof(buffer), 0);
+        send(sock, connack, sizeof(connack), 0);
+        while (recv(sock, buffer, sizeof(buffer), 0) > 0);
+        close(sock);
+    });
+}
+
+// Builds a 40 byte topic of "a" with bytes written at offset, so that a
+// sequence can be placed across the 16 and 32 byte blocks that
+// _mosquitto_topic_check() looks at, or in the tail after them.
+static const char *topicWithBytesAt(char *buffer, const char *bytes, int offset)
+{
+    memset(buffer, 'a', 40);
+    buffer[40] = '\0';
+    memcpy(buffer + offset, bytes, strlen(bytes));
+    return buffer;
+}
+
+// Reads everything a client sends until it closes the connection or sends
+// nothing for quietMs, and describes it: the packet types in order, with the
+// topics of each SUBSCRIBE, e.g. "1 8:a/b,c/#" for CONNECT and SUBSCRIBE.
+static NSString *readPackets(int sock, int quietMs)
+{
+    unsigned char buffer[4096];
+    ssize_t length = 0, received;
+    struct timeval timeout = {quietMs / 1000, (quietMs % 1000) * 1000};
+    NSMutableString *packets = [NSMutableString string];
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while ((size_t)length < sizeof(buffer) && (received = recv(sock, buffer + length, sizeof(buffer) - length, 0)) > 0) {
+        length += received;
+    }
+    for (ssize_t pos = 0; pos < length; ) {
+        int type = buffer[pos++] >> 4;
+        ssize_t remaining = 0, multiplier = 1;
+        do {
+            remaining += (buffer[pos] & 127) * multiplier;
+            multiplier *= 128;
+        } while (buffer[pos++] & 128);
+        ssize_t end = pos + remaining;
+
+        [packets appendFormat:@"%@%d", packets.length ? @" " : @"", type];
+        if (type == 8) {
+            char separator = ':';
+            // skip the message id, then each topic is followed by its qos
+            for (ssize_t topicPos = pos + 2; topicPos + 2 <= end; ) {
+                int topicLength = buffer[topicPos] * 256 + buffer[topicPos + 1];
+                [packets appendFormat:@"%c%.*s", separator, topicLength, buffer + topicPos + 2];
+                separator = ',';
+                topicPos += 2 + topicLength + 1;
+            }
+        }
+        pos = end;
+    }
+    return packets;
+}
+
 @interface MQTTKitTests : XCTestCase
 
 @end
@@ -167,6 +420,45 @@ NSString *topic;
     [client disconnectWithCompletionHandler:nil];
 }
 
+- (void)testSubscribeWithMessageHandler
+{
+    NSString *filter = [topic stringByAppendingString:@"/+/temperature"];
+    NSString *text = [NSString stringWithFormat:@"Hello, MQTT %d", arc4random()];
+
+    dispatch_semaphore_t subscribed = dispatch_semaphore_create(0);
+    dispatch_semaphore_t routed = dispatch_semaphore_create(0);
+    dispatch_semaphore_t received = dispatch_semaphore_create(0);
+
+    [client setMessageHandler:^(MQTTMessage *message) {
+        dispatch_semaphore_signal(received);
+    }];
+
+    [client connectWithCompletionHandler:^(NSUInteger code) {
+        [client subscribe:filter
+                  withQos:AtMostOnce
+           messageHandler:^(MQTTMessage *message) {
+               XCTAssertTrue([text isEqualToString:message.payloadString]);
+               dispatch_semaphore_signal(routed);
+           }
+        completionHandler:^(NSArray *grantedQos) {
+            dispatch_semaphore_signal(subscribed);
+        }];
+    }];
+
+    XCTAssertTrue(gotSignal(subscribed, 4));
+
+    [client publishString:text
+                  toTopic:[topic stringByAppendingString:@"/kitchen/temperature"]
+                  withQos:AtMostOnce
+                   retain:NO
+        completionHandler:nil];
+
+    XCTAssertTrue(gotSignal(routed, 4));
+    XCTAssertFalse(gotSignal(received, 1));
+
+    [client disconnectWithCompletionHandler:nil];
+}
+
 - (void)testPublishMany
 {
     dispatch_semaphore_t subscribed = dispatch_semaphore_create(0);
@@ -211,6 +503,124 @@ NSString *topic;
     [client disconnectWithCompletionHandler:nil];
 }
 
+// Times 160,000 QoS 0 publishes shared between producer threads, until the
+// network thread has written them all to a local sink, so that the numbers
+// don't depend on a remote broker.
+- (void)measurePublishWithProducerThreads:(int)threads
+{
+    uint16_t port;
+    int listener = listenOnLoopback(&port);
+    XCTAssertNotEqual(-1, listener);
+    runSink(listener);
+
+    struct mosquitto *mosq = mosquitto_new(NULL, true, NULL);
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_connect(mosq, "127.0.0.1", port, 60));
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_loop_start(mosq));
+    int perThread = 160000 / threads;
+
+    [self measureBlock:^{
+        dispatch_group_t group = dispatch_group_create();
+        for (int i = 0; i < threads; i++) {
+            // a serial queue per producer so that each one gets its own thread
+            dispatch_queue_t producer = dispatch_queue_create("MQTTKitTests.producer", NULL);
+            dispatch_group_async(group, producer, ^{
+                for (int j = 0; j < perThread; j++) {
+                    mosquitto_publish(mosq, NULL, "MQTTKitTests/producer", 16, "0123456789abcdef", 0, false);
+                }
+            });
+        }
+        XCTAssertEqual(0l, dispatch_group_wait(group, dispatch_time(DISPATCH_TIME_NOW, secondsToNanoseconds(30))));
+        for (int i = 0; i < 300000 && mosquitto_want_write(mosq); i++) {
+            usleep(100);
+        }
+        XCTAssertFalse(mosquitto_want_write(mosq));
+    }];
+
+    mosquitto_disconnect(mosq);
+    mosquitto_loop_stop(mosq, false);
+    mosquitto_destroy(mosq);
+    close(listener);
+}
+
+- (void)testPublishThroughputWith1ProducerThread
+{
+    [self measurePublishWithProducerThreads:1];
+}
+
+- (void)testPublishThroughputWith2ProducerThreads
+{
+    [self measurePublishWithProducerThreads:2];
+}
+
+- (void)testPublishThroughputWith4ProducerThreads
+{
+    [self measurePublishWithProducerThreads:4];
+}
+
+- (void)testPublishThroughputWith8ProducerThreads
+{
+    [self measurePublishWithProducerThreads:8];
+}
+
+- (void)testPublishThroughputWith16ProducerThreads
+{
+    [self measurePublishWithProducerThreads:16];
+}
+
+// The benchmarks below drive libmosquitto directly, so that they time the
+// client's publish path and its locking rather than MQTTKit's bookkeeping.
+- (void)testPublishPerformanceWithProducerThreads
+{
+    struct mosquitto *mosq = mosquitto_new(NULL, true, NULL);
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_connect(mosq, [kHost UTF8String], 1883, 60));
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_loop_start(mosq));
+    const char *topicName = [topic UTF8String];
+
+    [self measureBlock:^{
+        dispatch_group_t group = dispatch_group_create();
+        for (int i = 0; i < 4; i++) {
+            dispatch_queue_t producer = dispatch_queue_create("MQTTKitTests.producer", NULL);
+            dispatch_group_async(group, producer, ^{
+                for (int j = 0; j < 4000; j++) {
+                    mosquitto_publish(mosq, NULL, topicName, 16, "0123456789abcdef", 0, false);
+                }
+            });
+        }
+        XCTAssertEqual(0l, dispatch_group_wait(group, dispatch_time(DISPATCH_TIME_NOW, secondsToNanoseconds(30))));
+    }];
+
+    mosquitto_disconnect(mosq);
+    mosquitto_loop_stop(mosq, false);
+    mosquitto_destroy(mosq);
+}
+
+- (void)testPublishQos1Performance
+{
+    struct mosquitto *mosq = mosquitto_new(NULL, true, NULL);
+    mosquitto_publish_callback_set(mosq, countPublished);
+    // no inflight limit, so that the round trip to the broker doesn't
+    // dominate the measurement
+    mosquitto_max_inflight_messages_set(mosq, 0);
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_connect(mosq, [kHost UTF8String], 1883, 60));
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_loop_start(mosq));
+    const char *topicName = [topic UTF8String];
+
+    // Each iteration waits for every PUBACK, so the network thread handling
+    // acknowledgements competes with the publishing thread for the locks.
+    [self measureBlock:^{
+        publishedAll = dispatch_semaphore_create(0);
+        publishedRemaining = 2000;
+        for (int i = 0; i < 2000; i++) {
+            mosquitto_publish(mosq, NULL, topicName, 16, "0123456789abcdef", 1, false);
+        }
+        XCTAssertTrue(gotSignal(publishedAll, 30));
+    }];
+
+    mosquitto_disconnect(mosq);
+    mosquitto_loop_stop(mosq, false);
+    mosquitto_destroy(mosq);
+}
+
 - (void)testTwoClients
 {
     MQTTClient *subscriber = [[MQTTClient alloc] initWithClientId:@"MQTTKitTests-sub"];
@@ -369,4 +779,556 @@ NSString *topic;
     XCTAssertTrue(gotSignal(disconnected, 4));
 }
 
+- (void)testPipelinedSubscribe
+{
+    // a local broker that refuses the first connection and accepts the next
+    // two, reading whatever the client pipelines before sending CONNACK
+    uint16_t port;
+    int listener = listenOnLoopback(&port);
+    XCTAssertNotEqual(-1, listener);
+
+    const unsigned char connackCodes[] = {5, 0, 0};
+    NSMutableArray *seen = [NSMutableArray array];
+    dispatch_semaphore_t served = dispatch_semaphore_create(0);
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        for (int i = 0; i < 3; i++) {
+            int sock = accept(listener, NULL, NULL);
+            NSString *packets = readPackets(sock, 300);
+            @synchronized(seen) {
+                [seen addObject:packets];
+            }
+            unsigned char connack[4] = {0x20, 2, 0, connackCodes[i]};
+            send(sock, connack, sizeof(connack), 0);
+            close(sock);
+        }
+        dispatch_semaphore_signal(served);
+    });
+
+    struct mosquitto *mosq = mosquitto_new("MQTTKitTests-pipeline", true, NULL);
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_pipeline_set(mosq, true));
+
+    // queued while disconnected: nothing is sent, so there is no mid yet
+    int mid = -1;
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_subscribe(mosq, &mid, "a/b", 1));
+    XCTAssertEqual(0, mid);
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_subscribe(mosq, NULL, "c/#", 0));
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_subscribe(mosq, NULL, "gone", 0));
+    mid = -1;
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_unsubscribe(mosq, &mid, "gone"));
+    XCTAssertEqual(0, mid);
+
+    for (int i = 0; i < 3; i++) {
+        if (i == 0) {
+            XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_connect(mosq, "127.0.0.1", port, 60));
+        } else {
+            XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_reconnect(mosq));
+        }
+        int rc = MOSQ_ERR_SUCCESS;
+        for (int j = 0; j < 50 && rc == MOSQ_ERR_SUCCESS; j++) {
+            rc = mosquitto_loop(mosq, 100, 1);
+        }
+        // refused, then accepted and closed by the broker
+        XCTAssertEqual(i == 0 ? MOSQ_ERR_CONN_REFUSED : MOSQ_ERR_CONN_LOST, rc);
+        // nothing from this connection is left over for the next one
+        XCTAssertFalse(mosquitto_want_write(mosq));
+    }
+
+    XCTAssertTrue(gotSignal(served, 4));
+    close(listener);
+    mosquitto_destroy(mosq);
+
+    // each connection gets the tracked subscriptions once, in one SUBSCRIBE
+    // sent straight after CONNECT
+    NSArray *expected = @[@"1 8:a/b,c/#", @"1 8:a/b,c/#", @"1 8:a/b,c/#"];
+    XCTAssertEqualObjects(expected, seen);
+}
+
+- (void)testTopicCheck
+{
+    struct mosquitto *mosq = mosquitto_new(NULL, true, NULL);
+    char buffer[41];
+
+    // not connected, so a topic that passes the check fails with NO_CONN
+    const char *validTopics[] = {"a", "a/b/c", "/", "a//b", "caf\xc3\xa9/\xe2\x82\xac/\xf0\x9d\x84\x9e"};
+    for (int i = 0; i < 5; i++) {
+        XCTAssertEqual(MOSQ_ERR_NO_CONN, mosquitto_publish(mosq, NULL, validTopics[i], 0, NULL, 0, false), @"%s", validTopics[i]);
+        XCTAssertEqual(MOSQ_ERR_NO_CONN, mosquitto_subscribe(mosq, NULL, validTopics[i], 0), @"%s", validTopics[i]);
+    }
+
+    const char *validSubs[] = {"#", "+", "a/#", "a/+/b", "+/+", "/#", "+/"};
+    const char *invalidSubs[] = {"", "a#", "a/b#", "a/#/b", "#/", "a+", "+a", "a/+b/c"};
+    for (int i = 0; i < 7; i++) {
+        XCTAssertEqual(MOSQ_ERR_NO_CONN, mosquitto_subscribe(mosq, NULL, validSubs[i], 0), @"%s", validSubs[i]);
+        XCTAssertEqual(MOSQ_ERR_INVAL, mosquitto_publish(mosq, NULL, validSubs[i], 0, NULL, 0, false), @"%s", validSubs[i]);
+    }
+    for (int i = 0; i < 8; i++) {
+        XCTAssertEqual(MOSQ_ERR_INVAL, mosquitto_subscribe(mosq, NULL, invalidSubs[i], 0), @"%s", invalidSubs[i]);
+    }
+
+    // wildcards past the first block, where the block scan has to stop
+    // for them
+    XCTAssertEqual(MOSQ_ERR_INVAL, mosquitto_publish(mosq, NULL, topicWithBytesAt(buffer, "/+/", 20), 0, NULL, 0, false));
+    XCTAssertEqual(MOSQ_ERR_NO_CONN, mosquitto_subscribe(mosq, NULL, topicWithBytesAt(buffer, "/+/", 20), 0));
+    XCTAssertEqual(MOSQ_ERR_INVAL, mosquitto_subscribe(mosq, NULL, topicWithBytesAt(buffer, "+", 33), 0));
+    XCTAssertEqual(MOSQ_ERR_NO_CONN, mosquitto_subscribe(mosq, NULL, topicWithBytesAt(buffer, "/#", 38), 0));
+    XCTAssertEqual(MOSQ_ERR_INVAL, mosquitto_subscribe(mosq, NULL, topicWithBytesAt(buffer, "/#", 16), 0));
+
+    // well formed characters of every length, and malformed sequences:
+    // overlong forms, a surrogate, a code point above U+10FFFF, a stray
+    // continuation byte, a byte that never starts a character and
+    // characters cut short by the next one
+    const char *goodBytes[] = {"\xc3\xa9", "\xe2\x82\xac", "\xf0\x9d\x84\x9e", "\xf4\x8f\xbf\xbf"};
+    const char *badBytes[] = {"\xc0\xaf", "\xc1\xbf", "\xe0\x80\xaf", "\xf0\x80\x80\xaf", "\xed\xa0\x80",
+                              "\xf4\x90\x80\x80", "\x80", "\xff", "\xe2\x82" "a", "\xf0\x9f" "a"};
+    // straddling the end of the first 16 byte block, the first 32 byte
+    // block, and in the tail
+    const int offsets[] = {0, 13, 14, 15, 16, 29, 30, 31, 32, 36};
+    for (int j = 0; j < 10; j++) {
+        for (int i = 0; i < 4; i++) {
+            const char *topicName = topicWithBytesAt(buffer, goodBytes[i], offsets[j]);
+            XCTAssertEqual(MOSQ_ERR_NO_CONN, mosquitto_publish(mosq, NULL, topicName, 0, NULL, 0, false), @"%d at %d", i, offsets[j]);
+            XCTAssertEqual(MOSQ_ERR_NO_CONN, mosquitto_subscribe(mosq, NULL, topicName, 0), @"%d at %d", i, offsets[j]);
+        }
+        for (int i = 0; i < 10; i++) {
+            const char *topicName = topicWithBytesAt(buffer, badBytes[i], offsets[j]);
+            XCTAssertEqual(MOSQ_ERR_INVAL, mosquitto_publish(mosq, NULL, topicName, 0, NULL, 0, false), @"%d at %d", i, offsets[j]);
+            XCTAssertEqual(MOSQ_ERR_INVAL, mosquitto_subscribe(mosq, NULL, topicName, 0), @"%d at %d", i, offsets[j]);
+        }
+    }
+
+    // a character cut short by the end of the topic
+    const char *truncated[] = {"\xc3", "\xe2\x82", "\xf0\x9d\x84"};
+    for (int i = 0; i < 3; i++) {
+        const char *topicName = topicWithBytesAt(buffer, truncated[i], 40 - (int)strlen(truncated[i]));
+        XCTAssertEqual(MOSQ_ERR_INVAL, mosquitto_publish(mosq, NULL, topicName, 0, NULL, 0, false), @"%d", i);
+        XCTAssertEqual(MOSQ_ERR_INVAL, mosquitto_subscribe(mosq, NULL, topicName, 0), @"%d", i);
+    }
+
+    // the same in the multiple topic form: one bad topic fails them all
+    char *subs[] = {"a/+", "a\xc0\xaf"};
+    int qos[] = {0, 0};
+    XCTAssertEqual(MOSQ_ERR_INVAL, mosquitto_subscribe_multiple(mosq, NULL, 2, subs, qos));
+    XCTAssertEqual(MOSQ_ERR_NO_CONN, mosquitto_subscribe_multiple(mosq, NULL, 1, subs, qos));
+
+    mosquitto_destroy(mosq);
+}
+
+- (void)testReceivedTopicWithNul
+{
+    // A topic passed to the API ends at its first NUL, so an embedded NUL
+    // can only arrive from the broker. The client must treat it as a
+    // protocol error rather than deliver a topic that has been cut short.
+    uint16_t port;
+    int listener = listenOnLoopback(&port);
+    XCTAssertNotEqual(-1, listener);
+
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        int sock = accept(listener, NULL, NULL);
+        unsigned char buffer[256];
+        recv(sock, buffer, sizeof(buffer), 0);
+        const unsigned char connack[] = {0x20, 2, 0, 0};
+        const unsigned char publish[] = {0x30, 7, 0, 3, 'a', 0, 'b', 'h', 'i'};
+        send(sock, connack, sizeof(connack), 0);
+        send(sock, publish, sizeof(publish), 0);
+        // hold the connection open until the client drops it
+        while (recv(sock, buffer, sizeof(buffer), 0) > 0);
+        close(sock);
+    });
+
+    int received = 0;
+    struct mosquitto *mosq = mosquitto_new(NULL, true, &received);
+    mosquitto_message_callback_set(mosq, countMessage);
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_connect(mosq, "127.0.0.1", port, 60));
+    int rc = MOSQ_ERR_SUCCESS;
+    for (int i = 0; i < 50 && rc == MOSQ_ERR_SUCCESS; i++) {
+        rc = mosquitto_loop(mosq, 100, 1);
+    }
+    XCTAssertEqual(MOSQ_ERR_PROTOCOL, rc);
+    XCTAssertEqual(0, received);
+
+    mosquitto_destroy(mosq);
+    close(listener);
+}
+
+static void recordDisconnect(struct mosquitto *mosq, void *obj, int rc)
+{
+    *(int *)obj = rc;
+}
+
+- (void)testDisconnectWhileConnecting
+{
+    // Fill the listener's accept queue so that the client's SYN is dropped
+    // and its connection attempt stays in flight.
+    uint16_t port;
+    int listener = listenOnLoopback(&port);
+    XCTAssertNotEqual(-1, listener);
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    int fillers[16], fillerCount = 0;
+    bool full = false;
+    while (!full && fillerCount < 16) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        fd_set writefds;
+        struct timeval timeout = {0, 100000};
+        fcntl(sock, F_SETFL, O_NONBLOCK);
+        connect(sock, (struct sockaddr *)&address, sizeof(address));
+        FD_ZERO(&writefds);
+        FD_SET(sock, &writefds);
+        full = select(sock + 1, NULL, &writefds, NULL, &timeout) == 0;
+        fillers[fillerCount++] = sock;
+    }
+    XCTAssertTrue(full);
+
+    int disconnectRc = -1;
+    struct mosquitto *mosq = mosquitto_new(NULL, true, &disconnectRc);
+    mosquitto_disconnect_callback_set(mosq, recordDisconnect);
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_connect_async(mosq, "127.0.0.1", port, 30));
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_loop_start(mosq));
+    usleep(300000);
+
+    // the attempt is given up straight away, not after the keepalive
+    NSDate *start = [NSDate date];
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_disconnect(mosq));
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_loop_stop(mosq, false));
+    XCTAssertLessThan(-[start timeIntervalSinceNow], 2.0);
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, disconnectRc);
+    XCTAssertEqual(-1, mosquitto_socket(mosq));
+
+    // the same when the application runs the loop itself
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_reconnect_async(mosq));
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_loop(mosq, 100, 1));
+    disconnectRc = -1;
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_disconnect(mosq));
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_loop(mosq, 1000, 1));
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, disconnectRc);
+    XCTAssertEqual(MOSQ_ERR_NO_CONN, mosquitto_loop(mosq, 10, 1));
+
+    mosquitto_destroy(mosq);
+    for (int i = 0; i < fillerCount; i++) {
+        close(fillers[i]);
+    }
+    close(listener);
+}
+
+// obj points at {disconnect rc, connect rc}.
+static void recordConnect(struct mosquitto *mosq, void *obj, int rc)
+{
+    ((int *)obj)[1] = rc;
+}
+
+- (void)testConnectAsyncLooksUpHostInLoop
+{
+    // With nothing cached the lookup is left to the network loop, so a name
+    // that can't resolve is reported to the disconnect callback rather than
+    // returned, and mosquitto_socket() is ready to read when it finishes.
+    mosquitto_address_cache_ttl_set(0);
+    int results[2] = {-1, -1};
+    struct mosquitto *mosq = mosquitto_new(NULL, true, results);
+    mosquitto_disconnect_callback_set(mosq, recordDisconnect);
+    mosquitto_connect_callback_set(mosq, recordConnect);
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_connect_async(mosq, "mqttkit.invalid", 1883, 60));
+    XCTAssertNotEqual(-1, mosquitto_socket(mosq));
+    XCTAssertFalse(mosquitto_want_write(mosq));
+    for (int i = 0; i < 100 && results[0] == -1; i++) {
+        mosquitto_loop(mosq, 100, 1);
+    }
+    XCTAssertEqual(MOSQ_ERR_EAI, results[0]);
+    XCTAssertEqual(-1, mosquitto_socket(mosq));
+
+    uint16_t port;
+    int listener = listenOnLoopback(&port);
+    XCTAssertNotEqual(-1, listener);
+    runSink(listener);
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_connect_async(mosq, "localhost", port, 60));
+    for (int i = 0; i < 100 && results[1] == -1; i++) {
+        mosquitto_loop(mosq, 100, 1);
+    }
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, results[1]);
+
+    mosquitto_disconnect(mosq);
+    mosquitto_loop(mosq, 100, 1);
+    mosquitto_destroy(mosq);
+    close(listener);
+    mosquitto_address_cache_ttl_set(60000);
+}
+
+- (void)testMessageRetryClamped
+{
+    // 4294968 seconds is just over UINT_MAX milliseconds, and used to wrap
+    // round to a retry every 704 ms.
+    uint16_t port;
+    int listener = listenOnLoopback(&port);
+    XCTAssertNotEqual(-1, listener);
+
+    __block NSString *packets;
+    dispatch_semaphore_t served = dispatch_semaphore_create(0);
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        int sock = accept(listener, NULL, NULL);
+        unsigned char buffer[256];
+        const unsigned char connack[] = {0x20, 2, 0, 0};
+        recv(sock, buffer, sizeof(buffer), 0);
+        send(sock, connack, sizeof(connack), 0);
+        // never acknowledge the PUBLISH
+        packets = readPackets(sock, 3000);
+        close(sock);
+        dispatch_semaphore_signal(served);
+    });
+
+    struct mosquitto *mosq = mosquitto_new(NULL, true, NULL);
+    mosquitto_message_retry_set(mosq, 4294968);
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_connect(mosq, "127.0.0.1", port, 60));
+    for (int i = 0; i < 3; i++) {
+        mosquitto_loop(mosq, 100, 1);
+    }
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_publish(mosq, NULL, "MQTTKitTests/retry", 1, "x", 1, false));
+    NSDate *start = [NSDate date];
+    while ([start timeIntervalSinceNow] > -2) {
+        mosquitto_loop(mosq, 100, 1);
+    }
+    mosquitto_disconnect(mosq);
+    mosquitto_loop(mosq, 100, 1);
+
+    XCTAssertTrue(gotSignal(served, 5));
+    // one PUBLISH, then DISCONNECT
+    XCTAssertEqualObjects(@"3 14", packets);
+    mosquitto_destroy(mosq);
+    close(listener);
+}
+
+- (void)testRoutesSkipDollarTopicsForLeadingWildcards
+{
+    // "$SYS/x" should only reach the routes that name "$SYS" themselves.
+    uint16_t port;
+    int listener = listenOnLoopback(&port);
+    XCTAssertNotEqual(-1, listener);
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        int sock = accept(listener, NULL, NULL);
+        unsigned char buffer[256];
+        const unsigned char packets[] = {
+            0x20, 2, 0, 0,
+            0x30, 9, 0, 6, '$', 'S', 'Y', 'S', '/', 'x', '1',
+            0x30, 6, 0, 3, 'a', '/', 'x', '1',
+        };
+        recv(sock, buffer, sizeof(buffer), 0);
+        send(sock, packets, sizeof(packets), 0);
+        while (recv(sock, buffer, sizeof(buffer), 0) > 0);
+        close(sock);
+    });
+
+    const char *filters[] = {"#", "+/x", "$SYS/#", "$SYS/+", "a/x"};
+    int counts[5] = {0};
+    struct mosquitto *mosq = mosquitto_new(NULL, true, NULL);
+    for (int i = 0; i < 5; i++) {
+        XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_message_callback_add(mosq, filters[i], countMessage, &counts[i]));
+    }
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_connect(mosq, "127.0.0.1", port, 60));
+    for (int i = 0; i < 20 && counts[4] == 0; i++) {
+        mosquitto_loop(mosq, 100, 1);
+    }
+
+    XCTAssertEqual(1, counts[0]);
+    XCTAssertEqual(1, counts[1]);
+    XCTAssertEqual(1, counts[2]);
+    XCTAssertEqual(1, counts[3]);
+    mosquitto_disconnect(mosq);
+    mosquitto_loop(mosq, 100, 1);
+    mosquitto_destroy(mosq);
+    close(listener);
+}
+
+- (void)testTopicMatchesSubEquivalence
+{
+    char sub[16], topicName[16];
+    bool result;
+
+    // short strings over a small alphabet, so that runs of slashes and
+    // wildcards in odd places come up often
+    for (int i = 0; i < 1000000; i++) {
+        randomTopic(sub, "ab/+#/");
+        randomTopic(topicName, (i % 2) ? "ab/" : "ab/+#");
+        if (!sub[0] && !topicName[0]) {
+            continue;
+        }
+        XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_topic_matches_sub2(sub, strlen(sub), topicName, strlen(topicName), &result));
+        if (result != referenceTopicMatchesSub(sub, topicName)) {
+            XCTFail(@"sub '%s' topic '%s': got %d", sub, topicName, result);
+            break;
+        }
+    }
+
+    // explicit lengths do not need zero terminated strings
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_topic_matches_sub2("a/+/c", 5, "a//b/c/d", 6, &result));
+    XCTAssertTrue(result);
+}
+
+- (void)testTopicMatchesSubPerformance
+{
+    const char *subs[] = {"sensors/+/temperature", "sensors/#", "home/kitchen/+/state", "a/b/c/d/e/f", "+/+/+/+"};
+    const char *topicName = "sensors/device-1234/temperature";
+
+    [self measureBlock:^{
+        bool result;
+        for (int i = 0; i < 1000000; i++) {
+            mosquitto_topic_matches_sub(subs[i % 5], topicName, &result);
+        }
+    }];
+}
+
+- (void)testTokeniseViewEquivalence
+{
+    const char *topics[] = {"", "/", "//", "a", "/a", "a/", "/a/", "a//b", "//a//b//", "/a/deep//topic/",
+                            "$SYS", "$SYS/", "$SYS/broker/clients/total", "/$SYS/broker", "+/#", "a/+/b/#"};
+    int explicitCount = sizeof(topics) / sizeof(topics[0]);
+    struct mosquitto_topic_level levels[16];
+    char random[16];
+    char **tokens;
+    int count, viewCount;
+
+    // the cases above, then short random strings with runs of slashes
+    for (int i = 0; i < explicitCount + 100000; i++) {
+        const char *subtopic = random;
+        if (i < explicitCount) {
+            subtopic = topics[i];
+        } else {
+            randomTopic(random, "a/$");
+        }
+        XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_sub_topic_tokenise(subtopic, &tokens, &count));
+        if (mosquitto_sub_topic_tokenise_view(subtopic, levels, 16, &viewCount) != MOSQ_ERR_SUCCESS
+            || viewCount != count || !levelsMatchTokens(subtopic, levels, tokens, count)) {
+            XCTFail(@"'%s': %d levels, %d tokens", subtopic, viewCount, count);
+            mosquitto_sub_topic_tokens_free(&tokens, count);
+            break;
+        }
+
+        // one level short: the levels that fit are still filled in, and
+        // count says how many are needed
+        if (mosquitto_sub_topic_tokenise_view(subtopic, levels, count - 1, &viewCount) != MOSQ_ERR_NOMEM
+            || viewCount != count || !levelsMatchTokens(subtopic, levels, tokens, count - 1)) {
+            XCTFail(@"'%s' with %d levels: %d levels", subtopic, count - 1, viewCount);
+            mosquitto_sub_topic_tokens_free(&tokens, count);
+            break;
+        }
+        mosquitto_sub_topic_tokens_free(&tokens, count);
+    }
+
+    // no room at all, to ask for the size first
+    XCTAssertEqual(MOSQ_ERR_NOMEM, mosquitto_sub_topic_tokenise_view("$SYS/broker/uptime", NULL, 0, &viewCount));
+    XCTAssertEqual(3, viewCount);
+    XCTAssertEqual(MOSQ_ERR_INVAL, mosquitto_sub_topic_tokenise_view("a/b", NULL, 2, &viewCount));
+}
+
+- (void)testFilterSetMatch
+{
+    const char *filters[] = {"sensors/+/temperature", "sensors/#", "home/kitchen/+/state", "a/b/c/d/e/f", "+/+/+/+", "sensors", "a/#", "#", "$SYS/#"};
+    const char *topics[] = {"sensors/device-1234/temperature", "sensors", "home/kitchen/light/state", "a/b/c/d/e/f", "other/topic", "a", "$SYS/broker/uptime"};
+    struct mosquitto_filter_set *set;
+    unsigned char bitmap[2];
+    bool result;
+
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_filter_set_compile(&set, filters, 9));
+
+    for (int t = 0; t < 7; t++) {
+        XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_filter_set_match(set, topics[t], strlen(topics[t]), bitmap));
+        for (int f = 0; f < 9; f++) {
+            XCTAssertEqual(specTopicMatchesFilter(filters[f], topics[t]), (bool)((bitmap[f / 8] >> (f % 8)) & 1), @"%s against %s", topics[t], filters[f]);
+        }
+    }
+
+    // Where mosquitto_topic_matches_sub() differs from the specification.
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_filter_set_match(set, "a", 1, bitmap));
+    XCTAssertTrue((bitmap[0] >> 6) & 1);
+    mosquitto_topic_matches_sub("a/#", "a", &result);
+    XCTAssertFalse(result);
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_filter_set_match(set, "$SYS/broker/uptime", 18, bitmap));
+    XCTAssertFalse((bitmap[0] >> 7) & 1);
+    mosquitto_topic_matches_sub("#", "$SYS/broker/uptime", &result);
+    XCTAssertTrue(result);
+
+    mosquitto_filter_set_free(set);
+
+    const char *invalid[] = {"a/#/b"};
+    XCTAssertEqual(MOSQ_ERR_INVAL, mosquitto_filter_set_compile(&set, invalid, 1));
+}
+
+- (void)testFilterSetMatchEquivalence
+{
+    char filterBuffers[8][16], topicName[16];
+    const char *filters[8];
+    struct mosquitto_filter_set *set;
+    unsigned char bitmap[1];
+
+    for (int i = 0; i < 8; i++) {
+        filters[i] = filterBuffers[i];
+    }
+    for (int i = 0; i < 10000; i++) {
+        for (int f = 0; f < 8; f++) {
+            randomLevels(filterBuffers[f], true);
+        }
+        XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_filter_set_compile(&set, filters, 8));
+        for (int t = 0; t < 16; t++) {
+            randomLevels(topicName, false);
+            XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_filter_set_match(set, topicName, strlen(topicName), bitmap));
+            for (int f = 0; f < 8; f++) {
+                if (specTopicMatchesFilter(filters[f], topicName) != (bool)((bitmap[0] >> f) & 1)) {
+                    XCTFail(@"%s against %s", topicName, filters[f]);
+                }
+            }
+        }
+        mosquitto_filter_set_free(set);
+    }
+}
+
+// 1000 filters of the shape a broker bridge or rules engine might hold, and a
+// topic that matches a handful of them.
+static const char **performanceFilters(void)
+{
+    static char buffers[1000][48];
+    static const char *filters[1000];
+
+    for (int i = 0; i < 1000; i++) {
+        switch (i % 4) {
+            case 0: snprintf(buffers[i], sizeof(buffers[i]), "sensors/device-%d/temperature", i); break;
+            case 1: snprintf(buffers[i], sizeof(buffers[i]), "sensors/+/reading-%d", i); break;
+            case 2: snprintf(buffers[i], sizeof(buffers[i]), "home/room-%d/#", i); break;
+            default: snprintf(buffers[i], sizeof(buffers[i]), "+/device-%d/+", i); break;
+        }
+        filters[i] = buffers[i];
+    }
+    return filters;
+}
+
+- (void)testFilterSetMatchPerformance
+{
+    const char **filters = performanceFilters();
+    const char *topicName = "sensors/device-1234/temperature";
+    struct mosquitto_filter_set *set;
+    unsigned char bitmap[125];
+
+    XCTAssertEqual(MOSQ_ERR_SUCCESS, mosquitto_filter_set_compile(&set, filters, 1000));
+    [self measureBlock:^{
+        for (int i = 0; i < 10000; i++) {
+            mosquitto_filter_set_match(set, topicName, 31, bitmap);
+        }
+    }];
+    mosquitto_filter_set_free(set);
+}
+
+// The same matches as testFilterSetMatchPerformance, one filter at a time.
+- (void)testTopicMatchesSubOverFiltersPerformance
+{
+    const char **filters = performanceFilters();
+    const char *topicName = "sensors/device-1234/temperature";
+
+    [self measureBlock:^{
+        bool result;
+        for (int i = 0; i < 10000; i++) {
+            for (int f = 0; f < 1000; f++) {
+                mosquitto_topic_matches_sub(filters[f], topicName, &result);
+            }
+        }
+    }];
+}
+
 @end
@@ -0,0 +1,68 @@
+/*
+Copyright (c) 2013 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _ATOMIC_MOSQ_H_
+#define _ATOMIC_MOSQ_H_
+
+/* Atomic operations used by the lock free parts of the library.
+ *
+ * Loads have acquire semantics, stores have release semantics and
+ * read-modify-write operations are full barriers, which is all the outgoing
+ * packet queue needs. MOSQ_ATOMIC_CAS_U16(A, B, C) sets *A to C if it is
+ * equal to B, and evaluates to true on success.
+ *
+ * The _INT and _I64 variants are for int (or int sized enum) and int64_t
+ * fields that are read by one thread while another updates them, such as the
+ * client state and the last message times. MOSQ_ATOMIC_ADD_INT(A, B) adds B
+ * to *A. */
+
+#if defined(_MSC_VER)
+#  include <windows.h>
+#  define MOSQ_ATOMIC_LOAD_PTR(A) (*(void * volatile *)(A))
+#  define MOSQ_ATOMIC_STORE_PTR(A, B) InterlockedExchangePointer((PVOID volatile *)(A), (B))
+#  define MOSQ_ATOMIC_XCHG_PTR(A, B) InterlockedExchangePointer((PVOID volatile *)(A), (B))
+#  define MOSQ_ATOMIC_CAS_U16(A, B, C) (InterlockedCompareExchange16((SHORT volatile *)(A), (SHORT)(C), (SHORT)(B)) == (SHORT)(B))
+#  define MOSQ_ATOMIC_LOAD_INT(A) ((int)InterlockedCompareExchange((LONG volatile *)(A), 0, 0))
+#  define MOSQ_ATOMIC_STORE_INT(A, B) InterlockedExchange((LONG volatile *)(A), (LONG)(B))
+#  define MOSQ_ATOMIC_ADD_INT(A, B) InterlockedExchangeAdd((LONG volatile *)(A), (LONG)(B))
+#  define MOSQ_ATOMIC_LOAD_I64(A) InterlockedCompareExchange64((LONGLONG volatile *)(A), 0, 0)
+#  define MOSQ_ATOMIC_STORE_I64(A, B) InterlockedExchange64((LONGLONG volatile *)(A), (LONGLONG)(B))
+#else
+#  define MOSQ_ATOMIC_LOAD_PTR(A) __atomic_load_n((A), __ATOMIC_ACQUIRE)
+#  define MOSQ_ATOMIC_STORE_PTR(A, B) __atomic_store_n((A), (B), __ATOMIC_RELEASE)
+#  define MOSQ_ATOMIC_XCHG_PTR(A, B) __atomic_exchange_n((A), (B), __ATOMIC_ACQ_REL)
+#  define MOSQ_ATOMIC_CAS_U16(A, B, C) __sync_bool_compare_and_swap((A), (B), (C))
+#  define MOSQ_ATOMIC_LOAD_INT(A) __atomic_load_n((A), __ATOMIC_ACQUIRE)
+#  define MOSQ_ATOMIC_STORE_INT(A, B) __atomic_store_n((A), (B), __ATOMIC_RELEASE)
+#  define MOSQ_ATOMIC_ADD_INT(A, B) __atomic_add_fetch((A), (B), __ATOMIC_ACQ_REL)
+#  define MOSQ_ATOMIC_LOAD_I64(A) __atomic_load_n((A), __ATOMIC_ACQUIRE)
+#  define MOSQ_ATOMIC_STORE_I64(A, B) __atomic_store_n((A), (B), __ATOMIC_RELEASE)
+#endif
+
+#endif
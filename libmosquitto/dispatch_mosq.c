@@ -0,0 +1,266 @@
+/*
+Copyright (c) 2013 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <assert.h>
+#include <string.h>
+
+#include "mosquitto.h"
+#include "mosquitto_internal.h"
+#include "atomic_mosq.h"
+#include "dispatch_mosq.h"
+#include "memory_mosq.h"
+#include "messages_mosq.h"
+#include "route_mosq.h"
+#include "util_mosq.h"
+
+/* Run the application's callbacks for a received message: the
+ * per-subscription callbacks that match it, or on_message if there are none.
+ * This is the only place either is called from, whether on the network
+ * thread or a dispatch worker. */
+static void _mosquitto_message_callback(struct mosquitto *mosq, const struct mosquitto_message *message)
+{
+	void (*on_message)(struct mosquitto *, void *, const struct mosquitto_message *);
+
+	_mosquitto_callback_enter();
+	if(_mosquitto_route_message(mosq, message) == 0){
+		/* Workers run on_message concurrently, so callback_mutex is only
+		 * held long enough to read the callback. */
+		_mosquitto_mutex_lock(mosq, &mosq->callback_mutex);
+		on_message = mosq->on_message;
+		_mosquitto_mutex_unlock(mosq, &mosq->callback_mutex);
+		if(on_message){
+			on_message(mosq, mosq->userdata, message);
+		}
+	}
+	_mosquitto_callback_leave();
+}
+
+#ifdef WITH_THREADING
+/* One worker thread and its queue. Messages that hash to the same worker are
+ * delivered in the order they were received. */
+struct _mosquitto_dispatch_worker{
+	struct _mosquitto_dispatch *dispatch;
+	pthread_t thread_id;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct mosquitto_message_all *head;
+	struct mosquitto_message_all *tail;
+	unsigned int depth;
+	bool stop;
+};
+
+struct _mosquitto_dispatch{
+	struct mosquitto *mosq;
+	unsigned int (*key)(const struct mosquitto_message *, void *);
+	int worker_count;
+	struct _mosquitto_dispatch_worker workers[1];
+};
+
+static void *_mosquitto_dispatch_main(void *obj)
+{
+	struct _mosquitto_dispatch_worker *worker = obj;
+	struct mosquitto *mosq = worker->dispatch->mosq;
+	struct mosquitto_message_all *message;
+
+	while(1){
+		pthread_mutex_lock(&worker->mutex);
+		while(!worker->head && !worker->stop){
+			pthread_cond_wait(&worker->cond, &worker->mutex);
+		}
+		message = worker->head;
+		if(!message){
+			/* Stopping, and everything queued has been delivered. */
+			pthread_mutex_unlock(&worker->mutex);
+			return NULL;
+		}
+		worker->head = message->next;
+		if(!worker->head) worker->tail = NULL;
+		worker->depth--;
+		pthread_mutex_unlock(&worker->mutex);
+
+		_mosquitto_message_callback(mosq, &message->msg);
+		_mosquitto_message_cleanup(&message);
+	}
+	return NULL;
+}
+
+/* FNV-1a */
+static unsigned int _mosquitto_dispatch_hash(const char *str)
+{
+	unsigned int hash = 2166136261U;
+
+	while(*str){
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static void _mosquitto_dispatch_free(struct _mosquitto_dispatch *dispatch)
+{
+	struct _mosquitto_dispatch_worker *worker;
+	int i;
+
+	for(i=0; i<dispatch->worker_count; i++){
+		worker = &dispatch->workers[i];
+		pthread_mutex_lock(&worker->mutex);
+		worker->stop = true;
+		pthread_cond_signal(&worker->cond);
+		pthread_mutex_unlock(&worker->mutex);
+	}
+	for(i=0; i<dispatch->worker_count; i++){
+		worker = &dispatch->workers[i];
+		pthread_join(worker->thread_id, NULL);
+		pthread_cond_destroy(&worker->cond);
+		pthread_mutex_destroy(&worker->mutex);
+	}
+	_mosquitto_free(dispatch);
+}
+#endif
+
+int mosquitto_dispatch_start(struct mosquitto *mosq, int workers, unsigned int (*key)(const struct mosquitto_message *, void *))
+{
+#ifdef WITH_THREADING
+	struct _mosquitto_dispatch *dispatch;
+	struct _mosquitto_dispatch_worker *worker;
+	int i;
+
+	if(!mosq || workers < 1 || workers > MOSQ_DISPATCH_WORKERS_MAX) return MOSQ_ERR_INVAL;
+	if(mosq->dispatch || mosq->single_threaded) return MOSQ_ERR_INVAL;
+
+	dispatch = _mosquitto_calloc(1, sizeof(struct _mosquitto_dispatch) + (workers-1)*sizeof(struct _mosquitto_dispatch_worker));
+	if(!dispatch) return MOSQ_ERR_NOMEM;
+	dispatch->mosq = mosq;
+	dispatch->key = key;
+
+	for(i=0; i<workers; i++){
+		worker = &dispatch->workers[i];
+		worker->dispatch = dispatch;
+		pthread_mutex_init(&worker->mutex, NULL);
+		pthread_cond_init(&worker->cond, NULL);
+		if(pthread_create(&worker->thread_id, NULL, _mosquitto_dispatch_main, worker)){
+			pthread_cond_destroy(&worker->cond);
+			pthread_mutex_destroy(&worker->mutex);
+			_mosquitto_dispatch_free(dispatch);
+			return MOSQ_ERR_ERRNO;
+		}
+		dispatch->worker_count++;
+	}
+
+	mosq->dispatch = dispatch;
+	return MOSQ_ERR_SUCCESS;
+#else
+	return MOSQ_ERR_NOT_SUPPORTED;
+#endif
+}
+
+int mosquitto_dispatch_stop(struct mosquitto *mosq)
+{
+#ifdef WITH_THREADING
+	struct _mosquitto_dispatch *dispatch;
+
+	if(!mosq) return MOSQ_ERR_INVAL;
+	if(!mosq->dispatch) return MOSQ_ERR_SUCCESS;
+
+	dispatch = mosq->dispatch;
+	mosq->dispatch = NULL;
+	/* Workers deliver everything already queued before they exit. */
+	_mosquitto_dispatch_free(dispatch);
+	return MOSQ_ERR_SUCCESS;
+#else
+	return MOSQ_ERR_NOT_SUPPORTED;
+#endif
+}
+
+int mosquitto_dispatch_queue_depths(struct mosquitto *mosq, unsigned int *depths, int count)
+{
+#ifdef WITH_THREADING
+	struct _mosquitto_dispatch *dispatch;
+	struct _mosquitto_dispatch_worker *worker;
+	int i;
+
+	if(!mosq || (count > 0 && !depths)) return -1;
+
+	dispatch = mosq->dispatch;
+	if(!dispatch) return 0;
+
+	for(i=0; i<count && i<dispatch->worker_count; i++){
+		worker = &dispatch->workers[i];
+		pthread_mutex_lock(&worker->mutex);
+		depths[i] = worker->depth;
+		pthread_mutex_unlock(&worker->mutex);
+	}
+	return dispatch->worker_count;
+#else
+	return 0;
+#endif
+}
+
+/* Pass a received message to the application, either directly or through
+ * the dispatch pool. Takes ownership of message. */
+void _mosquitto_message_deliver(struct mosquitto *mosq, struct mosquitto_message_all *message)
+{
+#ifdef WITH_THREADING
+	struct _mosquitto_dispatch *dispatch = mosq->dispatch;
+	struct _mosquitto_dispatch_worker *worker;
+	unsigned int hash;
+
+	if(dispatch){
+		if(dispatch->key){
+			hash = dispatch->key(&message->msg, mosq->userdata);
+		}else{
+			hash = _mosquitto_dispatch_hash(message->msg.topic);
+		}
+		worker = &dispatch->workers[hash % dispatch->worker_count];
+
+		message->next = NULL;
+		pthread_mutex_lock(&worker->mutex);
+		if(worker->tail){
+			worker->tail->next = message;
+		}else{
+			worker->head = message;
+		}
+		worker->tail = message;
+		worker->depth++;
+		pthread_cond_signal(&worker->cond);
+		pthread_mutex_unlock(&worker->mutex);
+		return;
+	}
+#endif
+
+	_mosquitto_message_callback(mosq, &message->msg);
+	_mosquitto_message_cleanup(&message);
+}
+
+void _mosquitto_dispatch_cleanup(struct mosquitto *mosq)
+{
+#ifdef WITH_THREADING
+	mosquitto_dispatch_stop(mosq);
+#endif
+}
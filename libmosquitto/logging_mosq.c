@@ -33,6 +33,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "mosquitto_internal.h"
 #include "mosquitto.h"
+#include "atomic_mosq.h"
 #include "memory_mosq.h"
 
 int _mosquitto_log_printf(struct mosquitto *mosq, int priority, const char *fmt, ...)
@@ -44,12 +45,16 @@ int _mosquitto_log_printf(struct mosquitto *mosq, int priority, const char *fmt,
 	assert(mosq);
 	assert(fmt);
 
-	pthread_mutex_lock(&mosq->log_callback_mutex);
+	/* Most clients have no log callback, so avoid taking the lock for every
+	 * packet sent and received. on_log is only changed with the lock held. */
+	if(!MOSQ_ATOMIC_LOAD_PTR(&mosq->on_log)) return MOSQ_ERR_SUCCESS;
+
+	_mosquitto_mutex_lock(mosq, &mosq->log_callback_mutex);
 	if(mosq->on_log){
 		len = strlen(fmt) + 500;
 		s = _mosquitto_malloc(len*sizeof(char));
 		if(!s){
-			pthread_mutex_unlock(&mosq->log_callback_mutex);
+			_mosquitto_mutex_unlock(mosq, &mosq->log_callback_mutex);
 			return MOSQ_ERR_NOMEM;
 		}
 
@@ -62,7 +67,7 @@ int _mosquitto_log_printf(struct mosquitto *mosq, int priority, const char *fmt,
 
 		_mosquitto_free(s);
 	}
-	pthread_mutex_unlock(&mosq->log_callback_mutex);
+	_mosquitto_mutex_unlock(mosq, &mosq->log_callback_mutex);
 
 	return MOSQ_ERR_SUCCESS;
 }
@@ -28,11 +28,14 @@ POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "mosquitto_internal.h"
 #include "mosquitto.h"
+#include "atomic_mosq.h"
+#include "logging_mosq.h"
 #include "memory_mosq.h"
 #include "messages_mosq.h"
 #include "send_mosq.h"
@@ -114,6 +117,112 @@ void mosquitto_message_free(struct mosquitto_message **message)
 	_mosquitto_free(msg);
 }
 
+static bool _mosquitto_message_expired(struct mosquitto_message_all *message, int64_t now)
+{
+	return message->direction == mosq_md_out && message->expiry && message->expiry <= now;
+}
+
+/* When _mosquitto_message_retry_check() next needs to look at message, or -1
+ * if it never does in the message's current state. */
+static int64_t _mosquitto_message_deadline(struct mosquitto *mosq, struct mosquitto_message_all *message)
+{
+	int64_t deadline = -1;
+
+	switch(message->state){
+		case mosq_ms_wait_for_puback:
+		case mosq_ms_wait_for_pubrec:
+		case mosq_ms_wait_for_pubrel:
+		case mosq_ms_wait_for_pubcomp:
+			/* A retry interval of 0 resends on every check, which used to
+			 * happen once a second. Keep it that way rather than spin. */
+			deadline = message->timestamp + (mosq->message_retry ? mosq->message_retry : 1000);
+			break;
+		default:
+			break;
+	}
+	if(message->direction == mosq_md_out && message->expiry
+			&& (message->state == mosq_ms_invalid || message->state == mosq_ms_wait_for_puback)){
+
+		if(deadline < 0 || message->expiry < deadline){
+			deadline = message->expiry;
+		}
+	}
+	return deadline;
+}
+
+void _mosquitto_message_deadline_update(struct mosquitto *mosq, struct mosquitto_message_all *message)
+{
+	/* mosq->message_mutex should be locked before entering this function */
+	int64_t deadline;
+	int64_t next_retry_check;
+
+	deadline = _mosquitto_message_deadline(mosq, message);
+	if(deadline < 0) return;
+
+	next_retry_check = MOSQ_ATOMIC_LOAD_I64(&mosq->next_retry_check);
+	if(next_retry_check < 0 || deadline < next_retry_check){
+		MOSQ_ATOMIC_STORE_I64(&mosq->next_retry_check, deadline);
+	}
+}
+
+static struct mosquitto_message_all *_mosquitto_message_expire(struct mosquitto *mosq, struct mosquitto_message_all *prev, struct mosquitto_message_all *message)
+{
+	/* mosq->message_mutex should be locked before entering this function.
+	 * Unlinks and frees message, returning the message that followed it. The
+	 * caller is responsible for queue_len and inflight_messages. */
+	struct mosquitto_message_all *next;
+
+	next = message->next;
+	if(prev){
+		prev->next = next;
+	}else{
+		mosq->messages = next;
+	}
+	if(mosq->messages_last == message){
+		mosq->messages_last = prev;
+	}
+	mosq->messages_expired++;
+	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s dropping expired message (Mid: %d)", mosq->id, message->msg.mid);
+	_mosquitto_message_cleanup(&message);
+	return next;
+}
+
+static int _mosquitto_messages_promote(struct mosquitto *mosq, int64_t now)
+{
+	/* mosq->message_mutex should be locked before entering this function */
+	struct mosquitto_message_all *cur, *prev = NULL;
+	int rc;
+
+	cur = mosq->messages;
+	while(cur){
+		if(mosq->max_inflight_messages == 0 || mosq->inflight_messages < mosq->max_inflight_messages){
+			if(cur->msg.qos > 0 && cur->state == mosq_ms_invalid && cur->direction == mosq_md_out){
+				if(_mosquitto_message_expired(cur, now)){
+					mosq->queue_len--;
+					cur = _mosquitto_message_expire(mosq, prev, cur);
+					continue;
+				}
+				mosq->inflight_messages++;
+				if(cur->msg.qos == 1){
+					cur->state = mosq_ms_wait_for_puback;
+				}else if(cur->msg.qos == 2){
+					cur->state = mosq_ms_wait_for_pubrec;
+				}
+				_mosquitto_message_deadline_update(mosq, cur);
+				rc = _mosquitto_send_publish(mosq, cur->msg.mid, cur->msg.topic, cur->msg.payloadlen, cur->msg.payload, cur->msg.qos, cur->msg.retain, cur->dup);
+				if(rc){
+					return rc;
+				}
+			}
+		}else{
+			return MOSQ_ERR_SUCCESS;
+		}
+		prev = cur;
+		cur = cur->next;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
 void _mosquitto_message_queue(struct mosquitto *mosq, struct mosquitto_message_all *message, bool doinc)
 {
 	/* mosq->message_mutex should be locked before entering this function */
@@ -131,21 +240,33 @@ void _mosquitto_message_queue(struct mosquitto *mosq, struct mosquitto_message_a
 		mosq->messages = message;
 	}
 	mosq->messages_last = message;
+	_mosquitto_message_deadline_update(mosq, message);
 }
 
 void _mosquitto_messages_reconnect_reset(struct mosquitto *mosq)
 {
 	struct mosquitto_message_all *message;
 	struct mosquitto_message_all *prev = NULL;
+	int64_t now = mosquitto_time_ms();
 	assert(mosq);
 
-	pthread_mutex_lock(&mosq->message_mutex);
+	_mosquitto_mutex_lock(mosq, &mosq->message_mutex);
 	mosq->queue_len = 0;
 	mosq->inflight_messages = 0;
 	message = mosq->messages;
 	while(message){
 		message->timestamp = 0;
 		if(message->direction == mosq_md_out){
+			if(_mosquitto_message_expired(message, now)
+					&& (message->state == mosq_ms_invalid
+						|| message->state == mosq_ms_wait_for_puback
+						|| (message->state == mosq_ms_wait_for_pubrec && mosq->clean_session))){
+
+				/* With a clean session the broker has no record of a QoS 2
+				 * message that hasn't been acknowledged, so it is safe to drop. */
+				message = _mosquitto_message_expire(mosq, prev, message);
+				continue;
+			}
 			mosq->queue_len++;
 			if(message->msg.qos > 0){
 				mosq->inflight_messages++;
@@ -179,7 +300,9 @@ void _mosquitto_messages_reconnect_reset(struct mosquitto *mosq)
 		message = message->next;
 	}
 	mosq->messages_last = prev;
-	pthread_mutex_unlock(&mosq->message_mutex);
+	/* Every timestamp has been reset, so look at the whole list again. */
+	MOSQ_ATOMIC_STORE_I64(&mosq->next_retry_check, mosq->messages ? 0 : -1);
+	_mosquitto_mutex_unlock(mosq, &mosq->message_mutex);
 }
 
 int _mosquitto_message_remove(struct mosquitto *mosq, uint16_t mid, enum mosquitto_msg_direction dir, struct mosquitto_message_all **message)
@@ -190,7 +313,7 @@ int _mosquitto_message_remove(struct mosquitto *mosq, uint16_t mid, enum mosquit
 	assert(mosq);
 	assert(message);
 
-	pthread_mutex_lock(&mosq->message_mutex);
+	_mosquitto_mutex_lock(mosq, &mosq->message_mutex);
 	cur = mosq->messages;
 	while(cur){
 		if(cur->msg.mid == mid && cur->direction == dir){
@@ -217,32 +340,11 @@ int _mosquitto_message_remove(struct mosquitto *mosq, uint16_t mid, enum mosquit
 	}
 
 	if(found){
-		cur = mosq->messages;
-		while(cur){
-			if(mosq->max_inflight_messages == 0 || mosq->inflight_messages < mosq->max_inflight_messages){
-				if(cur->msg.qos > 0 && cur->state == mosq_ms_invalid && cur->direction == mosq_md_out){
-					mosq->inflight_messages++;
-					if(cur->msg.qos == 1){
-						cur->state = mosq_ms_wait_for_puback;
-					}else if(cur->msg.qos == 2){
-						cur->state = mosq_ms_wait_for_pubrec;
-					}
-					rc = _mosquitto_send_publish(mosq, cur->msg.mid, cur->msg.topic, cur->msg.payloadlen, cur->msg.payload, cur->msg.qos, cur->msg.retain, cur->dup);
-					if(rc){
-						pthread_mutex_unlock(&mosq->message_mutex);
-						return rc;
-					}
-				}
-			}else{
-				pthread_mutex_unlock(&mosq->message_mutex);
-				return MOSQ_ERR_SUCCESS;
-			}
-			cur = cur->next;
-		}
-		pthread_mutex_unlock(&mosq->message_mutex);
-		return MOSQ_ERR_SUCCESS;
+		rc = _mosquitto_messages_promote(mosq, mosquitto_time_ms());
+		_mosquitto_mutex_unlock(mosq, &mosq->message_mutex);
+		return rc;
 	}else{
-		pthread_mutex_unlock(&mosq->message_mutex);
+		_mosquitto_mutex_unlock(mosq, &mosq->message_mutex);
 		return MOSQ_ERR_NOT_FOUND;
 	}
 }
@@ -250,13 +352,28 @@ int _mosquitto_message_remove(struct mosquitto *mosq, uint16_t mid, enum mosquit
 void _mosquitto_message_retry_check(struct mosquitto *mosq)
 {
 	struct mosquitto_message_all *message;
-	time_t now = mosquitto_time();
+	struct mosquitto_message_all *prev = NULL;
+	int64_t now = mosquitto_time_ms();
+	int64_t deadline;
+	int64_t next_retry_check = -1;
+	bool expired = false;
 	assert(mosq);
 
-	pthread_mutex_lock(&mosq->message_mutex);
+	_mosquitto_mutex_lock(mosq, &mosq->message_mutex);
 	message = mosq->messages;
 	while(message){
-		if(message->timestamp + mosq->message_retry < now){
+		if(_mosquitto_message_expired(message, now)
+				&& (message->state == mosq_ms_invalid || message->state == mosq_ms_wait_for_puback)){
+
+			mosq->queue_len--;
+			if(message->state != mosq_ms_invalid){
+				mosq->inflight_messages--;
+			}
+			message = _mosquitto_message_expire(mosq, prev, message);
+			expired = true;
+			continue;
+		}
+		if(now - message->timestamp >= mosq->message_retry){
 			switch(message->state){
 				case mosq_ms_wait_for_puback:
 				case mosq_ms_wait_for_pubrec:
@@ -278,15 +395,56 @@ void _mosquitto_message_retry_check(struct mosquitto *mosq)
 					break;
 			}
 		}
+		deadline = _mosquitto_message_deadline(mosq, message);
+		if(deadline >= 0 && (next_retry_check < 0 || deadline < next_retry_check)){
+			next_retry_check = deadline;
+		}
+		prev = message;
 		message = message->next;
 	}
-	pthread_mutex_unlock(&mosq->message_mutex);
+	MOSQ_ATOMIC_STORE_I64(&mosq->next_retry_check, next_retry_check);
+	if(expired){
+		/* Dropping in flight messages may have freed up space for queued ones. */
+		_mosquitto_messages_promote(mosq, now);
+	}
+	_mosquitto_mutex_unlock(mosq, &mosq->message_mutex);
 }
 
 void mosquitto_message_retry_set(struct mosquitto *mosq, unsigned int message_retry)
 {
 	assert(mosq);
-	if(mosq) mosq->message_retry = message_retry;
+	if(mosq){
+		/* Anything longer can't be held in milliseconds. */
+		if(message_retry > UINT_MAX/1000) message_retry = UINT_MAX/1000;
+		_mosquitto_mutex_lock(mosq, &mosq->message_mutex);
+		mosq->message_retry = message_retry*1000;
+		MOSQ_ATOMIC_STORE_I64(&mosq->next_retry_check, 0);
+		_mosquitto_mutex_unlock(mosq, &mosq->message_mutex);
+	}
+}
+
+void mosquitto_message_retry_ms_set(struct mosquitto *mosq, unsigned int message_retry_ms)
+{
+	assert(mosq);
+	if(mosq){
+		_mosquitto_mutex_lock(mosq, &mosq->message_mutex);
+		mosq->message_retry = message_retry_ms;
+		MOSQ_ATOMIC_STORE_I64(&mosq->next_retry_check, 0);
+		_mosquitto_mutex_unlock(mosq, &mosq->message_mutex);
+	}
+}
+
+unsigned long mosquitto_message_expired_count(struct mosquitto *mosq)
+{
+	unsigned long count;
+
+	if(!mosq) return 0;
+
+	_mosquitto_mutex_lock(mosq, &mosq->message_mutex);
+	count = mosq->messages_expired;
+	_mosquitto_mutex_unlock(mosq, &mosq->message_mutex);
+
+	return count;
 }
 
 int _mosquitto_message_update(struct mosquitto *mosq, uint16_t mid, enum mosquitto_msg_direction dir, enum mosquitto_msg_state state)
@@ -294,18 +452,19 @@ int _mosquitto_message_update(struct mosquitto *mosq, uint16_t mid, enum mosquit
 	struct mosquitto_message_all *message;
 	assert(mosq);
 
-	pthread_mutex_lock(&mosq->message_mutex);
+	_mosquitto_mutex_lock(mosq, &mosq->message_mutex);
 	message = mosq->messages;
 	while(message){
 		if(message->msg.mid == mid && message->direction == dir){
 			message->state = state;
-			message->timestamp = mosquitto_time();
-			pthread_mutex_unlock(&mosq->message_mutex);
+			message->timestamp = mosquitto_time_ms();
+			_mosquitto_message_deadline_update(mosq, message);
+			_mosquitto_mutex_unlock(mosq, &mosq->message_mutex);
 			return MOSQ_ERR_SUCCESS;
 		}
 		message = message->next;
 	}
-	pthread_mutex_unlock(&mosq->message_mutex);
+	_mosquitto_mutex_unlock(mosq, &mosq->message_mutex);
 	return MOSQ_ERR_NOT_FOUND;
 }
 
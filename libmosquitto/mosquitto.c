@@ -29,6 +29,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
@@ -44,13 +45,17 @@ typedef int ssize_t;
 
 #include "mosquitto.h"
 #include "mosquitto_internal.h"
+#include "atomic_mosq.h"
+#include "dispatch_mosq.h"
 #include "logging_mosq.h"
 #include "messages_mosq.h"
 #include "memory_mosq.h"
 #include "mqtt3_protocol.h"
 #include "net_mosq.h"
 #include "read_handle.h"
+#include "route_mosq.h"
 #include "send_mosq.h"
+#include "session_mosq.h"
 #include "time_mosq.h"
 #include "tls_mosq.h"
 #include "util_mosq.h"
@@ -63,6 +68,7 @@ typedef int ssize_t;
 void _mosquitto_destroy(struct mosquitto *mosq);
 static int _mosquitto_reconnect(struct mosquitto *mosq, bool blocking);
 static int _mosquitto_connect_init(struct mosquitto *mosq, const char *host, int port, int keepalive, const char *bind_address);
+static int _mosquitto_loop_rc_handle(struct mosquitto *mosq, int rc);
 
 int mosquitto_lib_version(int *major, int *minor, int *revision)
 {
@@ -96,6 +102,11 @@ int mosquitto_lib_cleanup(void)
 }
 
 struct mosquitto *mosquitto_new(const char *id, bool clean_session, void *userdata)
+{
+	return mosquitto_new_flags(id, clean_session, userdata, 0);
+}
+
+struct mosquitto *mosquitto_new_flags(const char *id, bool clean_session, void *userdata, int flags)
 {
 	struct mosquitto *mosq = NULL;
 	int rc;
@@ -112,6 +123,7 @@ struct mosquitto *mosquitto_new(const char *id, bool clean_session, void *userda
 	mosq = (struct mosquitto *)_mosquitto_calloc(1, sizeof(struct mosquitto));
 	if(mosq){
 		mosq->sock = INVALID_SOCKET;
+		mosq->single_threaded = (flags & MOSQ_NEW_SINGLE_THREADED) != 0;
 #ifdef WITH_THREADING
 		mosq->thread_id = pthread_self();
 #endif
@@ -133,6 +145,7 @@ struct mosquitto *mosquitto_new(const char *id, bool clean_session, void *userda
 
 int mosquitto_reinitialise(struct mosquitto *mosq, const char *id, bool clean_session, void *userdata)
 {
+	bool single_threaded;
 	int i;
 
 	if(!mosq) return MOSQ_ERR_INVAL;
@@ -142,7 +155,9 @@ int mosquitto_reinitialise(struct mosquitto *mosq, const char *id, bool clean_se
 	}
 
 	_mosquitto_destroy(mosq);
+	single_threaded = mosq->single_threaded;
 	memset(mosq, 0, sizeof(struct mosquitto));
+	mosq->single_threaded = single_threaded;
 
 	if(userdata){
 		mosq->userdata = userdata;
@@ -150,9 +165,12 @@ int mosquitto_reinitialise(struct mosquitto *mosq, const char *id, bool clean_se
 		mosq->userdata = mosq;
 	}
 	mosq->sock = INVALID_SOCKET;
+	mosq->sockpairR = INVALID_SOCKET;
+	mosq->sockpairW = INVALID_SOCKET;
 	mosq->keepalive = 60;
-	mosq->message_retry = 20;
-	mosq->last_retry_check = 0;
+	mosq->connect_attempt_delay = 250;
+	mosq->message_retry = 20000;
+	mosq->next_retry_check = -1;
 	mosq->clean_session = clean_session;
 	if(id){
 		if(strlen(id) == 0){
@@ -174,12 +192,16 @@ int mosquitto_reinitialise(struct mosquitto *mosq, const char *id, bool clean_se
 			mosq->id[i] = (rand()%73)+48;
 		}
 	}
+	if(_mosquitto_socketpair(&mosq->sockpairR, &mosq->sockpairW)){
+		_mosquitto_log_printf(mosq, MOSQ_LOG_WARNING,
+				"Warning: Unable to open socket pair, outgoing publish commands may be delayed.");
+	}
 	mosq->in_packet.payload = NULL;
 	_mosquitto_packet_cleanup(&mosq->in_packet);
-	mosq->out_packet = NULL;
+	_mosquitto_packet_queue_init(mosq);
 	mosq->current_out_packet = NULL;
-	mosq->last_msg_in = mosquitto_time();
-	mosq->last_msg_out = mosquitto_time();
+	mosq->last_msg_in = mosquitto_time_ms();
+	mosq->last_msg_out = mosquitto_time_ms();
 	mosq->ping_t = 0;
 	mosq->last_mid = 0;
 	mosq->state = mosq_cs_new;
@@ -191,27 +213,36 @@ int mosquitto_reinitialise(struct mosquitto *mosq, const char *id, bool clean_se
 	mosq->on_message = NULL;
 	mosq->on_subscribe = NULL;
 	mosq->on_unsubscribe = NULL;
+	mosq->on_reconnect = NULL;
+	mosq->on_interest = NULL;
+	mosq->interest_sock = INVALID_SOCKET;
+	mosq->interest_write = false;
 	mosq->host = NULL;
 	mosq->port = 1883;
-	mosq->in_callback = false;
 	mosq->queue_len = 0;
-	mosq->reconnect_delay = 1;
-	mosq->reconnect_delay_max = 1;
+	mosq->messages_expired = 0;
+	mosq->reconnect_delay = 1000;
+	mosq->reconnect_delay_max = 1000;
 	mosq->reconnect_exponential_backoff = false;
+	mosq->reconnect_attempts = 0;
+	/* Seeds differ per client so that clients in one process spread out
+	 * their reconnects too. */
+	mosq->reconnect_rand = (uint32_t)mosquitto_time_ms() ^ (uint32_t)(uintptr_t)mosq;
+	if(mosq->reconnect_rand == 0) mosq->reconnect_rand = 1;
 	mosq->threaded = false;
 #ifdef WITH_TLS
 	mosq->ssl = NULL;
 	mosq->tls_cert_reqs = SSL_VERIFY_PEER;
 	mosq->tls_insecure = false;
+	mosq->tls_ktls = false;
 #endif
 #ifdef WITH_THREADING
 	pthread_mutex_init(&mosq->callback_mutex, NULL);
 	pthread_mutex_init(&mosq->log_callback_mutex, NULL);
-	pthread_mutex_init(&mosq->state_mutex, NULL);
-	pthread_mutex_init(&mosq->out_packet_mutex, NULL);
 	pthread_mutex_init(&mosq->current_out_packet_mutex, NULL);
-	pthread_mutex_init(&mosq->msgtime_mutex, NULL);
 	pthread_mutex_init(&mosq->message_mutex, NULL);
+	pthread_mutex_init(&mosq->interest_mutex, NULL);
+	pthread_mutex_init(&mosq->route_mutex, NULL);
 	mosq->thread_id = pthread_self();
 #endif
 
@@ -259,11 +290,28 @@ int mosquitto_username_pw_set(struct mosquitto *mosq, const char *username, cons
 }
 
 int mosquitto_reconnect_delay_set(struct mosquitto *mosq, unsigned int reconnect_delay, unsigned int reconnect_delay_max, bool reconnect_exponential_backoff)
+{
+	if(!mosq) return MOSQ_ERR_INVAL;
+	if(reconnect_delay > UINT_MAX/1000 || reconnect_delay_max > UINT_MAX/1000) return MOSQ_ERR_INVAL;
+
+	return mosquitto_reconnect_delay_ms_set(mosq, reconnect_delay*1000, reconnect_delay_max*1000, reconnect_exponential_backoff);
+}
+
+int mosquitto_connect_attempt_delay_set(struct mosquitto *mosq, unsigned int attempt_delay_ms)
+{
+	if(!mosq) return MOSQ_ERR_INVAL;
+
+	mosq->connect_attempt_delay = attempt_delay_ms;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_reconnect_delay_ms_set(struct mosquitto *mosq, unsigned int reconnect_delay_ms, unsigned int reconnect_delay_max_ms, bool reconnect_exponential_backoff)
 {
 	if(!mosq) return MOSQ_ERR_INVAL;
 	
-	mosq->reconnect_delay = reconnect_delay;
-	mosq->reconnect_delay_max = reconnect_delay_max;
+	mosq->reconnect_delay = reconnect_delay_ms;
+	mosq->reconnect_delay_max = reconnect_delay_max_ms;
 	mosq->reconnect_exponential_backoff = reconnect_exponential_backoff;
 	
 	return MOSQ_ERR_SUCCESS;
@@ -272,14 +320,16 @@ int mosquitto_reconnect_delay_set(struct mosquitto *mosq, unsigned int reconnect
 
 void _mosquitto_destroy(struct mosquitto *mosq)
 {
-	struct _mosquitto_packet *packet;
 	if(!mosq) return;
 
 #ifdef WITH_THREADING
-	if(!pthread_equal(mosq->thread_id, pthread_self())){
-		pthread_cancel(mosq->thread_id);
-		pthread_join(mosq->thread_id, NULL);
+	if(mosq->threaded && !pthread_equal(mosq->thread_id, pthread_self())){
+		mosquitto_loop_stop(mosq, true);
 	}
+	_mosquitto_dispatch_cleanup(mosq);
+	/* Closing the socket below must not call back into an application that
+	 * is in the middle of destroying the client. */
+	mosq->on_interest = NULL;
 
 	if(mosq->id){
 		/* If mosq->id is not NULL then the client has already been initialised
@@ -287,25 +337,36 @@ void _mosquitto_destroy(struct mosquitto *mosq)
 		 * haven't been initialised. */
 		pthread_mutex_destroy(&mosq->callback_mutex);
 		pthread_mutex_destroy(&mosq->log_callback_mutex);
-		pthread_mutex_destroy(&mosq->state_mutex);
-		pthread_mutex_destroy(&mosq->out_packet_mutex);
 		pthread_mutex_destroy(&mosq->current_out_packet_mutex);
-		pthread_mutex_destroy(&mosq->msgtime_mutex);
 		pthread_mutex_destroy(&mosq->message_mutex);
+		pthread_mutex_destroy(&mosq->interest_mutex);
+		pthread_mutex_destroy(&mosq->route_mutex);
 	}
 #endif
 	if(mosq->sock != INVALID_SOCKET){
 		_mosquitto_socket_close(mosq);
 	}
+	if(mosq->id){
+		/* As with the mutexes, the socket pair only exists if the client has
+		 * been initialised. */
+		if(mosq->sockpairR != INVALID_SOCKET){
+			COMPAT_CLOSE(mosq->sockpairR);
+			mosq->sockpairR = INVALID_SOCKET;
+		}
+		if(mosq->sockpairW != INVALID_SOCKET){
+			COMPAT_CLOSE(mosq->sockpairW);
+			mosq->sockpairW = INVALID_SOCKET;
+		}
+	}
 	_mosquitto_message_cleanup_all(mosq);
+	_mosquitto_session_cleanup(mosq);
+	_mosquitto_route_cleanup(mosq);
 	_mosquitto_will_clear(mosq);
 #ifdef WITH_TLS
 	if(mosq->ssl){
 		SSL_free(mosq->ssl);
 	}
-	if(mosq->ssl_ctx){
-		SSL_CTX_free(mosq->ssl_ctx);
-	}
+	_mosquitto_ssl_ctx_release(mosq);
 	if(mosq->tls_cafile) _mosquitto_free(mosq->tls_cafile);
 	if(mosq->tls_capath) _mosquitto_free(mosq->tls_capath);
 	if(mosq->tls_certfile) _mosquitto_free(mosq->tls_certfile);
@@ -315,6 +376,10 @@ void _mosquitto_destroy(struct mosquitto *mosq)
 	if(mosq->tls_ciphers) _mosquitto_free(mosq->tls_ciphers);
 	if(mosq->tls_psk) _mosquitto_free(mosq->tls_psk);
 	if(mosq->tls_psk_identity) _mosquitto_free(mosq->tls_psk_identity);
+	if(mosq->tls_wbuf){
+		_mosquitto_free(mosq->tls_wbuf);
+		mosq->tls_wbuf = NULL;
+	}
 #endif
 
 	if(mosq->address){
@@ -343,21 +408,7 @@ void _mosquitto_destroy(struct mosquitto *mosq)
 	}
 
 	/* Out packet cleanup */
-	if(mosq->out_packet && !mosq->current_out_packet){
-		mosq->current_out_packet = mosq->out_packet;
-		mosq->out_packet = mosq->out_packet->next;
-	}
-	while(mosq->current_out_packet){
-		packet = mosq->current_out_packet;
-		/* Free data and reset values */
-		mosq->current_out_packet = mosq->out_packet;
-		if(mosq->out_packet){
-			mosq->out_packet = mosq->out_packet->next;
-		}
-
-		_mosquitto_packet_cleanup(packet);
-		_mosquitto_free(packet);
-	}
+	_mosquitto_packet_queue_clear(mosq);
 
 	_mosquitto_packet_cleanup(&mosq->in_packet);
 }
@@ -381,6 +432,12 @@ static int _mosquitto_connect_init(struct mosquitto *mosq, const char *host, int
 	if(!mosq) return MOSQ_ERR_INVAL;
 	if(!host || port <= 0) return MOSQ_ERR_INVAL;
 
+#ifdef WITH_TLS
+	/* A saved TLS session is only any use to the broker that issued it. */
+	if(!mosq->host || strcmp(mosq->host, host) || mosq->port != port){
+		_mosquitto_tls_session_clear(mosq);
+	}
+#endif
 	if(mosq->host) _mosquitto_free(mosq->host);
 	mosq->host = _mosquitto_strdup(host);
 	if(!mosq->host) return MOSQ_ERR_NOMEM;
@@ -408,9 +465,7 @@ int mosquitto_connect_bind(struct mosquitto *mosq, const char *host, int port, i
 	rc = _mosquitto_connect_init(mosq, host, port, keepalive, bind_address);
 	if(rc) return rc;
 
-	pthread_mutex_lock(&mosq->state_mutex);
-	mosq->state = mosq_cs_new;
-	pthread_mutex_unlock(&mosq->state_mutex);
+	MOSQ_ATOMIC_STORE_INT(&mosq->state, mosq_cs_new);
 
 	return _mosquitto_reconnect(mosq, true);
 }
@@ -425,9 +480,7 @@ int mosquitto_connect_bind_async(struct mosquitto *mosq, const char *host, int p
 	int rc = _mosquitto_connect_init(mosq, host, port, keepalive, bind_address);
 	if(rc) return rc;
 
-	pthread_mutex_lock(&mosq->state_mutex);
-	mosq->state = mosq_cs_connect_async;
-	pthread_mutex_unlock(&mosq->state_mutex);
+	MOSQ_ATOMIC_STORE_INT(&mosq->state, mosq_cs_connect_async);
 
 	return _mosquitto_reconnect(mosq, false);
 }
@@ -444,45 +497,27 @@ int mosquitto_reconnect(struct mosquitto *mosq)
 
 static int _mosquitto_reconnect(struct mosquitto *mosq, bool blocking)
 {
+	int64_t now;
 	int rc;
-	struct _mosquitto_packet *packet;
 	if(!mosq) return MOSQ_ERR_INVAL;
 	if(!mosq->host || mosq->port <= 0) return MOSQ_ERR_INVAL;
 
-	pthread_mutex_lock(&mosq->state_mutex);
-	mosq->state = mosq_cs_new;
-	pthread_mutex_unlock(&mosq->state_mutex);
+	MOSQ_ATOMIC_STORE_INT(&mosq->state, mosq_cs_new);
+
+	/* Drop a connection race that is still going from an earlier call. */
+	_mosquitto_connect_race_cancel(mosq);
 
-	pthread_mutex_lock(&mosq->msgtime_mutex);
-	mosq->last_msg_in = mosquitto_time();
-	mosq->last_msg_out = mosquitto_time();
-	pthread_mutex_unlock(&mosq->msgtime_mutex);
+	now = mosquitto_time_ms();
+	MOSQ_ATOMIC_STORE_I64(&mosq->last_msg_in, now);
+	MOSQ_ATOMIC_STORE_I64(&mosq->last_msg_out, now);
 
 	mosq->ping_t = 0;
 
 	_mosquitto_packet_cleanup(&mosq->in_packet);
 		
-	pthread_mutex_lock(&mosq->current_out_packet_mutex);
-	pthread_mutex_lock(&mosq->out_packet_mutex);
-
-	if(mosq->out_packet && !mosq->current_out_packet){
-		mosq->current_out_packet = mosq->out_packet;
-		mosq->out_packet = mosq->out_packet->next;
-	}
-
-	while(mosq->current_out_packet){
-		packet = mosq->current_out_packet;
-		/* Free data and reset values */
-		mosq->current_out_packet = mosq->out_packet;
-		if(mosq->out_packet){
-			mosq->out_packet = mosq->out_packet->next;
-		}
-
-		_mosquitto_packet_cleanup(packet);
-		_mosquitto_free(packet);
-	}
-	pthread_mutex_unlock(&mosq->out_packet_mutex);
-	pthread_mutex_unlock(&mosq->current_out_packet_mutex);
+	_mosquitto_mutex_lock(mosq, &mosq->current_out_packet_mutex);
+	_mosquitto_packet_queue_clear(mosq);
+	_mosquitto_mutex_unlock(mosq, &mosq->current_out_packet_mutex);
 
 	_mosquitto_messages_reconnect_reset(mosq);
 
@@ -491,16 +526,25 @@ static int _mosquitto_reconnect(struct mosquitto *mosq, bool blocking)
 		return rc;
 	}
 
-	return _mosquitto_send_connect(mosq, mosq->keepalive, mosq->clean_session);
+	rc = _mosquitto_send_connect(mosq, mosq->keepalive, mosq->clean_session);
+	if(rc || !mosq->pipeline) return rc;
+
+	return _mosquitto_session_resume(mosq);
 }
 
 int mosquitto_disconnect(struct mosquitto *mosq)
 {
+	bool connecting;
+
 	if(!mosq) return MOSQ_ERR_INVAL;
 
-	pthread_mutex_lock(&mosq->state_mutex);
-	mosq->state = mosq_cs_disconnecting;
-	pthread_mutex_unlock(&mosq->state_mutex);
+	connecting = MOSQ_ATOMIC_LOAD_PTR(&mosq->connect_race) != NULL;
+	MOSQ_ATOMIC_STORE_INT(&mosq->state, mosq_cs_disconnecting);
+	/* The network thread may be waiting to reconnect, or for a connection
+	 * attempt to finish. It gives up on the attempt when it sees the new
+	 * state, so there is nothing to send. */
+	_mosquitto_loop_wakeup(mosq);
+	if(connecting) return MOSQ_ERR_SUCCESS;
 
 	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
 	return _mosquitto_send_disconnect(mosq);
@@ -508,16 +552,73 @@ int mosquitto_disconnect(struct mosquitto *mosq)
 
 int mosquitto_publish(struct mosquitto *mosq, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain)
 {
-	struct mosquitto_message_all *message;
-	uint16_t local_mid;
+	return mosquitto_publish_ttl(mosq, mid, topic, payloadlen, payload, qos, retain, 0);
+}
+
+static int _mosquitto_publish_check(const char *topic, int payloadlen, int qos)
+{
+	size_t len;
 
-	if(!mosq || !topic || qos<0 || qos>2) return MOSQ_ERR_INVAL;
-	if(strlen(topic) == 0) return MOSQ_ERR_INVAL;
+	if(!topic || qos<0 || qos>2) return MOSQ_ERR_INVAL;
+	len = strlen(topic);
+	if(len == 0) return MOSQ_ERR_INVAL;
 	if(payloadlen < 0 || payloadlen > MQTT_MAX_PAYLOAD) return MOSQ_ERR_PAYLOAD_SIZE;
 
-	if(_mosquitto_topic_wildcard_len_check(topic) != MOSQ_ERR_SUCCESS){
+	if(_mosquitto_topic_check(topic, len, false) != MOSQ_ERR_SUCCESS){
 		return MOSQ_ERR_INVAL;
 	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static struct mosquitto_message_all *_mosquitto_publish_message_new(uint16_t mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain, unsigned int ttl)
+{
+	struct mosquitto_message_all *message;
+
+	message = _mosquitto_calloc(1, sizeof(struct mosquitto_message_all));
+	if(!message) return NULL;
+
+	message->next = NULL;
+	message->timestamp = mosquitto_time_ms();
+	if(ttl){
+		message->expiry = message->timestamp + (int64_t)ttl*1000;
+	}else{
+		message->expiry = 0;
+	}
+	message->direction = mosq_md_out;
+	message->msg.mid = mid;
+	message->msg.topic = _mosquitto_strdup(topic);
+	if(!message->msg.topic){
+		_mosquitto_message_cleanup(&message);
+		return NULL;
+	}
+	if(payloadlen){
+		message->msg.payloadlen = payloadlen;
+		message->msg.payload = _mosquitto_malloc(payloadlen*sizeof(uint8_t));
+		if(!message->msg.payload){
+			_mosquitto_message_cleanup(&message);
+			return NULL;
+		}
+		memcpy(message->msg.payload, payload, payloadlen*sizeof(uint8_t));
+	}else{
+		message->msg.payloadlen = 0;
+		message->msg.payload = NULL;
+	}
+	message->msg.qos = qos;
+	message->msg.retain = retain;
+	message->dup = false;
+
+	return message;
+}
+
+int mosquitto_publish_ttl(struct mosquitto *mosq, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain, unsigned int ttl)
+{
+	struct mosquitto_message_all *message;
+	uint16_t local_mid;
+	int rc;
+
+	if(!mosq) return MOSQ_ERR_INVAL;
+	rc = _mosquitto_publish_check(topic, payloadlen, qos);
+	if(rc) return rc;
 
 	local_mid = _mosquitto_mid_generate(mosq);
 	if(mid){
@@ -527,35 +628,10 @@ int mosquitto_publish(struct mosquitto *mosq, int *mid, const char *topic, int p
 	if(qos == 0){
 		return _mosquitto_send_publish(mosq, local_mid, topic, payloadlen, payload, qos, retain, false);
 	}else{
-		message = _mosquitto_calloc(1, sizeof(struct mosquitto_message_all));
+		message = _mosquitto_publish_message_new(local_mid, topic, payloadlen, payload, qos, retain, ttl);
 		if(!message) return MOSQ_ERR_NOMEM;
 
-		message->next = NULL;
-		message->timestamp = mosquitto_time();
-		message->direction = mosq_md_out;
-		message->msg.mid = local_mid;
-		message->msg.topic = _mosquitto_strdup(topic);
-		if(!message->msg.topic){
-			_mosquitto_message_cleanup(&message);
-			return MOSQ_ERR_NOMEM;
-		}
-		if(payloadlen){
-			message->msg.payloadlen = payloadlen;
-			message->msg.payload = _mosquitto_malloc(payloadlen*sizeof(uint8_t));
-			if(!message->msg.payload){
-				_mosquitto_message_cleanup(&message);
-				return MOSQ_ERR_NOMEM;
-			}
-			memcpy(message->msg.payload, payload, payloadlen*sizeof(uint8_t));
-		}else{
-			message->msg.payloadlen = 0;
-			message->msg.payload = NULL;
-		}
-		message->msg.qos = qos;
-		message->msg.retain = retain;
-		message->dup = false;
-
-		pthread_mutex_lock(&mosq->message_mutex);
+		_mosquitto_mutex_lock(mosq, &mosq->message_mutex);
 		_mosquitto_message_queue(mosq, message, false);
 		if(mosq->max_inflight_messages == 0 || mosq->inflight_messages < mosq->max_inflight_messages){
 			mosq->inflight_messages++;
@@ -564,30 +640,217 @@ int mosquitto_publish(struct mosquitto *mosq, int *mid, const char *topic, int p
 			}else if(qos == 2){
 				message->state = mosq_ms_wait_for_pubrec;
 			}
-			pthread_mutex_unlock(&mosq->message_mutex);
+			_mosquitto_message_deadline_update(mosq, message);
+			_mosquitto_mutex_unlock(mosq, &mosq->message_mutex);
 			return _mosquitto_send_publish(mosq, message->msg.mid, message->msg.topic, message->msg.payloadlen, message->msg.payload, message->msg.qos, message->msg.retain, message->dup);
 		}else{
 			message->state = mosq_ms_invalid;
-			pthread_mutex_unlock(&mosq->message_mutex);
+			_mosquitto_mutex_unlock(mosq, &mosq->message_mutex);
 			return MOSQ_ERR_SUCCESS;
 		}
 	}
 }
 
+int mosquitto_publish_batch(struct mosquitto *mosq, const struct mosquitto_publish_req *reqs, int n, int *mids)
+{
+	struct mosquitto_message_all **messages;
+	struct _mosquitto_packet **packets;
+	struct _mosquitto_packet *head = NULL, *tail = NULL;
+	const struct mosquitto_publish_req *req;
+	uint16_t local_mid;
+	bool connected;
+	int rc = MOSQ_ERR_SUCCESS;
+	int rc2;
+	int i;
+
+	if(!mosq || !reqs || n < 0) return MOSQ_ERR_INVAL;
+	if(n == 0) return MOSQ_ERR_SUCCESS;
+
+	/* Nothing is queued unless every request is valid. */
+	for(i=0; i<n; i++){
+		rc2 = _mosquitto_publish_check(reqs[i].topic, reqs[i].payloadlen, reqs[i].qos);
+		if(rc2) return rc2;
+	}
+
+	messages = _mosquitto_calloc(n, sizeof(struct mosquitto_message_all *));
+	packets = _mosquitto_calloc(n, sizeof(struct _mosquitto_packet *));
+	if(!messages || !packets){
+		if(messages) _mosquitto_free(messages);
+		if(packets) _mosquitto_free(packets);
+		return MOSQ_ERR_NOMEM;
+	}
+
+	/* QoS>0 messages must be copied for the message store. QoS 0 messages are
+	 * only ever sent once, so can be encoded straight away. */
+	connected = (mosq->sock != INVALID_SOCKET);
+	for(i=0; i<n; i++){
+		req = &reqs[i];
+		local_mid = _mosquitto_mid_generate(mosq);
+		if(mids){
+			mids[i] = local_mid;
+		}
+		if(req->qos > 0){
+			messages[i] = _mosquitto_publish_message_new(local_mid, req->topic, req->payloadlen, req->payload, req->qos, req->retain, 0);
+			if(!messages[i]){
+				rc = MOSQ_ERR_NOMEM;
+				break;
+			}
+		}else if(connected){
+			rc = _mosquitto_packet_publish_build(&packets[i], local_mid, req->topic, req->payloadlen, req->payload, 0, req->retain, false);
+			if(rc) break;
+		}
+	}
+	if(rc){
+		for(i=0; i<n; i++){
+			if(messages[i]) _mosquitto_message_cleanup(&messages[i]);
+			if(packets[i]){
+				_mosquitto_packet_cleanup(packets[i]);
+				_mosquitto_free(packets[i]);
+			}
+		}
+		_mosquitto_free(messages);
+		_mosquitto_free(packets);
+		return rc;
+	}
+
+	_mosquitto_mutex_lock(mosq, &mosq->message_mutex);
+	for(i=0; i<n; i++){
+		if(!messages[i]) continue;
+
+		_mosquitto_message_queue(mosq, messages[i], false);
+		if(mosq->max_inflight_messages == 0 || mosq->inflight_messages < mosq->max_inflight_messages){
+			mosq->inflight_messages++;
+			if(messages[i]->msg.qos == 1){
+				messages[i]->state = mosq_ms_wait_for_puback;
+			}else{
+				messages[i]->state = mosq_ms_wait_for_pubrec;
+			}
+			_mosquitto_message_deadline_update(mosq, messages[i]);
+			if(connected){
+				/* On failure the message stays in flight and is sent by the
+				 * retry check, as for any other failed send. */
+				rc2 = _mosquitto_packet_publish_build(&packets[i], messages[i]->msg.mid, messages[i]->msg.topic, messages[i]->msg.payloadlen, messages[i]->msg.payload, messages[i]->msg.qos, messages[i]->msg.retain, false);
+				if(rc2 && !rc) rc = rc2;
+			}
+		}else{
+			messages[i]->state = mosq_ms_invalid;
+		}
+	}
+	_mosquitto_mutex_unlock(mosq, &mosq->message_mutex);
+
+	for(i=0; i<n; i++){
+		if(!packets[i]) continue;
+
+		_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s sending PUBLISH (d0, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, reqs[i].qos, reqs[i].retain, (int)packets[i]->mid, reqs[i].topic, (long)reqs[i].payloadlen);
+		if(tail){
+			tail->next = packets[i];
+		}else{
+			head = packets[i];
+		}
+		tail = packets[i];
+		tail->next = NULL;
+	}
+	_mosquitto_free(messages);
+	_mosquitto_free(packets);
+
+	if(!connected) return MOSQ_ERR_NO_CONN;
+	if(head){
+		rc2 = _mosquitto_packet_queue_chain(mosq, head);
+		if(rc2 && !rc) rc = rc2;
+	}
+	return rc;
+}
+
+static int _mosquitto_subscribe_check(const char *sub, int qos)
+{
+	size_t len;
+
+	if(!sub || qos<0 || qos>2) return MOSQ_ERR_INVAL;
+	len = strlen(sub);
+	if(len == 0) return MOSQ_ERR_INVAL;
+
+	return _mosquitto_topic_check(sub, len, true);
+}
+
 int mosquitto_subscribe(struct mosquitto *mosq, int *mid, const char *sub, int qos)
 {
+	int rc;
+
 	if(!mosq) return MOSQ_ERR_INVAL;
+	rc = _mosquitto_subscribe_check(sub, qos);
+	if(rc) return rc;
+	if(mosq->pipeline){
+		rc = _mosquitto_session_sub_add(mosq, 1, (char *const *)&sub, &qos);
+		if(rc) return rc;
+		if(mosq->sock == INVALID_SOCKET){
+			/* Sent with a new mid once connected. */
+			if(mid) *mid = 0;
+			return MOSQ_ERR_SUCCESS;
+		}
+	}
 	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
 
-	return _mosquitto_send_subscribe(mosq, mid, false, sub, qos);
+	return _mosquitto_send_subscribe(mosq, mid, false, 1, (char *const *)&sub, &qos);
+}
+
+int mosquitto_subscribe_multiple(struct mosquitto *mosq, int *mid, int sub_count, char *const *sub, const int *qos)
+{
+	int i;
+	int rc;
+
+	if(!mosq || sub_count < 1 || !sub || !qos) return MOSQ_ERR_INVAL;
+	for(i=0; i<sub_count; i++){
+		rc = _mosquitto_subscribe_check(sub[i], qos[i]);
+		if(rc) return rc;
+	}
+	if(mosq->pipeline){
+		rc = _mosquitto_session_sub_add(mosq, sub_count, sub, qos);
+		if(rc) return rc;
+		if(mosq->sock == INVALID_SOCKET){
+			/* Sent with a new mid once connected. */
+			if(mid) *mid = 0;
+			return MOSQ_ERR_SUCCESS;
+		}
+	}
+	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
+
+	return _mosquitto_send_subscribe(mosq, mid, false, sub_count, sub, qos);
 }
 
 int mosquitto_unsubscribe(struct mosquitto *mosq, int *mid, const char *sub)
 {
 	if(!mosq) return MOSQ_ERR_INVAL;
+	if(mosq->pipeline){
+		if(!sub) return MOSQ_ERR_INVAL;
+		_mosquitto_session_sub_remove(mosq, 1, (char *const *)&sub);
+		if(mosq->sock == INVALID_SOCKET){
+			if(mid) *mid = 0;
+			return MOSQ_ERR_SUCCESS;
+		}
+	}
+	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
+
+	return _mosquitto_send_unsubscribe(mosq, mid, false, 1, (char *const *)&sub);
+}
+
+int mosquitto_unsubscribe_multiple(struct mosquitto *mosq, int *mid, int sub_count, char *const *sub)
+{
+	int i;
+
+	if(!mosq || sub_count < 1 || !sub) return MOSQ_ERR_INVAL;
+	for(i=0; i<sub_count; i++){
+		if(!sub[i]) return MOSQ_ERR_INVAL;
+	}
+	if(mosq->pipeline){
+		_mosquitto_session_sub_remove(mosq, sub_count, sub);
+		if(mosq->sock == INVALID_SOCKET){
+			if(mid) *mid = 0;
+			return MOSQ_ERR_SUCCESS;
+		}
+	}
 	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
 
-	return _mosquitto_send_unsubscribe(mosq, mid, false, sub);
+	return _mosquitto_send_unsubscribe(mosq, mid, false, sub_count, sub);
 }
 
 int mosquitto_tls_set(struct mosquitto *mosq, const char *cafile, const char *capath, const char *certfile, const char *keyfile, int (*pw_callback)(char *buf, int size, int rwflag, void *userdata))
@@ -596,6 +859,7 @@ int mosquitto_tls_set(struct mosquitto *mosq, const char *cafile, const char *ca
 	FILE *fptr;
 
 	if(!mosq || (!cafile && !capath) || (certfile && !keyfile) || (!certfile && keyfile)) return MOSQ_ERR_INVAL;
+	_mosquitto_ssl_ctx_release(mosq);
 
 	if(cafile){
 		fptr = _mosquitto_fopen(cafile, "rt");
@@ -690,6 +954,7 @@ int mosquitto_tls_opts_set(struct mosquitto *mosq, int cert_reqs, const char *tl
 {
 #ifdef WITH_TLS
 	if(!mosq) return MOSQ_ERR_INVAL;
+	_mosquitto_ssl_ctx_release(mosq);
 
 	mosq->tls_cert_reqs = cert_reqs;
 	if(tls_version){
@@ -747,10 +1012,41 @@ int mosquitto_tls_insecure_set(struct mosquitto *mosq, bool value)
 }
 
 
+int mosquitto_tls_ktls_set(struct mosquitto *mosq, bool value)
+{
+#ifdef REAL_WITH_TLS_KTLS
+	if(!mosq) return MOSQ_ERR_INVAL;
+	mosq->tls_ktls = value;
+	return MOSQ_ERR_SUCCESS;
+#else
+	return MOSQ_ERR_NOT_SUPPORTED;
+#endif
+}
+
+
+int mosquitto_tls_stats(struct mosquitto *mosq, struct mosquitto_tls_stats *stats)
+{
+#ifdef WITH_TLS
+	if(!mosq || !stats) return MOSQ_ERR_INVAL;
+
+	stats->handshakes = (unsigned int)MOSQ_ATOMIC_LOAD_INT(&mosq->tls_handshakes);
+	stats->resumed = (unsigned int)MOSQ_ATOMIC_LOAD_INT(&mosq->tls_resumed);
+	stats->last_handshake_ms = (unsigned int)MOSQ_ATOMIC_LOAD_I64(&mosq->tls_handshake_ms_last);
+	stats->total_handshake_ms = (unsigned long)MOSQ_ATOMIC_LOAD_I64(&mosq->tls_handshake_ms_total);
+	stats->ktls_send = mosq->tls_ktls_send;
+	stats->ktls_recv = mosq->tls_ktls_recv;
+	return MOSQ_ERR_SUCCESS;
+#else
+	return MOSQ_ERR_NOT_SUPPORTED;
+#endif
+}
+
+
 int mosquitto_tls_psk_set(struct mosquitto *mosq, const char *psk, const char *identity, const char *ciphers)
 {
 #ifdef REAL_WITH_TLS_PSK
 	if(!mosq || !psk || !identity) return MOSQ_ERR_INVAL;
+	_mosquitto_ssl_ctx_release(mosq);
 
 	/* Check for hex only digits */
 	if(strspn(psk, "0123456789abcdefABCDEF") < strlen(psk)){
@@ -788,44 +1084,62 @@ int mosquitto_loop(struct mosquitto *mosq, int timeout, int max_packets)
 	fd_set readfds, writefds;
 	int fdcount;
 	int rc;
+	mosq_sock_t maxfd;
+	int64_t deadline;
+	int64_t wait;
 
 	if(!mosq || max_packets < 1) return MOSQ_ERR_INVAL;
 	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
 
 	FD_ZERO(&readfds);
 	FD_SET(mosq->sock, &readfds);
+	maxfd = mosq->sock;
+	if(mosq->sockpairR != INVALID_SOCKET){
+		/* Other threads use the socket pair to break us out of select()
+		 * before the timeout, e.g. when they queue a packet. */
+		FD_SET(mosq->sockpairR, &readfds);
+		if(mosq->sockpairR > maxfd){
+			maxfd = mosq->sockpairR;
+		}
+	}
 	FD_ZERO(&writefds);
-	pthread_mutex_lock(&mosq->current_out_packet_mutex);
-	pthread_mutex_lock(&mosq->out_packet_mutex);
-	if(mosq->out_packet || mosq->current_out_packet){
+	if(mosq->connect_race){
+		/* Still connecting: any of the attempts may win, not only the one
+		 * in mosq->sock. While the broker's address is being looked up
+		 * there are no attempts, and mosq->sock is the lookup's wakeup. */
+		_mosquitto_connect_race_fdset(mosq, &writefds, &maxfd);
+	}else if(mosquitto_want_write(mosq)){
 		FD_SET(mosq->sock, &writefds);
 #ifdef WITH_TLS
 	}else if(mosq->ssl && mosq->want_write){
 		FD_SET(mosq->sock, &writefds);
 #endif
 	}
-	pthread_mutex_unlock(&mosq->out_packet_mutex);
-	pthread_mutex_unlock(&mosq->current_out_packet_mutex);
-	if(timeout >= 0){
-		local_timeout.tv_sec = timeout/1000;
-#ifdef HAVE_PSELECT
-		local_timeout.tv_nsec = (timeout-local_timeout.tv_sec*1000)*1e6;
-#else
-		local_timeout.tv_usec = (timeout-local_timeout.tv_sec*1000)*1000;
-#endif
-	}else{
-		local_timeout.tv_sec = 1;
+	/* Sleep no longer than until mosquitto_loop_misc() next has something to
+	 * do. Anything else that needs attention, incoming data or a packet queued
+	 * by another thread, wakes select() up itself. */
+	deadline = _mosquitto_loop_deadline(mosq);
+	if(deadline >= 0){
+		wait = deadline - mosquitto_time_ms();
+		if(wait < 0) wait = 0;
+		if(timeout < 0 || wait < timeout){
+			timeout = (int)wait;
+		}
+	}
+	if(timeout < 0){
+		timeout = 1000;
+	}
+	local_timeout.tv_sec = timeout/1000;
 #ifdef HAVE_PSELECT
-		local_timeout.tv_nsec = 0;
+	local_timeout.tv_nsec = (timeout-local_timeout.tv_sec*1000)*1e6;
 #else
-		local_timeout.tv_usec = 0;
+	local_timeout.tv_usec = (timeout-local_timeout.tv_sec*1000)*1000;
 #endif
-	}
 
 #ifdef HAVE_PSELECT
-	fdcount = pselect(mosq->sock+1, &readfds, &writefds, NULL, &local_timeout, NULL);
+	fdcount = pselect(maxfd+1, &readfds, &writefds, NULL, &local_timeout, NULL);
 #else
-	fdcount = select(mosq->sock+1, &readfds, &writefds, NULL, &local_timeout);
+	fdcount = select(maxfd+1, &readfds, &writefds, NULL, &local_timeout);
 #endif
 	if(fdcount == -1){
 #ifdef WIN32
@@ -837,6 +1151,16 @@ int mosquitto_loop(struct mosquitto *mosq, int timeout, int max_packets)
 			return MOSQ_ERR_ERRNO;
 		}
 	}else{
+		if(mosq->sockpairR != INVALID_SOCKET && FD_ISSET(mosq->sockpairR, &readfds)){
+			_mosquitto_loop_wakeup_clear(mosq);
+			/* We were most likely woken because a packet was queued after
+			 * writefds was set up. The socket is almost certainly writable,
+			 * so try now rather than waiting for another select(). */
+			FD_SET(mosq->sock, &writefds);
+		}
+		if(mosq->connect_race){
+			return mosquitto_loop_misc(mosq);
+		}
 		if(FD_ISSET(mosq->sock, &readfds)){
 			rc = mosquitto_loop_read(mosq, max_packets);
 			if(rc || mosq->sock == INVALID_SOCKET){
@@ -853,62 +1177,142 @@ int mosquitto_loop(struct mosquitto *mosq, int timeout, int max_packets)
 	return mosquitto_loop_misc(mosq);
 }
 
-int mosquitto_loop_forever(struct mosquitto *mosq, int timeout, int max_packets)
+static bool _mosquitto_loop_stopping(struct mosquitto *mosq)
 {
-	int run = 1;
-	int rc;
-	unsigned int reconnects = 0;
-	unsigned long reconnect_delay;
+	return MOSQ_ATOMIC_LOAD_INT(&mosq->loop_stop_requested) != 0;
+}
 
-	if(!mosq) return MOSQ_ERR_INVAL;
+/* Wait for up to delay milliseconds, returning early if _mosquitto_loop_wakeup()
+ * is called from another thread. */
+static void _mosquitto_loop_sleep(struct mosquitto *mosq, unsigned long delay)
+{
+	struct timeval local_timeout;
+	fd_set readfds;
 
-	if(mosq->state == mosq_cs_connect_async){
-		mosquitto_reconnect(mosq);
+	if(mosq->sockpairR == INVALID_SOCKET){
+#ifdef WIN32
+		Sleep(delay);
+#else
+		usleep(delay*1000);
+#endif
+		return;
 	}
 
-	while(run){
-		do{
-			rc = mosquitto_loop(mosq, timeout, max_packets);
-			if (reconnects !=0 && rc == MOSQ_ERR_SUCCESS){
-				reconnects = 0;
-			}
-		}while(rc == MOSQ_ERR_SUCCESS);
-		if(errno == EPROTO){
-			return rc;
+	FD_ZERO(&readfds);
+	FD_SET(mosq->sockpairR, &readfds);
+	local_timeout.tv_sec = delay/1000;
+	local_timeout.tv_usec = (delay%1000)*1000;
+	if(select(mosq->sockpairR+1, &readfds, NULL, NULL, &local_timeout) > 0){
+		_mosquitto_loop_wakeup_clear(mosq);
+	}
+}
+
+static uint32_t _mosquitto_reconnect_rand(struct mosquitto *mosq)
+{
+	/* xorshift32 - only used for spreading out reconnect attempts. */
+	uint32_t x = mosq->reconnect_rand;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	mosq->reconnect_rand = x;
+	return x;
+}
+
+/* Delay in ms before the next reconnect attempt. The ceiling is
+ * reconnect_delay, or with exponential backoff doubles on each attempt up to
+ * reconnect_delay_max. Either way the actual delay is chosen uniformly between
+ * 0 and the ceiling ("full jitter"), so that clients which lost the same
+ * broker do not all come back at the same moment. */
+static unsigned int _mosquitto_reconnect_delay_next(struct mosquitto *mosq)
+{
+	uint64_t delay = mosq->reconnect_delay;
+	unsigned int i;
+
+	if(mosq->reconnect_exponential_backoff){
+		for(i=0; i<mosq->reconnect_attempts && delay < mosq->reconnect_delay_max; i++){
+			delay *= 2;
 		}
-		pthread_mutex_lock(&mosq->state_mutex);
-		if(mosq->state == mosq_cs_disconnecting){
-			run = 0;
-			pthread_mutex_unlock(&mosq->state_mutex);
-		}else{
-			pthread_mutex_unlock(&mosq->state_mutex);
+		if(delay > mosq->reconnect_delay_max){
+			delay = mosq->reconnect_delay_max;
+		}
+	}
+	if(delay > 0){
+		delay = _mosquitto_reconnect_rand(mosq) % (delay+1);
+	}
+	return (unsigned int)delay;
+}
 
-			if(mosq->reconnect_delay > 0 && mosq->reconnect_exponential_backoff){
-				reconnect_delay = mosq->reconnect_delay*reconnects*reconnects;
-			}else{
-				reconnect_delay = mosq->reconnect_delay;
+int mosquitto_loop_forever(struct mosquitto *mosq, int timeout, int max_packets)
+{
+	int rc = MOSQ_ERR_NO_CONN;
+	int64_t reconnect_at;
+	int64_t now;
+	unsigned int delay = 0;
+
+	if(!mosq) return MOSQ_ERR_INVAL;
+
+	/* If there is no connection yet, for example because
+	 * mosquitto_connect_async() failed early, try straight away. */
+	reconnect_at = mosquitto_time_ms();
+
+	while(1){
+		if(mosq->sock != INVALID_SOCKET){
+			do{
+				rc = mosquitto_loop(mosq, timeout, max_packets);
+			}while(rc == MOSQ_ERR_SUCCESS && !_mosquitto_loop_stopping(mosq));
+			if(rc == MOSQ_ERR_SUCCESS){
+				/* Stopped by mosquitto_loop_stop() */
+				return rc;
+			}
+			if(errno == EPROTO){
+				return rc;
 			}
+			if(_mosquitto_loop_finished(mosq)){
+				return rc;
+			}
+			delay = _mosquitto_reconnect_delay_next(mosq);
+			reconnect_at = mosquitto_time_ms() + delay;
+		}
 
-			if(reconnect_delay > mosq->reconnect_delay_max){
-				reconnect_delay = mosq->reconnect_delay_max;
-			}else{
-				reconnects++;
+		/* Wait for the reconnect timer. Any other wakeup, such as a packet
+		 * being queued while we're disconnected, just goes back to waiting. */
+		now = mosquitto_time_ms();
+		while(now < reconnect_at){
+			_mosquitto_loop_sleep(mosq, (unsigned long)(reconnect_at - now));
+			if(_mosquitto_loop_finished(mosq)){
+				return rc;
 			}
-				
-#ifdef WIN32
-			Sleep(reconnect_delay*1000);
-#else
-			sleep(reconnect_delay);
-#endif
+			now = mosquitto_time_ms();
+		}
+		if(_mosquitto_loop_finished(mosq)){
+			return rc;
+		}
 
-			pthread_mutex_lock(&mosq->state_mutex);
-			if(mosq->state == mosq_cs_disconnecting){
-				run = 0;
-				pthread_mutex_unlock(&mosq->state_mutex);
-			}else{
-				pthread_mutex_unlock(&mosq->state_mutex);
-				mosquitto_reconnect(mosq);
+		mosq->reconnect_attempts++;
+		_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s reconnecting, attempt %u after %u ms", mosq->id, mosq->reconnect_attempts, delay);
+		_mosquitto_mutex_lock(mosq, &mosq->callback_mutex);
+		if(mosq->on_reconnect){
+			_mosquitto_callback_enter();
+			mosq->on_reconnect(mosq, mosq->userdata, (int)mosq->reconnect_attempts, delay);
+			_mosquitto_callback_leave();
+		}
+		_mosquitto_mutex_unlock(mosq, &mosq->callback_mutex);
+
+		/* The broker's address is looked up and the connection attempts
+		 * raced by mosquitto_loop() above, like any other traffic, so
+		 * mosquitto_disconnect() and mosquitto_loop_stop() can interrupt
+		 * them. */
+		rc = mosquitto_reconnect_async(mosq);
+		if(rc != MOSQ_ERR_SUCCESS){
+			if(mosq->sock != INVALID_SOCKET){
+				_mosquitto_socket_close(mosq);
 			}
+			if(_mosquitto_loop_finished(mosq)){
+				return rc;
+			}
+			delay = _mosquitto_reconnect_delay_next(mosq);
+			reconnect_at = mosquitto_time_ms() + delay;
 		}
 	}
 	return rc;
@@ -916,38 +1320,44 @@ int mosquitto_loop_forever(struct mosquitto *mosq, int timeout, int max_packets)
 
 int mosquitto_loop_misc(struct mosquitto *mosq)
 {
-	time_t now;
+	int64_t now;
+	int64_t next_retry_check;
 	int rc;
 
 	if(!mosq) return MOSQ_ERR_INVAL;
 	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
 
-	now = mosquitto_time();
+	if(mosq->connect_race){
+		rc = _mosquitto_connect_race_step(mosq);
+		if(rc || mosq->connect_race){
+			return _mosquitto_loop_rc_handle(mosq, rc);
+		}
+	}
+
+	now = mosquitto_time_ms();
 
 	_mosquitto_check_keepalive(mosq);
-	if(mosq->last_retry_check+1 < now){
+	next_retry_check = MOSQ_ATOMIC_LOAD_I64(&mosq->next_retry_check);
+	if(next_retry_check >= 0 && now >= next_retry_check){
 		_mosquitto_message_retry_check(mosq);
-		mosq->last_retry_check = now;
 	}
-	if(mosq->ping_t && now - mosq->ping_t >= mosq->keepalive){
+	if(mosq->ping_t && now - mosq->ping_t >= (int64_t)mosq->keepalive*1000){
 		/* mosq->ping_t != 0 means we are waiting for a pingresp.
 		 * This hasn't happened in the keepalive time so we should disconnect.
 		 */
 		_mosquitto_socket_close(mosq);
-		pthread_mutex_lock(&mosq->state_mutex);
-		if(mosq->state == mosq_cs_disconnecting){
+		if(MOSQ_ATOMIC_LOAD_INT(&mosq->state) == mosq_cs_disconnecting){
 			rc = MOSQ_ERR_SUCCESS;
 		}else{
 			rc = 1;
 		}
-		pthread_mutex_unlock(&mosq->state_mutex);
-		pthread_mutex_lock(&mosq->callback_mutex);
+		_mosquitto_mutex_lock(mosq, &mosq->callback_mutex);
 		if(mosq->on_disconnect){
-			mosq->in_callback = true;
+			_mosquitto_callback_enter();
 			mosq->on_disconnect(mosq, mosq->userdata, rc);
-			mosq->in_callback = false;
+			_mosquitto_callback_leave();
 		}
-		pthread_mutex_unlock(&mosq->callback_mutex);
+		_mosquitto_mutex_unlock(mosq, &mosq->callback_mutex);
 		return MOSQ_ERR_CONN_LOST;
 	}
 	return MOSQ_ERR_SUCCESS;
@@ -957,18 +1367,16 @@ static int _mosquitto_loop_rc_handle(struct mosquitto *mosq, int rc)
 {
 	if(rc){
 		_mosquitto_socket_close(mosq);
-		pthread_mutex_lock(&mosq->state_mutex);
-		if(mosq->state == mosq_cs_disconnecting){
+		if(MOSQ_ATOMIC_LOAD_INT(&mosq->state) == mosq_cs_disconnecting){
 			rc = MOSQ_ERR_SUCCESS;
 		}
-		pthread_mutex_unlock(&mosq->state_mutex);
-		pthread_mutex_lock(&mosq->callback_mutex);
+		_mosquitto_mutex_lock(mosq, &mosq->callback_mutex);
 		if(mosq->on_disconnect){
-			mosq->in_callback = true;
+			_mosquitto_callback_enter();
 			mosq->on_disconnect(mosq, mosq->userdata, rc);
-			mosq->in_callback = false;
+			_mosquitto_callback_leave();
 		}
-		pthread_mutex_unlock(&mosq->callback_mutex);
+		_mosquitto_mutex_unlock(mosq, &mosq->callback_mutex);
 		return rc;
 	}
 	return rc;
@@ -980,9 +1388,17 @@ int mosquitto_loop_read(struct mosquitto *mosq, int max_packets)
 	int i;
 	if(max_packets < 1) return MOSQ_ERR_INVAL;
 
-	pthread_mutex_lock(&mosq->message_mutex);
+	if(mosq->connect_race){
+		/* Still connecting, see whether an attempt has finished. */
+		rc = _mosquitto_connect_race_step(mosq);
+		if(rc || mosq->connect_race){
+			return _mosquitto_loop_rc_handle(mosq, rc);
+		}
+	}
+
+	_mosquitto_mutex_lock(mosq, &mosq->message_mutex);
 	max_packets = mosq->queue_len;
-	pthread_mutex_unlock(&mosq->message_mutex);
+	_mosquitto_mutex_unlock(mosq, &mosq->message_mutex);
 	if(max_packets < 1) max_packets = 1;
 	/* Queue len here tells us how many messages are awaiting processing and
 	 * have QoS > 0. We should try to deal with that many in this loop in order
@@ -990,9 +1406,12 @@ int mosquitto_loop_read(struct mosquitto *mosq, int max_packets)
 	for(i=0; i<max_packets; i++){
 		rc = _mosquitto_packet_read(mosq);
 		if(rc || errno == EAGAIN || errno == COMPAT_EWOULDBLOCK){
-			return _mosquitto_loop_rc_handle(mosq, rc);
+			rc = _mosquitto_loop_rc_handle(mosq, rc);
+			break;
 		}
 	}
+	/* A TLS read may need to write before it can continue. */
+	_mosquitto_interest_update(mosq);
 	return rc;
 }
 
@@ -1002,9 +1421,17 @@ int mosquitto_loop_write(struct mosquitto *mosq, int max_packets)
 	int i;
 	if(max_packets < 1) return MOSQ_ERR_INVAL;
 
-	pthread_mutex_lock(&mosq->message_mutex);
+	if(mosq->connect_race){
+		/* Still connecting, see whether an attempt has finished. */
+		rc = _mosquitto_connect_race_step(mosq);
+		if(rc || mosq->connect_race){
+			return _mosquitto_loop_rc_handle(mosq, rc);
+		}
+	}
+
+	_mosquitto_mutex_lock(mosq, &mosq->message_mutex);
 	max_packets = mosq->queue_len;
-	pthread_mutex_unlock(&mosq->message_mutex);
+	_mosquitto_mutex_unlock(mosq, &mosq->message_mutex);
 	if(max_packets < 1) max_packets = 1;
 	/* Queue len here tells us how many messages are awaiting processing and
 	 * have QoS > 0. We should try to deal with that many in this loop in order
@@ -1012,15 +1439,33 @@ int mosquitto_loop_write(struct mosquitto *mosq, int max_packets)
 	for(i=0; i<max_packets; i++){
 		rc = _mosquitto_packet_write(mosq);
 		if(rc || errno == EAGAIN || errno == COMPAT_EWOULDBLOCK){
-			return _mosquitto_loop_rc_handle(mosq, rc);
+			rc = _mosquitto_loop_rc_handle(mosq, rc);
+			break;
 		}
+		/* _mosquitto_packet_write() writes everything it can, so once the
+		 * queue is empty further calls would only take the lock again. */
+		if(!mosquitto_want_write(mosq)) break;
 	}
+	_mosquitto_interest_update(mosq);
 	return rc;
 }
 
 bool mosquitto_want_write(struct mosquitto *mosq)
 {
-	if(mosq->out_packet){
+	/* None of the checks needs a lock: a stale answer only costs one extra
+	 * iteration of the caller's loop. */
+	if(MOSQ_ATOMIC_LOAD_INT(&mosq->connect_resolving)){
+		/* There is nowhere to write to yet, and mosquitto_socket() is the
+		 * lookup's wakeup, which only becomes readable. */
+		return false;
+	}
+#ifdef WITH_TLS
+	/* Queued packets wait for the handshake, which knows what it needs. */
+	if(mosq->ssl && !mosq->tls_handshake_done){
+		return mosq->want_write;
+	}
+#endif
+	if(MOSQ_ATOMIC_LOAD_PTR(&mosq->current_out_packet) || !_mosquitto_packet_queue_empty(mosq)){
 		return true;
 	}else{
 		return false;
@@ -1029,51 +1474,84 @@ bool mosquitto_want_write(struct mosquitto *mosq)
 
 void mosquitto_connect_callback_set(struct mosquitto *mosq, void (*on_connect)(struct mosquitto *, void *, int))
 {
-	pthread_mutex_lock(&mosq->callback_mutex);
+	_mosquitto_mutex_lock(mosq, &mosq->callback_mutex);
 	mosq->on_connect = on_connect;
-	pthread_mutex_unlock(&mosq->callback_mutex);
+	_mosquitto_mutex_unlock(mosq, &mosq->callback_mutex);
 }
 
 void mosquitto_disconnect_callback_set(struct mosquitto *mosq, void (*on_disconnect)(struct mosquitto *, void *, int))
 {
-	pthread_mutex_lock(&mosq->callback_mutex);
+	_mosquitto_mutex_lock(mosq, &mosq->callback_mutex);
 	mosq->on_disconnect = on_disconnect;
-	pthread_mutex_unlock(&mosq->callback_mutex);
+	_mosquitto_mutex_unlock(mosq, &mosq->callback_mutex);
 }
 
 void mosquitto_publish_callback_set(struct mosquitto *mosq, void (*on_publish)(struct mosquitto *, void *, int))
 {
-	pthread_mutex_lock(&mosq->callback_mutex);
+	_mosquitto_mutex_lock(mosq, &mosq->callback_mutex);
 	mosq->on_publish = on_publish;
-	pthread_mutex_unlock(&mosq->callback_mutex);
+	_mosquitto_mutex_unlock(mosq, &mosq->callback_mutex);
 }
 
 void mosquitto_message_callback_set(struct mosquitto *mosq, void (*on_message)(struct mosquitto *, void *, const struct mosquitto_message *))
 {
-	pthread_mutex_lock(&mosq->callback_mutex);
+	_mosquitto_mutex_lock(mosq, &mosq->callback_mutex);
 	mosq->on_message = on_message;
-	pthread_mutex_unlock(&mosq->callback_mutex);
+	_mosquitto_mutex_unlock(mosq, &mosq->callback_mutex);
 }
 
 void mosquitto_subscribe_callback_set(struct mosquitto *mosq, void (*on_subscribe)(struct mosquitto *, void *, int, int, const int *))
 {
-	pthread_mutex_lock(&mosq->callback_mutex);
+	_mosquitto_mutex_lock(mosq, &mosq->callback_mutex);
 	mosq->on_subscribe = on_subscribe;
-	pthread_mutex_unlock(&mosq->callback_mutex);
+	_mosquitto_mutex_unlock(mosq, &mosq->callback_mutex);
 }
 
 void mosquitto_unsubscribe_callback_set(struct mosquitto *mosq, void (*on_unsubscribe)(struct mosquitto *, void *, int))
 {
-	pthread_mutex_lock(&mosq->callback_mutex);
+	_mosquitto_mutex_lock(mosq, &mosq->callback_mutex);
 	mosq->on_unsubscribe = on_unsubscribe;
-	pthread_mutex_unlock(&mosq->callback_mutex);
+	_mosquitto_mutex_unlock(mosq, &mosq->callback_mutex);
+}
+
+void mosquitto_interest_callback_set(struct mosquitto *mosq, void (*on_interest)(struct mosquitto *, void *, int, bool))
+{
+	_mosquitto_mutex_lock(mosq, &mosq->interest_mutex);
+	mosq->interest_sock = INVALID_SOCKET;
+	mosq->interest_write = false;
+	MOSQ_ATOMIC_STORE_PTR(&mosq->on_interest, on_interest);
+	_mosquitto_mutex_unlock(mosq, &mosq->interest_mutex);
+	/* Report the current state straight away if there is a connection. */
+	_mosquitto_interest_update(mosq);
+}
+
+int mosquitto_next_timeout_ms(struct mosquitto *mosq)
+{
+	int64_t deadline;
+	int64_t wait;
+
+	if(!mosq) return -1;
+
+	deadline = _mosquitto_loop_deadline(mosq);
+	if(deadline < 0) return -1;
+
+	wait = deadline - mosquitto_time_ms();
+	if(wait < 0) wait = 0;
+	return (int)wait;
+}
+
+void mosquitto_reconnect_callback_set(struct mosquitto *mosq, void (*on_reconnect)(struct mosquitto *, void *, int, unsigned int))
+{
+	_mosquitto_mutex_lock(mosq, &mosq->callback_mutex);
+	mosq->on_reconnect = on_reconnect;
+	_mosquitto_mutex_unlock(mosq, &mosq->callback_mutex);
 }
 
 void mosquitto_log_callback_set(struct mosquitto *mosq, void (*on_log)(struct mosquitto *, void *, int, const char *))
 {
-	pthread_mutex_lock(&mosq->log_callback_mutex);
-	mosq->on_log = on_log;
-	pthread_mutex_unlock(&mosq->log_callback_mutex);
+	_mosquitto_mutex_lock(mosq, &mosq->log_callback_mutex);
+	MOSQ_ATOMIC_STORE_PTR(&mosq->on_log, on_log);
+	_mosquitto_mutex_unlock(mosq, &mosq->log_callback_mutex);
 }
 
 void mosquitto_user_data_set(struct mosquitto *mosq, void *userdata)
@@ -1222,3 +1700,40 @@ int mosquitto_sub_topic_tokens_free(char ***topics, int count)
 	return MOSQ_ERR_SUCCESS;
 }
 
+int mosquitto_sub_topic_tokenise_view(const char *subtopic, struct mosquitto_topic_level *levels, int max_levels, int *count)
+{
+	const char *p;
+	const char *start;
+	int n = 0;
+
+	if(!subtopic || !count || max_levels < 0) return MOSQ_ERR_INVAL;
+	if(max_levels > 0 && !levels) return MOSQ_ERR_INVAL;
+
+	p = subtopic;
+	if(*p == '/' || *p == '\0'){
+		/* A leading separator, or an empty string, is an empty level. */
+		if(n < max_levels){
+			levels[n].offset = 0;
+			levels[n].len = 0;
+		}
+		n++;
+	}
+	while(1){
+		/* Ignore duplicate and trailing separators. */
+		while(*p == '/') p++;
+		if(*p == '\0') break;
+
+		start = p;
+		while(*p != '/' && *p != '\0') p++;
+		if(n < max_levels){
+			levels[n].offset = start - subtopic;
+			levels[n].len = p - start;
+		}
+		n++;
+	}
+
+	*count = n;
+	if(n > max_levels) return MOSQ_ERR_NOMEM;
+	return MOSQ_ERR_SUCCESS;
+}
+
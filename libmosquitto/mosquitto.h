@@ -62,6 +62,7 @@ extern "C" {
 #		include <stdbool.h>
 #	endif
 #endif
+#include <stddef.h>
 
 #define LIBMOSQUITTO_MAJOR 1
 #define LIBMOSQUITTO_MINOR 2
@@ -80,6 +81,9 @@ extern "C" {
 #define MOSQ_LOG_UNSUBSCRIBE 0x40
 #define MOSQ_LOG_ALL 0xFFFF
 
+/* Flags for mosquitto_new_flags */
+#define MOSQ_NEW_SINGLE_THREADED 0x01
+
 /* Error values */
 enum mosq_err_t {
 	MOSQ_ERR_CONN_PENDING = -1,
@@ -113,7 +117,34 @@ struct mosquitto_message{
 	bool retain;
 };
 
+/* A single message for <mosquitto_publish_batch>. The fields have the same
+ * meaning as the parameters of <mosquitto_publish>. */
+struct mosquitto_publish_req{
+	const char *topic;
+	int payloadlen;
+	const void *payload;
+	int qos;
+	bool retain;
+};
+
+/* TLS handshake counters, see <mosquitto_tls_stats>. */
+struct mosquitto_tls_stats{
+	unsigned int handshakes;
+	unsigned int resumed;
+	unsigned int last_handshake_ms;
+	unsigned long total_handshake_ms;
+	bool ktls_send;
+	bool ktls_recv;
+};
+
+/* One level of a topic, as found by <mosquitto_sub_topic_tokenise_view>. */
+struct mosquitto_topic_level{
+	int offset;
+	int len;
+};
+
 struct mosquitto;
+struct mosquitto_filter_set;
 
 /*
  * Topic: Threads
@@ -220,6 +251,38 @@ libmosq_EXPORT int mosquitto_lib_cleanup(void);
  */
 libmosq_EXPORT struct mosquitto *mosquitto_new(const char *id, bool clean_session, void *obj);
 
+/*
+ * Function: mosquitto_new_flags
+ *
+ * Create a new mosquitto client instance, as <mosquitto_new>, with extra
+ * options.
+ *
+ * Parameters:
+ * 	id -            as for <mosquitto_new>.
+ * 	clean_session - as for <mosquitto_new>.
+ * 	obj -           as for <mosquitto_new>.
+ * 	flags -         zero, or a combination of the following:
+ * 	                MOSQ_NEW_SINGLE_THREADED - the application promises to
+ * 	                only ever use the client from one thread at a time, for
+ * 	                example by driving it with <mosquitto_loop> from the
+ * 	                thread that calls <mosquitto_publish>. The client then
+ * 	                skips all of its internal locking. <mosquitto_loop_start>
+ * 	                and <mosquitto_dispatch_start> return MOSQ_ERR_INVAL for
+ * 	                such a client. Debug builds assert if two threads use the
+ * 	                client at once. The flag is kept by
+ * 	                <mosquitto_reinitialise>.
+ *
+ * Returns:
+ * 	Pointer to a struct mosquitto on success.
+ * 	NULL on failure. Interrogate errno to determine the cause for the failure:
+ *      - ENOMEM on out of memory.
+ *      - EINVAL on invalid input parameters.
+ *
+ * See Also:
+ * 	<mosquitto_new>, <mosquitto_destroy>
+ */
+libmosq_EXPORT struct mosquitto *mosquitto_new_flags(const char *id, bool clean_session, void *obj, int flags);
+
 /* 
  * Function: mosquitto_destroy
  *
@@ -391,6 +454,14 @@ libmosq_EXPORT int mosquitto_connect_bind(struct mosquitto *mosq, const char *ho
  * <mosquitto_loop_start>. If you need to use <mosquitto_loop>, you must use
  * <mosquitto_connect> to connect the client.
  *
+ * If TLS is configured, the TLS handshake is also carried out by the network
+ * loop, and the CONNECT message is sent once it has completed.
+ *
+ * When the library is built with threading support, a broker hostname that
+ * isn't in the address cache is looked up by the network loop too, so an
+ * unknown hostname is reported to the disconnect callback with
+ * MOSQ_ERR_EAI rather than returned from this function.
+ *
  * May be called before or after <mosquitto_loop_start>.
  *
  * Parameters:
@@ -516,7 +587,10 @@ libmosq_EXPORT int mosquitto_reconnect_async(struct mosquitto *mosq);
 /*
  * Function: mosquitto_disconnect
  *
- * Disconnect from the broker.
+ * Disconnect from the broker. If a connection started with
+ * <mosquitto_connect_async> or <mosquitto_reconnect_async> is still being
+ * made, it is abandoned the next time the network loop runs, and the
+ * disconnect callback is called with rc 0.
  *
  * Parameters:
  *	mosq - a valid mosquitto instance.
@@ -542,6 +616,9 @@ libmosq_EXPORT int mosquitto_disconnect(struct mosquitto *mosq);
  *               Note that although the MQTT protocol doesn't use message ids
  *               for messages with QoS=0, libmosquitto assigns them message ids
  *               so they can be tracked with this parameter.
+ * 	topic -      null terminated string of the topic to publish to. It must be
+ *               valid UTF-8, no longer than 65535 bytes, and must not contain
+ *               the wildcards + or #.
  * 	payloadlen - the size of the payload (bytes). Valid values are between 0 and
  *               268,435,455.
  * 	payload -    pointer to the data to send. If payloadlen > 0 this must be a
@@ -564,6 +641,87 @@ libmosq_EXPORT int mosquitto_disconnect(struct mosquitto *mosq);
  */
 libmosq_EXPORT int mosquitto_publish(struct mosquitto *mosq, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain);
 
+/* 
+ * Function: mosquitto_publish_ttl
+ *
+ * Publish a message on a given topic, discarding it if it has not been
+ * delivered within ttl seconds. This behaves exactly as <mosquitto_publish>
+ * except for the expiry.
+ *
+ * Only QoS 1 and 2 messages are held by the library and so can expire. A
+ * message that has expired is dropped instead of being sent (or resent)
+ * when it is next considered - either when it would be promoted from the
+ * queue to in flight, when it is due to be retried, or when the client
+ * reconnects. A QoS 2 message is never dropped part way through its
+ * delivery flow, because the broker may already hold state for it. The
+ * number of messages dropped is available from
+ * <mosquitto_message_expired_count>.
+ *
+ * Parameters:
+ * 	mosq -       a valid mosquitto instance.
+ * 	mid -        pointer to an int. If not NULL, the function will set this
+ *               to the message id of this particular message.
+ * 	topic -      the topic to publish on.
+ * 	payloadlen - the size of the payload (bytes). Valid values are between 0 and
+ *               268,435,455.
+ * 	payload -    pointer to the data to send. If payloadlen > 0 this must be a
+ *               valid memory location.
+ * 	qos -        integer value 0, 1 or 2 indicating the Quality of Service to be
+ *               used for the message.
+ * 	retain -     set to true to make the message retained.
+ * 	ttl -        the number of seconds after which the message should be
+ * 	             discarded if it has not been delivered. Set to 0 for no
+ * 	             expiry.
+ *
+ * Returns:
+ * 	MOSQ_ERR_SUCCESS -      on success.
+ * 	MOSQ_ERR_INVAL -        if the input parameters were invalid.
+ * 	MOSQ_ERR_NOMEM -        if an out of memory condition occurred.
+ * 	MOSQ_ERR_NO_CONN -      if the client isn't connected to a broker.
+ *	MOSQ_ERR_PROTOCOL -     if there is a protocol error communicating with the
+ *                          broker.
+ * 	MOSQ_ERR_PAYLOAD_SIZE - if payloadlen is too large.
+ *
+ * See Also: 
+ *	<mosquitto_publish>, <mosquitto_message_expired_count>
+ */
+libmosq_EXPORT int mosquitto_publish_ttl(struct mosquitto *mosq, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain, unsigned int ttl);
+
+/* 
+ * Function: mosquitto_publish_batch
+ *
+ * Publish a number of messages in one call. This is equivalent to calling
+ * <mosquitto_publish> for each element of reqs in order, but the message
+ * store is locked once for the whole batch and the resulting packets are
+ * queued together and written with as few system calls as possible.
+ *
+ * Every request is validated before anything is queued, so if
+ * MOSQ_ERR_INVAL or MOSQ_ERR_PAYLOAD_SIZE is returned then no messages have
+ * been published.
+ *
+ * Parameters:
+ * 	mosq - a valid mosquitto instance.
+ * 	reqs - an array of n messages to publish.
+ * 	n -    the number of elements in reqs.
+ * 	mids - if not NULL, an array of at least n ints. The function will set
+ * 	       mids[i] to the message id of reqs[i].
+ *
+ * Returns:
+ * 	MOSQ_ERR_SUCCESS -      on success.
+ * 	MOSQ_ERR_INVAL -        if the input parameters were invalid.
+ * 	MOSQ_ERR_NOMEM -        if an out of memory condition occurred.
+ * 	MOSQ_ERR_NO_CONN -      if the client isn't connected to a broker. QoS>0
+ * 	                        messages are still queued, as with
+ * 	                        <mosquitto_publish>.
+ *	MOSQ_ERR_PROTOCOL -     if there is a protocol error communicating with the
+ *                          broker.
+ * 	MOSQ_ERR_PAYLOAD_SIZE - if a payloadlen is too large.
+ *
+ * See Also: 
+ *	<mosquitto_publish>
+ */
+libmosq_EXPORT int mosquitto_publish_batch(struct mosquitto *mosq, const struct mosquitto_publish_req *reqs, int n, int *mids);
+
 /*
  * Function: mosquitto_subscribe
  *
@@ -574,8 +732,12 @@ libmosq_EXPORT int mosquitto_publish(struct mosquitto *mosq, int *mid, const cha
  *	mid -  a pointer to an int. If not NULL, the function will set this to
  *	       the message id of this particular message. This can be then used
  *	       with the subscribe callback to determine when the message has been
- *	       sent.
- *	sub -  the subscription pattern.
+ *	       sent. If the subscription was only recorded because pipelining
+ *	       is enabled and the client is not connected, it is set to 0,
+ *	       which is never a valid message id. See <mosquitto_pipeline_set>.
+ *	sub -  the subscription pattern. It must be valid UTF-8, no longer than
+ *	       65535 bytes, and may only use the wildcards + and # as a whole
+ *	       level, with # as the last level.
  *	qos -  the requested Quality of Service for this subscription.
  *
  * Returns:
@@ -586,6 +748,35 @@ libmosq_EXPORT int mosquitto_publish(struct mosquitto *mosq, int *mid, const cha
  */
 libmosq_EXPORT int mosquitto_subscribe(struct mosquitto *mosq, int *mid, const char *sub, int qos);
 
+/*
+ * Function: mosquitto_subscribe_multiple
+ *
+ * Subscribe to several topics with a single SUBSCRIBE packet. The broker
+ * answers with one SUBACK, and the subscribe callback receives the granted
+ * QoS of every topic, in the same order as sub.
+ *
+ * Parameters:
+ *	mosq -      a valid mosquitto instance.
+ *	mid -       a pointer to an int. If not NULL, the function will set this to
+ *	            the message id of the SUBSCRIBE packet, as for
+ *	            <mosquitto_subscribe>.
+ *	sub_count - the number of entries in sub and qos.
+ *	sub -       an array of subscription patterns, each as for
+ *	            <mosquitto_subscribe>.
+ *	qos -       an array of the requested Quality of Service for each pattern.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS -      on success.
+ * 	MOSQ_ERR_INVAL -        if the input parameters were invalid.
+ * 	MOSQ_ERR_NOMEM -        if an out of memory condition occurred.
+ * 	MOSQ_ERR_NO_CONN -      if the client isn't connected to a broker.
+ * 	MOSQ_ERR_PAYLOAD_SIZE - if the packet would be too large.
+ *
+ * See Also:
+ *	<mosquitto_subscribe>, <mosquitto_subscribe_callback_set>
+ */
+libmosq_EXPORT int mosquitto_subscribe_multiple(struct mosquitto *mosq, int *mid, int sub_count, char *const *sub, const int *qos);
+
 /*
  * Function: mosquitto_unsubscribe
  *
@@ -607,6 +798,31 @@ libmosq_EXPORT int mosquitto_subscribe(struct mosquitto *mosq, int *mid, const c
  */
 libmosq_EXPORT int mosquitto_unsubscribe(struct mosquitto *mosq, int *mid, const char *sub);
 
+/*
+ * Function: mosquitto_unsubscribe_multiple
+ *
+ * Unsubscribe from several topics with a single UNSUBSCRIBE packet. The
+ * unsubscribe callback is called once, when the broker's UNSUBACK arrives.
+ *
+ * Parameters:
+ *	mosq -      a valid mosquitto instance.
+ *	mid -       a pointer to an int. If not NULL, the function will set this to
+ *	            the message id of the UNSUBSCRIBE packet.
+ *	sub_count - the number of entries in sub.
+ *	sub -       an array of unsubscription patterns.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS -      on success.
+ * 	MOSQ_ERR_INVAL -        if the input parameters were invalid.
+ * 	MOSQ_ERR_NOMEM -        if an out of memory condition occurred.
+ * 	MOSQ_ERR_NO_CONN -      if the client isn't connected to a broker.
+ * 	MOSQ_ERR_PAYLOAD_SIZE - if the packet would be too large.
+ *
+ * See Also:
+ *	<mosquitto_unsubscribe>, <mosquitto_unsubscribe_callback_set>
+ */
+libmosq_EXPORT int mosquitto_unsubscribe_multiple(struct mosquitto *mosq, int *mid, int sub_count, char *const *sub);
+
 /*
  * Function: mosquitto_message_copy
  *
@@ -665,7 +881,9 @@ libmosq_EXPORT void mosquitto_message_free(struct mosquitto_message **message);
  *	mosq -        a valid mosquitto instance.
  *	timeout -     Maximum number of milliseconds to wait for network activity
  *	              in the select() call before timing out. Set to 0 for instant
- *	              return.  Set negative to use the default of 1000ms.
+ *	              return. Set negative to wait until the client next has timed
+ *	              work to do, such as sending a PINGREQ or retrying a message.
+ *	              The wait is never longer than that, whatever the timeout.
  *	max_packets - this parameter is currently unused and should be set to 1 for
  *	              future compatibility.
  * 
@@ -694,13 +912,18 @@ libmosq_EXPORT int mosquitto_loop(struct mosquitto *mosq, int timeout, int max_p
  * program.
  *
  * It handles reconnecting in case server connection is lost. If you call
- * mosquitto_disconnect() in a callback it will return.
+ * mosquitto_disconnect() in a callback it will return. Calling
+ * mosquitto_disconnect() from another thread also cancels any pending
+ * reconnect. Reconnect attempts do not block the loop; see
+ * <mosquitto_reconnect_delay_set> and <mosquitto_reconnect_callback_set>.
  *
  * Parameters:
  *  mosq - a valid mosquitto instance.
  *	timeout -     Maximum number of milliseconds to wait for network activity
  *	              in the select() call before timing out. Set to 0 for instant
- *	              return.  Set negative to use the default of 1000ms.
+ *	              return. Set negative to wait until the client next has timed
+ *	              work to do, such as sending a PINGREQ or retrying a message.
+ *	              The wait is never longer than that, whatever the timeout.
  *	max_packets - this parameter is currently unused and should be set to 1 for
  *	              future compatibility.
  *
@@ -734,7 +957,8 @@ libmosq_EXPORT int mosquitto_loop_forever(struct mosquitto *mosq, int timeout, i
  *
  * Returns:
  *	MOSQ_ERR_SUCCESS -       on success.
- * 	MOSQ_ERR_INVAL -         if the input parameters were invalid.
+ * 	MOSQ_ERR_INVAL -         if the input parameters were invalid, or the
+ * 	                         client was created with MOSQ_NEW_SINGLE_THREADED.
  *	MOSQ_ERR_NOT_SUPPORTED - if thread support is not available.
  *
  * See Also:
@@ -751,10 +975,14 @@ libmosq_EXPORT int mosquitto_loop_start(struct mosquitto *mosq);
  * you must have previously called <mosquitto_disconnect> or have set the force
  * parameter to true.
  *
+ * The network thread is woken up rather than cancelled, so it always finishes
+ * what it is doing, including any callback, before exiting.
+ *
  * Parameters:
  *  mosq - a valid mosquitto instance.
- *	force - set to true to force thread cancellation. If false,
- *	        <mosquitto_disconnect> must have already been called.
+ *	force - set to true to stop the thread even if the client is still
+ *	        connected. If false, <mosquitto_disconnect> must have already been
+ *	        called.
  *
  * Returns:
  *	MOSQ_ERR_SUCCESS -       on success.
@@ -876,6 +1104,28 @@ libmosq_EXPORT int mosquitto_loop_misc(struct mosquitto *mosq);
  */
 libmosq_EXPORT bool mosquitto_want_write(struct mosquitto *mosq);
 
+/*
+ * Function: mosquitto_next_timeout_ms
+ *
+ * For use with your own event loop, alongside <mosquitto_socket>,
+ * <mosquitto_want_write> and <mosquitto_interest_callback_set>. Returns how
+ * long the loop may wait before <mosquitto_loop_misc> next needs calling, to
+ * send a PINGREQ or retry a message for example. Ask again after each call to
+ * <mosquitto_loop_read>, <mosquitto_loop_write> or <mosquitto_loop_misc>, and
+ * whenever the interest callback is called.
+ *
+ * Parameters:
+ *	mosq - a valid mosquitto instance.
+ *
+ * Returns:
+ *	The number of milliseconds until <mosquitto_loop_misc> should be called,
+ *	0 if it should be called now, or -1 if the client is not connected.
+ *
+ * See Also:
+ *	<mosquitto_loop_misc>, <mosquitto_interest_callback_set>
+ */
+libmosq_EXPORT int mosquitto_next_timeout_ms(struct mosquitto *mosq);
+
 /*
  * Function: mosquitto_tls_set
  *
@@ -892,6 +1142,11 @@ libmosq_EXPORT bool mosquitto_want_write(struct mosquitto *mosq);
  * private key. If your private key is encrypted, provide a password callback
  * function or you will have to enter the password at the command line.
  *
+ * The files are loaded when the client first connects. Clients with the same
+ * TLS settings share the loaded certificates, and keep them across
+ * reconnects, so changes to the files on disk are only picked up once every
+ * such client has been destroyed or had its TLS settings changed.
+ *
  * Parameters:
  *  mosq -        a valid mosquitto instance.
  *  cafile -      path to a file containing the PEM encoded trusted CA
@@ -954,6 +1209,33 @@ libmosq_EXPORT int mosquitto_tls_set(struct mosquitto *mosq,
  */
 libmosq_EXPORT int mosquitto_tls_insecure_set(struct mosquitto *mosq, bool value);
 
+/*
+ * Function: mosquitto_tls_ktls_set
+ *
+ * Ask for the TLS record layer to be handed to the kernel (kTLS) once the
+ * handshake is complete. Writes still go through OpenSSL, which then passes
+ * the plaintext to the kernel to encrypt instead of encrypting it itself.
+ *
+ * This needs Linux with the tls kernel module and an OpenSSL built with
+ * kTLS support, and only works with the ciphers the kernel implements, such
+ * as AES-GCM. If any of these is missing the connection silently carries on
+ * in user space. Use <mosquitto_tls_stats> to see whether kTLS is in use.
+ * Must be called before <mosquitto_connect>.
+ *
+ * Parameters:
+ *  mosq -  a valid mosquitto instance.
+ *  value - set to true to use kTLS where possible. Defaults to false.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS -       on success.
+ * 	MOSQ_ERR_INVAL -         if the input parameters were invalid.
+ * 	MOSQ_ERR_NOT_SUPPORTED - if the library was built without kTLS support.
+ *
+ * See Also:
+ *	<mosquitto_tls_set>, <mosquitto_tls_stats>
+ */
+libmosq_EXPORT int mosquitto_tls_ktls_set(struct mosquitto *mosq, bool value);
+
 /*
  * Function: mosquitto_tls_opts_set
  *
@@ -988,6 +1270,38 @@ libmosq_EXPORT int mosquitto_tls_insecure_set(struct mosquitto *mosq, bool value
  */
 libmosq_EXPORT int mosquitto_tls_opts_set(struct mosquitto *mosq, int cert_reqs, const char *tls_version, const char *ciphers);
 
+/*
+ * Function: mosquitto_tls_stats
+ *
+ * Retrieve TLS handshake statistics for this client. A client keeps the TLS
+ * session from each connection and offers it when it reconnects to the same
+ * broker. If the broker accepts it the handshake is resumed, which saves a
+ * round trip and the public key operations. The saved session is dropped when
+ * the TLS options are changed or <mosquitto_connect> is called with a
+ * different host or port.
+ *
+ * Parameters:
+ *  mosq -  a valid mosquitto instance.
+ *  stats - a struct mosquitto_tls_stats to fill in, with:
+ *          handshakes - the number of TLS handshakes completed.
+ *          resumed - how many of those resumed an earlier session.
+ *          last_handshake_ms - the duration of the last handshake.
+ *          total_handshake_ms - the total duration of all handshakes.
+ *          ktls_send - true if the kernel is encrypting outgoing data on
+ *                      the current connection.
+ *          ktls_recv - true if the kernel is decrypting incoming data on
+ *                      the current connection.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS -       on success.
+ * 	MOSQ_ERR_INVAL -         if the input parameters were invalid.
+ * 	MOSQ_ERR_NOT_SUPPORTED - if TLS support is not available.
+ *
+ * See Also:
+ *	<mosquitto_tls_set>
+ */
+libmosq_EXPORT int mosquitto_tls_stats(struct mosquitto *mosq, struct mosquitto_tls_stats *stats);
+
 /*
  * Function: mosquitto_tls_psk_set
  *
@@ -1096,10 +1410,147 @@ libmosq_EXPORT void mosquitto_publish_callback_set(struct mosquitto *mosq, void
  *            should make copies of any of the data it requires.
  *
  * See Also:
- * 	<mosquitto_message_copy>
+ * 	<mosquitto_message_copy>, <mosquitto_message_callback_add>,
+ * 	<mosquitto_dispatch_start>
  */
 libmosq_EXPORT void mosquitto_message_callback_set(struct mosquitto *mosq, void (*on_message)(struct mosquitto *, void *, const struct mosquitto_message *));
 
+/*
+ * Function: mosquitto_message_callback_add
+ *
+ * Add a callback for messages whose topics match a subscription pattern.
+ * Each callback has its own user data, and any number may be added. A
+ * received message is passed to every callback whose pattern matches it, in
+ * no particular order, and to the callback set with
+ * <mosquitto_message_callback_set> only if none match. Finding the callbacks
+ * for a message takes time in proportion to the number of levels in its
+ * topic, not to the number of callbacks.
+ *
+ * Patterns are matched as the MQTT specification describes, so "foo/#" also
+ * matches "foo", and a pattern starting with "+" or "#" does not match a
+ * topic starting with "$", such as "$SYS/broker/uptime".
+ *
+ * This does not subscribe to anything; use <mosquitto_subscribe> as usual.
+ * Adding a callback that is already present for the same pattern and user
+ * data has no effect.
+ *
+ * Callbacks may be added and removed from any thread, including from within
+ * a callback. A callback may still be running on the network thread, or on
+ * a worker of the dispatch pool, when <mosquitto_message_callback_remove>
+ * returns on another thread, so do not free its user data until it can no
+ * longer be called.
+ *
+ * Parameters:
+ *  mosq -       a valid mosquitto instance.
+ *  sub -        the subscription pattern, in which "+" and "#" must each make
+ *               up a whole level and "#" must be the last level.
+ *  on_message - a callback function in the following form:
+ *               void callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message)
+ *  obj -        user data passed to the callback in place of the user data
+ *               provided in <mosquitto_new>.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS - on success.
+ * 	MOSQ_ERR_INVAL -   if the input parameters were invalid.
+ * 	MOSQ_ERR_NOMEM -   if an out of memory condition occurred.
+ *
+ * See Also:
+ * 	<mosquitto_message_callback_remove>
+ */
+libmosq_EXPORT int mosquitto_message_callback_add(struct mosquitto *mosq, const char *sub, void (*on_message)(struct mosquitto *, void *, const struct mosquitto_message *), void *obj);
+
+/*
+ * Function: mosquitto_message_callback_remove
+ *
+ * Remove a callback added with <mosquitto_message_callback_add>. The pattern,
+ * callback and user data must all be the same as when it was added.
+ *
+ * Parameters:
+ *  mosq -       a valid mosquitto instance.
+ *  sub -        the subscription pattern.
+ *  on_message - the callback function.
+ *  obj -        the user data.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS -   on success.
+ * 	MOSQ_ERR_INVAL -     if the input parameters were invalid.
+ * 	MOSQ_ERR_NOT_FOUND - if there is no such callback.
+ */
+libmosq_EXPORT int mosquitto_message_callback_remove(struct mosquitto *mosq, const char *sub, void (*on_message)(struct mosquitto *, void *, const struct mosquitto_message *), void *obj);
+
+/*
+ * Function: mosquitto_dispatch_start
+ *
+ * Run the message callback on a pool of worker threads rather than on the
+ * thread that reads from the network, so that slow message handling does
+ * not hold up reading, keepalive or acknowledgements.
+ *
+ * Each received message is assigned to one worker by hashing its topic, or
+ * the value returned by the key callback if one is given. Messages with the
+ * same topic or key are therefore delivered in the order they were received,
+ * one at a time, but messages on different workers are delivered
+ * concurrently, so the message callback must be thread safe. Queues are not
+ * bounded; use <mosquitto_dispatch_queue_depths> to monitor them.
+ *
+ * Call this before connecting or starting the network loop. Requires thread
+ * support.
+ *
+ * Parameters:
+ *  mosq -    a valid mosquitto instance.
+ *  workers - the number of worker threads, between 1 and 64.
+ *  key -     NULL to order messages by topic, or a function in the
+ *            following form that returns the ordering key for a message:
+ *            unsigned int key(const struct mosquitto_message *message, void *obj)
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS -       on success.
+ * 	MOSQ_ERR_INVAL -         if the input parameters were invalid, a pool is
+ * 	                         already running, or the client was created with
+ * 	                         MOSQ_NEW_SINGLE_THREADED.
+ * 	MOSQ_ERR_NOMEM -         if an out of memory condition occurred.
+ * 	MOSQ_ERR_ERRNO -         if a worker thread could not be created.
+ * 	MOSQ_ERR_NOT_SUPPORTED - if thread support is not available.
+ *
+ * See Also:
+ * 	<mosquitto_dispatch_stop>
+ */
+libmosq_EXPORT int mosquitto_dispatch_start(struct mosquitto *mosq, int workers, unsigned int (*key)(const struct mosquitto_message *, void *));
+
+/*
+ * Function: mosquitto_dispatch_stop
+ *
+ * Stop the dispatch pool started with <mosquitto_dispatch_start>. Messages
+ * already queued are delivered before this returns. Later messages are passed
+ * to the message callback on the network thread as usual. Do not call this
+ * while the network loop is running or from within the message callback.
+ * <mosquitto_destroy> stops the pool automatically.
+ *
+ * Parameters:
+ *  mosq - a valid mosquitto instance.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS -       on success.
+ * 	MOSQ_ERR_INVAL -         if the input parameters were invalid.
+ * 	MOSQ_ERR_NOT_SUPPORTED - if thread support is not available.
+ */
+libmosq_EXPORT int mosquitto_dispatch_stop(struct mosquitto *mosq);
+
+/*
+ * Function: mosquitto_dispatch_queue_depths
+ *
+ * Retrieve the number of messages waiting in each dispatch worker's queue.
+ *
+ * Parameters:
+ *  mosq -   a valid mosquitto instance.
+ *  depths - an array of at least count elements to receive the queue depths.
+ *  count -  the size of depths.
+ *
+ * Returns:
+ *	The number of workers in the pool, which may be more than count, 0 if
+ *	there is no pool, or -1 if the input parameters were invalid.
+ */
+libmosq_EXPORT int mosquitto_dispatch_queue_depths(struct mosquitto *mosq, unsigned int *depths, int count);
+
 /*
  * Function: mosquitto_subscribe_callback_set
  *
@@ -1139,6 +1590,93 @@ libmosq_EXPORT void mosquitto_subscribe_callback_set(struct mosquitto *mosq, voi
  */
 libmosq_EXPORT void mosquitto_unsubscribe_callback_set(struct mosquitto *mosq, void (*on_unsubscribe)(struct mosquitto *, void *, int));
 
+/*
+ * Function: mosquitto_reconnect_callback_set
+ *
+ * Set the reconnect callback. This is called by <mosquitto_loop_forever>, and
+ * so by the thread started with <mosquitto_loop_start>, immediately before
+ * each attempt to reconnect after the connection was lost.
+ *
+ * Parameters:
+ *  mosq -         a valid mosquitto instance.
+ *  on_reconnect - a callback function in the following form:
+ *                 void callback(struct mosquitto *mosq, void *obj, int attempt, unsigned int delay)
+ *
+ * Callback Parameters:
+ *  mosq -    the mosquitto instance making the callback.
+ *  obj -     the user data provided in <mosquitto_new>
+ *  attempt - the number of this attempt since the last successful
+ *            connection, starting at 1.
+ *  delay -   the number of milliseconds waited before this attempt.
+ */
+libmosq_EXPORT void mosquitto_reconnect_callback_set(struct mosquitto *mosq, void (*on_reconnect)(struct mosquitto *, void *, int, unsigned int));
+
+/*
+ * Function: mosquitto_interest_callback_set
+ *
+ * Set the interest callback. This is for applications that watch the client
+ * socket in their own event loop. It is called whenever the socket to watch
+ * or whether it should be watched for writing changes: when a connection is
+ * made or closed, when packets are queued on an empty queue and when the
+ * queue has been written out. It is called once straight away if the client
+ * is already connected, and is not called by <mosquitto_destroy>.
+ *
+ * The callback may be called from any thread that uses the client,
+ * including one calling <mosquitto_publish>. It must only update the event
+ * loop, and must not call any other mosquitto functions for this client.
+ *
+ * Parameters:
+ *  mosq -        a valid mosquitto instance.
+ *  on_interest - a callback function in the following form:
+ *                void callback(struct mosquitto *mosq, void *obj, int sock, bool want_write)
+ *
+ * Callback Parameters:
+ *  mosq -       the mosquitto instance making the callback.
+ *  obj -        the user data provided in <mosquitto_new>
+ *  sock -       the socket to watch for reading, or -1 if there is none.
+ *  want_write - true if the socket should also be watched for writing.
+ *
+ * See Also:
+ *	<mosquitto_next_timeout_ms>, <mosquitto_socket>, <mosquitto_want_write>
+ */
+libmosq_EXPORT void mosquitto_interest_callback_set(struct mosquitto *mosq, void (*on_interest)(struct mosquitto *, void *, int, bool));
+
+/*
+ * Function: mosquitto_pipeline_set
+ *
+ * Enable or disable pipelined session setup. When enabled, the client keeps
+ * track of the subscriptions made with <mosquitto_subscribe> and
+ * <mosquitto_subscribe_multiple> and removed with <mosquitto_unsubscribe>
+ * and <mosquitto_unsubscribe_multiple>. Each time it connects it sends the
+ * CONNECT, a single SUBSCRIBE for all of those topics and any messages that
+ * have not yet been delivered together, without waiting for the CONNACK.
+ * This saves a round trip on every connection.
+ *
+ * Subscriptions may be made before the client is connected, in which case
+ * they are sent on connection and mid is set to 0, as no packet has been
+ * sent yet. The SUBACK for the SUBSCRIBE sent later carries a message id the
+ * application has not seen. Unsubscribing while disconnected also sets mid
+ * to 0 and only removes the topics from the tracked subscriptions. The
+ * application should not resubscribe in its connect callback. If the broker
+ * refuses the connection, anything not yet written is dropped and sent again
+ * on the next attempt.
+ *
+ * Disabling pipelining forgets the tracked subscriptions. It is disabled by
+ * default.
+ *
+ * Parameters:
+ *  mosq -     a valid mosquitto instance.
+ *  pipeline - true to enable pipelined session setup.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS - on success.
+ * 	MOSQ_ERR_INVAL -   if the input parameters were invalid.
+ *
+ * See Also:
+ *	<mosquitto_subscribe>, <mosquitto_connect>
+ */
+libmosq_EXPORT int mosquitto_pipeline_set(struct mosquitto *mosq, bool pipeline);
+
 /*
  * Function: mosquitto_log_callback_set
  *
@@ -1168,20 +1706,26 @@ libmosq_EXPORT void mosquitto_log_callback_set(struct mosquitto *mosq, void (*on
  * Control the behaviour of the client when it has unexpectedly disconnected in
  * <mosquitto_loop_forever> or after <mosquitto_loop_start>. The default
  * behaviour if this function is not used is to repeatedly attempt to reconnect
- * with a delay of 1 second until the connection succeeds.
+ * with a delay of up to 1 second until the connection succeeds.
  *
  * Use reconnect_delay parameter to change the delay between successive
  * reconnection attempts. You may also enable exponential backoff of the time
  * between reconnections by setting reconnect_exponential_backoff to true and
  * set an upper bound on the delay with reconnect_delay_max.
  *
+ * The delay is an upper limit: the actual delay is picked at random between
+ * zero and that limit. This stops many clients that lost the same broker from
+ * reconnecting to it in lockstep. With exponential backoff the limit doubles
+ * after each failed attempt, up to reconnect_delay_max. The attempt count is
+ * reset once a connection is accepted by the broker.
+ *
  * Example 1:
  *	delay=2, delay_max=10, exponential_backoff=False
- *	Delays would be: 2, 4, 6, 8, 10, 10, ...
+ *	Delays would be up to: 2, 2, 2, 2, 2, ...
  *
  * Example 2:
  *	delay=3, delay_max=30, exponential_backoff=True
- *	Delays would be: 3, 6, 12, 24, 30, 30, ...
+ *	Delays would be up to: 3, 6, 12, 24, 30, 30, ...
  *
  * Parameters:
  *  mosq -                          a valid mosquitto instance.
@@ -1196,9 +1740,80 @@ libmosq_EXPORT void mosquitto_log_callback_set(struct mosquitto *mosq, void (*on
  * Returns:
  *	MOSQ_ERR_SUCCESS - on success.
  * 	MOSQ_ERR_INVAL -   if the input parameters were invalid.
+ *
+ * See Also:
+ * 	<mosquitto_reconnect_delay_ms_set>
  */
 libmosq_EXPORT int mosquitto_reconnect_delay_set(struct mosquitto *mosq, unsigned int reconnect_delay, unsigned int reconnect_delay_max, bool reconnect_exponential_backoff);
 
+/*
+ * Function: mosquitto_reconnect_delay_ms_set
+ *
+ * As for <mosquitto_reconnect_delay_set>, but with the delays given in
+ * milliseconds.
+ *
+ * Parameters:
+ *  mosq -                          a valid mosquitto instance.
+ *  reconnect_delay_ms -            the number of milliseconds to wait between
+ *                                  reconnects.
+ *  reconnect_delay_max_ms -        the maximum number of milliseconds to wait
+ *                                  between reconnects.
+ *  reconnect_exponential_backoff - use exponential backoff between
+ *                                  reconnect attempts. Set to true to enable
+ *                                  exponential backoff.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS - on success.
+ * 	MOSQ_ERR_INVAL -   if the input parameters were invalid.
+ */
+libmosq_EXPORT int mosquitto_reconnect_delay_ms_set(struct mosquitto *mosq, unsigned int reconnect_delay_ms, unsigned int reconnect_delay_max_ms, bool reconnect_exponential_backoff);
+
+/*
+ * Function: mosquitto_connect_attempt_delay_set
+ *
+ * When the broker hostname resolves to more than one address, the connect
+ * and reconnect functions race connections to them in the manner of RFC 8305
+ * ("Happy Eyeballs"). IPv6 and IPv4 addresses are alternated and a new
+ * attempt is started every attempt_delay_ms, or as soon as the previous
+ * attempt fails. The first connection to complete is used and the others are
+ * closed. The non-blocking functions such as <mosquitto_connect_async> start
+ * the race and leave the network loop to finish it, so <mosquitto_socket> is
+ * the most recent attempt until then.
+ *
+ * Parameters:
+ *  mosq -             a valid mosquitto instance.
+ *  attempt_delay_ms - the number of milliseconds to wait for one attempt
+ *                     before starting the next. Defaults to 250. Set to 0 to
+ *                     try each address in turn until it fails.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS - on success.
+ * 	MOSQ_ERR_INVAL -   if the input parameters were invalid.
+ */
+libmosq_EXPORT int mosquitto_connect_attempt_delay_set(struct mosquitto *mosq, unsigned int attempt_delay_ms);
+
+/*
+ * Function: mosquitto_address_cache_ttl_set
+ *
+ * The addresses that broker hostnames resolve to are cached and shared by all
+ * clients in the process, so that many clients reconnecting at once do not
+ * each query the resolver. The address that last accepted a connection is
+ * tried first. Failing to connect does not drop an entry, because a broker
+ * that is restarting would then send every client back to the resolver at
+ * once; the next attempt starts with the following address instead. The
+ * hostname is resolved again once the entry expires.
+ *
+ * This function sets how long entries are kept. It affects all clients.
+ *
+ * Parameters:
+ *  ttl_ms - the number of milliseconds to keep resolved addresses for.
+ *           Defaults to 60000. Set to 0 to disable the cache.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS - always.
+ */
+libmosq_EXPORT int mosquitto_address_cache_ttl_set(unsigned int ttl_ms);
+
 /*
  * Function: mosquitto_max_inflight_messages_set
  *
@@ -1233,10 +1848,47 @@ libmosq_EXPORT int mosquitto_max_inflight_messages_set(struct mosquitto *mosq, u
  * Parameters:
  *  mosq -          a valid mosquitto instance.
  *  message_retry - the number of seconds to wait for a response before
- *                  retrying. Defaults to 20.
+ *                  retrying. Defaults to 20. Values above UINT_MAX/1000
+ *                  (about 49 days) are treated as UINT_MAX/1000.
+ *
+ * See Also:
+ * 	<mosquitto_message_retry_ms_set>
  */
 libmosq_EXPORT void mosquitto_message_retry_set(struct mosquitto *mosq, unsigned int message_retry);
 
+/*
+ * Function: mosquitto_message_retry_ms_set
+ *
+ * Set the number of milliseconds to wait before retrying messages. This
+ * applies to publish messages with QoS>0. May be called at any time.
+ *
+ * With a retry interval below one second, <mosquitto_loop> called with a
+ * negative timeout waits no longer than the retry interval so that retries
+ * are sent on time.
+ *
+ * Parameters:
+ *  mosq -             a valid mosquitto instance.
+ *  message_retry_ms - the number of milliseconds to wait for a response
+ *                     before retrying. Defaults to 20000.
+ */
+libmosq_EXPORT void mosquitto_message_retry_ms_set(struct mosquitto *mosq, unsigned int message_retry_ms);
+
+/*
+ * Function: mosquitto_message_expired_count
+ *
+ * Retrieve the number of outgoing messages that have been discarded because
+ * their time to live expired before they could be delivered. See
+ * <mosquitto_publish_ttl>.
+ *
+ * Parameters:
+ *  mosq - a valid mosquitto instance.
+ *
+ * Returns:
+ *	The number of expired messages dropped since the client was created, or 0
+ *	if mosq is NULL.
+ */
+libmosq_EXPORT unsigned long mosquitto_message_expired_count(struct mosquitto *mosq);
+
 /*
  * Function: mosquitto_user_data_set
  *
@@ -1338,7 +1990,7 @@ libmosq_EXPORT const char *mosquitto_connack_string(int connack_code);
  * > }
  *
  * See Also:
- *	<mosquitto_sub_topic_tokens_free>
+ *	<mosquitto_sub_topic_tokens_free>, <mosquitto_sub_topic_tokenise_view>
  */
 libmosq_EXPORT int mosquitto_sub_topic_tokenise(const char *subtopic, char ***topics, int *count);
 
@@ -1360,6 +2012,54 @@ libmosq_EXPORT int mosquitto_sub_topic_tokenise(const char *subtopic, char ***to
  */
 libmosq_EXPORT int mosquitto_sub_topic_tokens_free(char ***topics, int count);
 
+/*
+ * Function mosquitto_sub_topic_tokenise_view
+ *
+ * Tokenise a topic or subscription string in the same way as
+ * <mosquitto_sub_topic_tokenise>, but without allocating or copying
+ * anything. Each level is described by its offset and length within
+ * subtopic. A level that <mosquitto_sub_topic_tokenise> would return as NULL
+ * has a length of 0.
+ *
+ * For example, "/a/deep//topic/" would result in:
+ *
+ * levels[0] = {0, 0}
+ * levels[1] = {1, 1}  "a"
+ * levels[2] = {3, 4}  "deep"
+ * levels[3] = {9, 5}  "topic"
+ *
+ * Parameters:
+ *	subtopic -   the subscription/topic to tokenise
+ *	levels -     an array of at least max_levels elements to store the levels
+ *	             in. May be NULL if max_levels is 0.
+ *	max_levels - the size of levels.
+ *	count -      an int pointer to store the number of levels in subtopic.
+ *	             This is set even if levels is too small to hold them all.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS - on success
+ * 	MOSQ_ERR_INVAL -   if the input parameters were invalid.
+ * 	MOSQ_ERR_NOMEM -   if there are more than max_levels levels. The first
+ * 	                   max_levels have been stored, and count holds the size
+ * 	                   needed for all of them.
+ *
+ * Example:
+ *
+ * > struct mosquitto_topic_level levels[16];
+ * > int level_count;
+ * > int i;
+ * >
+ * > if(!mosquitto_sub_topic_tokenise_view(topic, levels, 16, &level_count)){
+ * >     for(i=0; i<level_count; i++){
+ * >         printf("%d: %.*s\n", i, levels[i].len, topic+levels[i].offset);
+ * >     }
+ * > }
+ *
+ * See Also:
+ *	<mosquitto_sub_topic_tokenise>
+ */
+libmosq_EXPORT int mosquitto_sub_topic_tokenise_view(const char *subtopic, struct mosquitto_topic_level *levels, int max_levels, int *count);
+
 /*
  * Function mosquitto_topic_matches_sub
  *
@@ -1383,6 +2083,102 @@ libmosq_EXPORT int mosquitto_sub_topic_tokens_free(char ***topics, int count);
  */
 libmosq_EXPORT int mosquitto_topic_matches_sub(const char *sub, const char *topic, bool *result);
 
+/*
+ * Function mosquitto_topic_matches_sub2
+ *
+ * Check whether a topic matches a subscription, as <mosquitto_topic_matches_sub>
+ * does, but with the lengths of both strings given. Neither string needs to
+ * be zero terminated, so a topic can be matched straight out of a larger
+ * buffer. The match is done in place without allocating any memory.
+ *
+ * As with <mosquitto_topic_matches_sub>, runs of slashes count as a single
+ * slash and trailing slashes are ignored.
+ *
+ * Parameters:
+ *	sub -      subscription string to check topic against.
+ *	sublen -   length in bytes of sub.
+ *	topic -    topic to check.
+ *	topiclen - length in bytes of topic.
+ *	result -   bool pointer to hold result. Will be set to true if the topic
+ *	           matches the subscription.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS - on success
+ * 	MOSQ_ERR_INVAL -   if the input parameters were invalid.
+ *
+ * See Also:
+ *	<mosquitto_topic_matches_sub>
+ */
+libmosq_EXPORT int mosquitto_topic_matches_sub2(const char *sub, size_t sublen, const char *topic, size_t topiclen, bool *result);
+
+/*
+ * Function mosquitto_filter_set_compile
+ *
+ * Compile a list of subscription filters into a set that can be matched
+ * against a topic in one pass with <mosquitto_filter_set_match>. The cost of
+ * a match depends on the number of levels in the topic and how many "+"
+ * filters could match it, rather than on the number of filters.
+ *
+ * Topics and filters are split into levels as <mosquitto_sub_topic_tokenise>
+ * does, and matched as the MQTT specification describes. A filter ending in
+ * "/#" always matches its parent, so "a/#" matches "a", which
+ * <mosquitto_topic_matches_sub> misses when the parent level is a single
+ * character. A filter starting with "+" or "#" does not match a topic
+ * starting with "$", which <mosquitto_topic_matches_sub> does.
+ *
+ * A compiled set is never modified, so it may be used by several threads at
+ * once.
+ *
+ * Parameters:
+ *	set -          pointer to store the new set in. Free it with
+ *	               <mosquitto_filter_set_free>.
+ *	filters -      array of filter_count subscription filters, in which "+"
+ *	               and "#" must each make up a whole level and "#" must be the
+ *	               last level. Filters may repeat.
+ *	filter_count - the number of filters.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS - on success
+ * 	MOSQ_ERR_INVAL -   if the input parameters were invalid.
+ * 	MOSQ_ERR_NOMEM -   if an out of memory condition occurred.
+ *
+ * See Also:
+ *	<mosquitto_filter_set_match>, <mosquitto_filter_set_free>
+ */
+libmosq_EXPORT int mosquitto_filter_set_compile(struct mosquitto_filter_set **set, const char *const *filters, int filter_count);
+
+/*
+ * Function mosquitto_filter_set_match
+ *
+ * Find which filters in a compiled set match a topic.
+ *
+ * Parameters:
+ *	set -      a set from <mosquitto_filter_set_compile>.
+ *	topic -    topic to check. It need not be zero terminated.
+ *	topiclen - length in bytes of topic.
+ *	bitmap -   an array of at least (filter_count+7)/8 bytes. Bit i%8 of
+ *	           byte i/8 is set if filter i matches the topic, and cleared if
+ *	           it does not.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS - on success
+ * 	MOSQ_ERR_INVAL -   if the input parameters were invalid.
+ *
+ * See Also:
+ *	<mosquitto_filter_set_compile>
+ */
+libmosq_EXPORT int mosquitto_filter_set_match(const struct mosquitto_filter_set *set, const char *topic, size_t topiclen, unsigned char *bitmap);
+
+/*
+ * Function mosquitto_filter_set_free
+ *
+ * Free a set from <mosquitto_filter_set_compile>.
+ *
+ * Parameters:
+ *	set - the set to free. May be NULL.
+ */
+libmosq_EXPORT void mosquitto_filter_set_free(struct mosquitto_filter_set *set);
+
 #ifdef __cplusplus
 }
 #endif
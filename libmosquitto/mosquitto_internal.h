@@ -53,6 +53,7 @@ POSSIBILITY OF SUCH DAMAGE.
 		typedef unsigned short uint16_t;
 		typedef unsigned int uint32_t;
 		typedef unsigned long long uint64_t;
+		typedef long long int64_t;
 #	else
 #		include <stdint.h>
 #	endif
@@ -60,6 +61,12 @@ POSSIBILITY OF SUCH DAMAGE.
 #	include <stdint.h>
 #endif
 
+#ifdef WIN32
+typedef SOCKET mosq_sock_t;
+#else
+typedef int mosq_sock_t;
+#endif
+
 #include "mosquitto.h"
 #include "time_mosq.h"
 #ifdef WITH_BROKER
@@ -110,13 +117,20 @@ struct _mosquitto_packet{
 
 struct mosquitto_message_all{
 	struct mosquitto_message_all *next;
-	time_t timestamp;
+	int64_t timestamp; /* ms, from mosquitto_time_ms() */
+	int64_t expiry;
 	enum mosquitto_msg_direction direction;
 	enum mosquitto_msg_state state;
 	bool dup;
 	struct mosquitto_message msg;
 };
 
+struct _mosquitto_session_sub{
+	struct _mosquitto_session_sub *next;
+	char *topic;
+	int qos;
+};
+
 struct mosquitto {
 #ifndef WIN32
 	int sock;
@@ -128,15 +142,33 @@ struct mosquitto {
 	char *username;
 	char *password;
 	uint16_t keepalive;
+	unsigned int connect_attempt_delay; /* ms */
+	/* A non-blocking connect that is still racing the broker's addresses,
+	 * see net_mosq.c. Like sock, it belongs to the thread running the network
+	 * loop. */
+	struct _mosquitto_connect_race *connect_race;
+	/* Set while connect_race is still looking up the broker's address, and
+	 * read by any thread with MOSQ_ATOMIC_LOAD_INT(). */
+	int connect_resolving;
 	bool clean_session;
+	/* state, last_msg_in and last_msg_out are shared between the network
+	 * thread and the application, so are only accessed with the
+	 * MOSQ_ATOMIC_* operations from atomic_mosq.h. */
 	enum mosquitto_client_state state;
-	time_t last_msg_in;
-	time_t last_msg_out;
-	time_t ping_t;
+	int64_t last_msg_in; /* ms, from mosquitto_time_ms() */
+	int64_t last_msg_out;
+	int64_t ping_t;
 	uint16_t last_mid;
 	struct _mosquitto_packet in_packet;
 	struct _mosquitto_packet *current_out_packet;
+	/* Outgoing packets form an intrusive multi-producer, single-consumer
+	 * queue. Any thread may add packets to the tail (out_packet_last) without
+	 * locking, but only the holder of current_out_packet_mutex may remove them
+	 * from the head (out_packet). out_packet_stub keeps the queue non-empty so
+	 * that producers never touch the head. See net_mosq.c. */
 	struct _mosquitto_packet *out_packet;
+	struct _mosquitto_packet *out_packet_last;
+	struct _mosquitto_packet out_packet_stub;
 	struct mosquitto_message *will;
 #ifdef WITH_TLS
 	SSL *ssl;
@@ -152,16 +184,33 @@ struct mosquitto {
 	char *tls_psk;
 	char *tls_psk_identity;
 	bool tls_insecure;
+	bool tls_ktls;
+	/* Set once the handshake has finished if the kernel took over the
+	 * record layer in that direction. See _mosquitto_tls_handshake_check(). */
+	bool tls_ktls_send;
+	bool tls_ktls_recv;
+	/* Staging buffer for gathering small packets into a single TLS record,
+	 * MOSQ_TLS_RECORD_MAX bytes, allocated on first use. */
+	uint8_t *tls_wbuf;
+	/* The session from the last handshake, offered on the next connect so
+	 * that the broker can resume it. See tls_mosq.c. */
+	SSL_SESSION *tls_session;
+	int64_t tls_handshake_start;
+	bool tls_handshake_done;
+	/* Handshake statistics, read by mosquitto_tls_stats() from any thread. */
+	int tls_handshakes; /* atomic */
+	int tls_resumed; /* atomic */
+	int64_t tls_handshake_ms_last; /* atomic */
+	int64_t tls_handshake_ms_total; /* atomic */
 #endif
 	bool want_write;
 #if defined(WITH_THREADING) && !defined(WITH_BROKER)
 	pthread_mutex_t callback_mutex;
 	pthread_mutex_t log_callback_mutex;
-	pthread_mutex_t msgtime_mutex;
-	pthread_mutex_t out_packet_mutex;
 	pthread_mutex_t current_out_packet_mutex;
-	pthread_mutex_t state_mutex;
 	pthread_mutex_t message_mutex;
+	pthread_mutex_t interest_mutex;
+	pthread_mutex_t route_mutex;
 	pthread_t thread_id;
 #endif
 #ifdef WITH_BROKER
@@ -173,12 +222,12 @@ struct mosquitto {
 	time_t disconnect_t;
 	int pollfd_index;
 	int db_index;
-	struct _mosquitto_packet *out_packet_last;
 #else
 	void *userdata;
-	bool in_callback;
-	unsigned int message_retry;
-	time_t last_retry_check;
+	unsigned int message_retry; /* ms */
+	/* When _mosquitto_message_retry_check() next has work to do, or -1 for
+	 * never. Updated with message_mutex held, read atomically. */
+	int64_t next_retry_check;
 	struct mosquitto_message_all *messages;
 	void (*on_connect)(struct mosquitto *, void *userdata, int rc);
 	void (*on_disconnect)(struct mosquitto *, void *userdata, int rc);
@@ -187,20 +236,77 @@ struct mosquitto {
 	void (*on_subscribe)(struct mosquitto *, void *userdata, int mid, int qos_count, const int *granted_qos);
 	void (*on_unsubscribe)(struct mosquitto *, void *userdata, int mid);
 	void (*on_log)(struct mosquitto *, void *userdata, int level, const char *str);
+	void (*on_reconnect)(struct mosquitto *, void *userdata, int attempt, unsigned int delay);
+	/* on_interest is read atomically. interest_sock and interest_write are
+	 * what it was last told, protected by interest_mutex. */
+	void (*on_interest)(struct mosquitto *, void *userdata, int sock, bool want_write);
+	mosq_sock_t interest_sock;
+	bool interest_write;
 	//void (*on_error)();
 	char *host;
 	int port;
 	int queue_len;
 	char *bind_address;
-	unsigned int reconnect_delay;
+	unsigned int reconnect_delay; /* ms */
 	unsigned int reconnect_delay_max;
 	bool reconnect_exponential_backoff;
+	unsigned int reconnect_attempts;
+	uint32_t reconnect_rand;
+	struct _mosquitto_dispatch *dispatch;
+	/* Per-subscription message callbacks, see route_mosq.c. The trie is
+	 * protected by route_mutex, route_count is read atomically. */
+	struct _mosquitto_route_node *routes;
+	int route_count;
+	/* Pipelined session setup, see session_mosq.c. Protected by
+	 * message_mutex. */
+	bool pipeline;
+	struct _mosquitto_session_sub *session_subs;
+	int session_sub_count;
 	bool threaded;
-	struct _mosquitto_packet *out_packet_last;
+	/* Set by MOSQ_NEW_SINGLE_THREADED, in which case the per-client mutexes
+	 * are never locked. single_thread_owner and single_thread_depth are only
+	 * used by debug builds to catch two threads using the client at once. */
+	bool single_threaded;
+	pthread_t single_thread_owner;
+	int single_thread_depth;
+	int loop_stop_requested; /* atomic */
+	/* Written to by any thread to wake the network loop from select(). */
+	mosq_sock_t sockpairR;
+	mosq_sock_t sockpairW;
 	struct mosquitto_message_all *messages_last;
 	int inflight_messages;
 	int max_inflight_messages;
+	unsigned long messages_expired;
 #endif
 };
 
+/* Lock and unlock the per-client mutexes. These are no-ops for clients
+ * created with MOSQ_NEW_SINGLE_THREADED. */
+#if defined(WITH_THREADING) && !defined(WITH_BROKER)
+#  define _mosquitto_mutex_lock(mosq, mutex) do{ \
+		if((mosq)->single_threaded){ \
+			_mosquitto_single_thread_enter(mosq); \
+		}else{ \
+			pthread_mutex_lock(mutex); \
+		} \
+	}while(0)
+#  define _mosquitto_mutex_unlock(mosq, mutex) do{ \
+		if((mosq)->single_threaded){ \
+			_mosquitto_single_thread_leave(mosq); \
+		}else{ \
+			pthread_mutex_unlock(mutex); \
+		} \
+	}while(0)
+#  ifdef NDEBUG
+#    define _mosquitto_single_thread_enter(mosq)
+#    define _mosquitto_single_thread_leave(mosq)
+#  else
+void _mosquitto_single_thread_enter(struct mosquitto *mosq);
+void _mosquitto_single_thread_leave(struct mosquitto *mosq);
+#  endif
+#else
+#  define _mosquitto_mutex_lock(mosq, mutex) pthread_mutex_lock(mutex)
+#  define _mosquitto_mutex_unlock(mosq, mutex) pthread_mutex_unlock(mutex)
+#endif
+
 #endif
@@ -34,7 +34,10 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <string.h>
 #ifndef WIN32
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #else
 #include <winsock2.h>
@@ -82,6 +85,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #  include <read_handle.h>
 #endif
 
+#include "atomic_mosq.h"
 #include "logging_mosq.h"
 #include "memory_mosq.h"
 #include "mqtt3_protocol.h"
@@ -112,6 +116,8 @@ void _mosquitto_net_init(void)
 
 void _mosquitto_net_cleanup(void)
 {
+	_mosquitto_addr_cache_cleanup();
+
 #ifdef WITH_TLS
 	ERR_free_strings();
 	EVP_cleanup();
@@ -139,34 +145,310 @@ void _mosquitto_packet_cleanup(struct _mosquitto_packet *packet)
 	packet->pos = 0;
 }
 
+/* The outgoing packet queue is an intrusive multi-producer, single-consumer
+ * queue after Dmitry Vyukov. Producers link packets onto the tail with a
+ * single atomic exchange and never block. The consumer is whoever holds
+ * current_out_packet_mutex, and it alone moves the head. The queue always
+ * contains at least one node - the stub embedded in struct mosquitto is
+ * pushed back on whenever the last real packet is removed - so the head and
+ * tail never have to be updated together. */
+void _mosquitto_packet_queue_init(struct mosquitto *mosq)
+{
+	assert(mosq);
+
+	memset(&mosq->out_packet_stub, 0, sizeof(struct _mosquitto_packet));
+	mosq->out_packet = &mosq->out_packet_stub;
+	mosq->out_packet_last = &mosq->out_packet_stub;
+}
+
+/* Returns true if the queue was empty before the push. */
+static bool _mosquitto_packet_queue_push(struct mosquitto *mosq, struct _mosquitto_packet *first, struct _mosquitto_packet *last)
+{
+	struct _mosquitto_packet *prev;
+
+	last->next = NULL;
+	prev = MOSQ_ATOMIC_XCHG_PTR(&mosq->out_packet_last, last);
+	/* Between the exchange and this store the queue is briefly disconnected.
+	 * The consumer sees this as the queue ending at prev. */
+	MOSQ_ATOMIC_STORE_PTR(&prev->next, first);
+
+	return prev == &mosq->out_packet_stub;
+}
+
+/* Remove the packet at the head of the queue. Must only be called by the
+ * holder of current_out_packet_mutex. Returns NULL if the queue is empty, or
+ * if a producer is part way through adding the only remaining packet. */
+struct _mosquitto_packet *_mosquitto_packet_queue_pop(struct mosquitto *mosq)
+{
+	struct _mosquitto_packet *stub = &mosq->out_packet_stub;
+	struct _mosquitto_packet *head = mosq->out_packet;
+	struct _mosquitto_packet *next;
+
+	next = MOSQ_ATOMIC_LOAD_PTR(&head->next);
+	if(head == stub){
+		if(!next) return NULL;
+		mosq->out_packet = next;
+		head = next;
+		next = MOSQ_ATOMIC_LOAD_PTR(&head->next);
+	}
+	if(next){
+		mosq->out_packet = next;
+		return head;
+	}
+	if(head != MOSQ_ATOMIC_LOAD_PTR(&mosq->out_packet_last)){
+		return NULL;
+	}
+	_mosquitto_packet_queue_push(mosq, stub, stub);
+	next = MOSQ_ATOMIC_LOAD_PTR(&head->next);
+	if(next){
+		mosq->out_packet = next;
+		return head;
+	}
+	return NULL;
+}
+
+/* Return the packet after prev in the queue, or the first packet in the queue
+ * if prev is NULL, without removing anything. Must only be called by the
+ * holder of current_out_packet_mutex. */
+struct _mosquitto_packet *_mosquitto_packet_queue_peek(struct mosquitto *mosq, struct _mosquitto_packet *prev)
+{
+	struct _mosquitto_packet *packet;
+
+	if(prev){
+		packet = MOSQ_ATOMIC_LOAD_PTR(&prev->next);
+	}else{
+		packet = mosq->out_packet;
+	}
+	if(packet == &mosq->out_packet_stub){
+		packet = MOSQ_ATOMIC_LOAD_PTR(&packet->next);
+	}
+	return packet;
+}
+
+/* Returns true if there are no packets waiting in the queue. This can be
+ * called from any thread. */
+bool _mosquitto_packet_queue_empty(struct mosquitto *mosq)
+{
+	return MOSQ_ATOMIC_LOAD_PTR(&mosq->out_packet_last) == &mosq->out_packet_stub;
+}
+
+/* Free the packet currently being written and everything in the queue. The
+ * caller must hold current_out_packet_mutex. */
+void _mosquitto_packet_queue_clear(struct mosquitto *mosq)
+{
+	struct _mosquitto_packet *packet;
+
+	if(!mosq->out_packet) return; /* Never initialised */
+
+	if(mosq->current_out_packet){
+		_mosquitto_packet_cleanup(mosq->current_out_packet);
+		_mosquitto_free(mosq->current_out_packet);
+		mosq->current_out_packet = NULL;
+	}
+	while((packet = _mosquitto_packet_queue_pop(mosq))){
+		_mosquitto_packet_cleanup(packet);
+		_mosquitto_free(packet);
+	}
+}
+
 int _mosquitto_packet_queue(struct mosquitto *mosq, struct _mosquitto_packet *packet)
 {
 	assert(mosq);
 	assert(packet);
 
-	packet->pos = 0;
-	packet->to_process = packet->packet_length;
-
 	packet->next = NULL;
-	pthread_mutex_lock(&mosq->out_packet_mutex);
-	if(mosq->out_packet){
-		mosq->out_packet_last->next = packet;
-	}else{
-		mosq->out_packet = packet;
+	return _mosquitto_packet_queue_chain(mosq, packet);
+}
+
+/* Queue a list of packets, linked through their next pointers and terminated
+ * by NULL, with a single atomic operation on the out packet queue and a single
+ * write attempt. */
+int _mosquitto_packet_queue_chain(struct mosquitto *mosq, struct _mosquitto_packet *packet)
+{
+	struct _mosquitto_packet *last;
+	bool was_empty;
+#ifndef WITH_BROKER
+	int rc;
+#endif
+
+	assert(mosq);
+	assert(packet);
+
+	last = packet;
+	while(1){
+		last->pos = 0;
+		last->to_process = last->packet_length;
+		if(!last->next) break;
+		last = last->next;
 	}
-	mosq->out_packet_last = packet;
-	pthread_mutex_unlock(&mosq->out_packet_mutex);
+
+	was_empty = _mosquitto_packet_queue_push(mosq, packet, last);
 #ifdef WITH_BROKER
 	return _mosquitto_packet_write(mosq);
 #else
-	if(mosq->in_callback == false && mosq->threaded == false){
-		return _mosquitto_packet_write(mosq);
+	if(!_mosquitto_callback_active() && mosq->threaded == false){
+		rc = _mosquitto_packet_write(mosq);
+		_mosquitto_interest_update(mosq);
+		return rc;
 	}else{
+		/* The network thread may be waiting in select() without the socket in
+		 * its write set, and that includes a loop that is running this
+		 * callback. It only needs telling when the queue was empty, otherwise
+		 * it is already waiting to write. */
+		if(was_empty){
+			_mosquitto_loop_wakeup(mosq);
+			_mosquitto_interest_update(mosq);
+		}
 		return MOSQ_ERR_SUCCESS;
 	}
 #endif
 }
 
+#ifndef WITH_BROKER
+/* Create a pair of connected, non-blocking descriptors that can be used with
+ * select(). Anything written to pairW can be read from pairR. */
+int _mosquitto_socketpair(mosq_sock_t *pairR, mosq_sock_t *pairW)
+{
+#ifndef WIN32
+	int fds[2];
+	int i;
+	int opt;
+
+	*pairR = INVALID_SOCKET;
+	*pairW = INVALID_SOCKET;
+
+	if(pipe(fds)){
+		return MOSQ_ERR_ERRNO;
+	}
+	for(i=0; i<2; i++){
+		opt = fcntl(fds[i], F_GETFL, 0);
+		if(opt == -1 || fcntl(fds[i], F_SETFL, opt | O_NONBLOCK) == -1){
+			COMPAT_CLOSE(fds[0]);
+			COMPAT_CLOSE(fds[1]);
+			return MOSQ_ERR_ERRNO;
+		}
+	}
+	*pairR = fds[0];
+	*pairW = fds[1];
+	return MOSQ_ERR_SUCCESS;
+#else
+	/* select() on Windows only works with sockets, so use a connected pair of
+	 * loopback TCP sockets. */
+	SOCKET listensock;
+	struct sockaddr_in addr;
+	int addrlen = sizeof(addr);
+	u_long val = 1;
+
+	*pairR = INVALID_SOCKET;
+	*pairW = INVALID_SOCKET;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+
+	listensock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if(listensock == INVALID_SOCKET) return MOSQ_ERR_ERRNO;
+	if(bind(listensock, (struct sockaddr *)&addr, sizeof(addr))
+			|| listen(listensock, 1)
+			|| getsockname(listensock, (struct sockaddr *)&addr, &addrlen)){
+		COMPAT_CLOSE(listensock);
+		return MOSQ_ERR_ERRNO;
+	}
+	*pairW = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if(*pairW == INVALID_SOCKET || connect(*pairW, (struct sockaddr *)&addr, sizeof(addr))){
+		COMPAT_CLOSE(listensock);
+		if(*pairW != INVALID_SOCKET) COMPAT_CLOSE(*pairW);
+		*pairW = INVALID_SOCKET;
+		return MOSQ_ERR_ERRNO;
+	}
+	*pairR = accept(listensock, NULL, NULL);
+	COMPAT_CLOSE(listensock);
+	if(*pairR == INVALID_SOCKET
+			|| ioctlsocket(*pairR, FIONBIO, &val)
+			|| ioctlsocket(*pairW, FIONBIO, &val)){
+
+		if(*pairR != INVALID_SOCKET) COMPAT_CLOSE(*pairR);
+		COMPAT_CLOSE(*pairW);
+		*pairR = INVALID_SOCKET;
+		*pairW = INVALID_SOCKET;
+		return MOSQ_ERR_ERRNO;
+	}
+	return MOSQ_ERR_SUCCESS;
+#endif
+}
+
+static void _mosquitto_socketpair_signal(mosq_sock_t pairW)
+{
+	char sockpair_data = 0;
+
+	/* If the pair is full then a signal is already pending, so a failed write
+	 * doesn't matter. */
+#ifndef WIN32
+	if(write(pairW, &sockpair_data, 1)){
+	}
+#else
+	send(pairW, &sockpair_data, 1, 0);
+#endif
+}
+
+static void _mosquitto_socketpair_drain(mosq_sock_t pairR)
+{
+	char buf[64];
+
+#ifndef WIN32
+	while(read(pairR, buf, sizeof(buf)) == sizeof(buf)){
+	}
+#else
+	while(recv(pairR, buf, sizeof(buf), 0) == sizeof(buf)){
+	}
+#endif
+}
+
+/* Wake the network loop if it is waiting in select(). Safe to call from any
+ * thread. */
+void _mosquitto_loop_wakeup(struct mosquitto *mosq)
+{
+	if(mosq->sockpairW == INVALID_SOCKET) return;
+	_mosquitto_socketpair_signal(mosq->sockpairW);
+}
+
+/* Discard any pending wakeups. Called by the network loop. */
+void _mosquitto_loop_wakeup_clear(struct mosquitto *mosq)
+{
+	if(mosq->sockpairR == INVALID_SOCKET) return;
+	_mosquitto_socketpair_drain(mosq->sockpairR);
+}
+
+/* Tell the application, through on_interest, if the socket or whether it
+ * should be watched for writing has changed since it was last told. Called
+ * after anything that can change either. */
+void _mosquitto_interest_update(struct mosquitto *mosq)
+{
+	void (*on_interest)(struct mosquitto *, void *, int, bool);
+	bool want_write;
+
+	on_interest = MOSQ_ATOMIC_LOAD_PTR(&mosq->on_interest);
+	if(!on_interest) return;
+
+	/* The lock keeps the order of the calls the same as the order of the
+	 * changes they report. */
+	_mosquitto_mutex_lock(mosq, &mosq->interest_mutex);
+	want_write = mosq->sock != INVALID_SOCKET && mosquitto_want_write(mosq);
+#ifdef WITH_TLS
+	if(mosq->sock != INVALID_SOCKET && mosq->ssl && mosq->want_write){
+		want_write = true;
+	}
+#endif
+	if(mosq->sock != mosq->interest_sock || want_write != mosq->interest_write){
+		mosq->interest_sock = mosq->sock;
+		mosq->interest_write = want_write;
+		on_interest(mosq, mosq->userdata, mosq->sock, want_write);
+	}
+	_mosquitto_mutex_unlock(mosq, &mosq->interest_mutex);
+}
+#endif
+
 /* Close a socket associated with a context and set it to -1.
  * Returns 1 on failure (context is NULL)
  * Returns 0 on success.
@@ -176,58 +458,760 @@ int _mosquitto_socket_close(struct mosquitto *mosq)
 	int rc = 0;
 
 	assert(mosq);
+#ifndef WITH_BROKER
+	if(mosq->connect_race){
+		/* mosq->sock is one of the race's attempts. */
+		_mosquitto_connect_race_cancel(mosq);
+	}
+#endif
 #ifdef WITH_TLS
 	if(mosq->ssl){
 		SSL_shutdown(mosq->ssl);
 		SSL_free(mosq->ssl);
 		mosq->ssl = NULL;
 	}
-	if(mosq->ssl_ctx){
-		SSL_CTX_free(mosq->ssl_ctx);
-		mosq->ssl_ctx = NULL;
-	}
+#ifdef WITH_BROKER
+	/* Bridges have no destroy hook here, so don't keep the context. */
+	_mosquitto_ssl_ctx_release(mosq);
+#endif
 #endif
 
 	if(mosq->sock != INVALID_SOCKET){
 		rc = COMPAT_CLOSE(mosq->sock);
 		mosq->sock = INVALID_SOCKET;
+#ifndef WITH_BROKER
+		_mosquitto_interest_update(mosq);
+#endif
 	}
 
 	return rc;
 }
 
-#ifdef REAL_WITH_TLS_PSK
-static unsigned int psk_client_callback(SSL *ssl, const char *hint,
-		char *identity, unsigned int max_identity_len,
-		unsigned char *psk, unsigned int max_psk_len)
+#if defined(WITH_THREADING) && !defined(WITH_BROKER)
+/* A name lookup running on its own thread. It is shared between the resolver
+ * thread and the waiting client, and freed by whichever finishes with it
+ * last, so that the client can give up on a slow lookup without waiting. */
+struct _mosquitto_resolve_req{
+	pthread_mutex_t mutex;
+	int refcount;
+	bool done;
+	int rc;
+	char *host;
+	struct addrinfo hints;
+	struct addrinfo *ainfo;
+	mosq_sock_t pairR;
+	mosq_sock_t pairW;
+};
+
+static void _mosquitto_resolve_req_release(struct _mosquitto_resolve_req *req)
+{
+	int refcount;
+
+	pthread_mutex_lock(&req->mutex);
+	refcount = --req->refcount;
+	pthread_mutex_unlock(&req->mutex);
+	if(refcount > 0) return;
+
+	if(req->ainfo) freeaddrinfo(req->ainfo);
+	COMPAT_CLOSE(req->pairR);
+	COMPAT_CLOSE(req->pairW);
+	_mosquitto_free(req->host);
+	pthread_mutex_destroy(&req->mutex);
+	_mosquitto_free(req);
+}
+
+static void *_mosquitto_resolve_thread(void *obj)
+{
+	struct _mosquitto_resolve_req *req = obj;
+	struct addrinfo *ainfo = NULL;
+	int rc;
+
+	rc = getaddrinfo(req->host, NULL, &req->hints, &ainfo);
+
+	pthread_mutex_lock(&req->mutex);
+	req->rc = rc;
+	req->ainfo = ainfo;
+	req->done = true;
+	pthread_mutex_unlock(&req->mutex);
+	_mosquitto_socketpair_signal(req->pairW);
+
+	_mosquitto_resolve_req_release(req);
+	return NULL;
+}
+
+/* Start looking up host on a new thread. Returns NULL if the thread can't be
+ * started, in which case the caller should look it up itself. */
+static struct _mosquitto_resolve_req *_mosquitto_resolve_start(const char *host, struct addrinfo *hints)
+{
+	struct _mosquitto_resolve_req *req;
+	pthread_t thread;
+	pthread_attr_t attr;
+	int rc;
+
+	req = _mosquitto_calloc(1, sizeof(struct _mosquitto_resolve_req));
+	if(!req) return NULL;
+	req->host = _mosquitto_strdup(host);
+	if(!req->host || _mosquitto_socketpair(&req->pairR, &req->pairW)){
+		_mosquitto_free(req->host);
+		_mosquitto_free(req);
+		return NULL;
+	}
+	req->hints = *hints;
+	req->refcount = 2;
+	pthread_mutex_init(&req->mutex, NULL);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create(&thread, &attr, _mosquitto_resolve_thread, req);
+	pthread_attr_destroy(&attr);
+	if(rc){
+		req->refcount = 1;
+		_mosquitto_resolve_req_release(req);
+		return NULL;
+	}
+	return req;
+}
+
+/* Collect the result of a lookup. *done is false while it is still running.
+ * req->pairR becomes readable when it finishes. */
+static int _mosquitto_resolve_poll(struct _mosquitto_resolve_req *req, struct addrinfo **ainfo, bool *done)
+{
+	int s;
+
+	pthread_mutex_lock(&req->mutex);
+	*done = req->done;
+	s = req->rc;
+	*ainfo = req->ainfo;
+	req->ainfo = NULL;
+	pthread_mutex_unlock(&req->mutex);
+
+	if(*done && s){
+		errno = s;
+		return MOSQ_ERR_EAI;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+#endif
+
+/* Look up host. Where possible this is done on a separate thread so that
+ * mosquitto_disconnect() or mosquitto_loop_stop() can interrupt a slow
+ * resolver, in which case MOSQ_ERR_NO_CONN is returned. */
+static int _mosquitto_resolve(struct mosquitto *mosq, const char *host, struct addrinfo *hints, struct addrinfo **ainfo)
+{
+#if defined(WITH_THREADING) && !defined(WITH_BROKER)
+	struct _mosquitto_resolve_req *req;
+	fd_set readfds;
+	mosq_sock_t maxfd;
+	bool done;
+	int rc;
+#endif
+	int s;
+
+	*ainfo = NULL;
+#if defined(WITH_THREADING) && !defined(WITH_BROKER)
+	if(mosq->sockpairR == INVALID_SOCKET){
+		goto blocking;
+	}
+	req = _mosquitto_resolve_start(host, hints);
+	if(!req) goto blocking;
+
+	while(1){
+		FD_ZERO(&readfds);
+		FD_SET(req->pairR, &readfds);
+		FD_SET(mosq->sockpairR, &readfds);
+		maxfd = req->pairR > mosq->sockpairR ? req->pairR : mosq->sockpairR;
+		if(select(maxfd+1, &readfds, NULL, NULL, NULL) == -1){
+#ifdef WIN32
+			errno = WSAGetLastError();
+#endif
+			if(errno == EINTR) continue;
+			_mosquitto_resolve_req_release(req);
+			return MOSQ_ERR_ERRNO;
+		}
+		if(FD_ISSET(req->pairR, &readfds)){
+			rc = _mosquitto_resolve_poll(req, ainfo, &done);
+			if(done){
+				_mosquitto_resolve_req_release(req);
+				return rc;
+			}
+		}
+		if(FD_ISSET(mosq->sockpairR, &readfds)){
+			_mosquitto_loop_wakeup_clear(mosq);
+			if(_mosquitto_loop_finished(mosq)){
+				_mosquitto_resolve_req_release(req);
+				return MOSQ_ERR_NO_CONN;
+			}
+		}
+	}
+
+blocking:
+#endif
+	s = getaddrinfo(host, NULL, hints, ainfo);
+	if(s){
+		errno = s;
+		return MOSQ_ERR_EAI;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+struct _mosquitto_addr{
+	struct sockaddr_storage addr;
+	socklen_t len;
+};
+
+/* Process wide cache of resolved broker addresses, so that many clients
+ * reconnecting to the same host at once don't each go to the resolver. Each
+ * entry also remembers the address that last accepted a connection so that
+ * it can be tried first. */
+struct _mosquitto_addr_cache{
+	struct _mosquitto_addr_cache *next;
+	char *host;
+	int64_t expires;
+	int count;
+	int last_good;
+	struct _mosquitto_addr addrs[MOSQ_CONNECT_CANDIDATES_MAX];
+};
+
+static struct _mosquitto_addr_cache *addr_cache = NULL;
+static int addr_cache_len = 0;
+static unsigned int addr_cache_ttl = MOSQ_ADDR_CACHE_TTL_DEFAULT;
+#if defined(WITH_THREADING) && !defined(WITH_BROKER)
+static pthread_mutex_t addr_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void _mosquitto_addr_cache_free(struct _mosquitto_addr_cache *entry)
+{
+	_mosquitto_free(entry->host);
+	_mosquitto_free(entry);
+}
+
+/* addr_cache_mutex must be held. */
+static struct _mosquitto_addr_cache *_mosquitto_addr_cache_find(const char *host, struct _mosquitto_addr_cache **prev_out)
+{
+	struct _mosquitto_addr_cache *entry, *prev = NULL;
+
+	for(entry = addr_cache; entry; entry = entry->next){
+		if(!strcmp(entry->host, host)){
+			if(prev_out) *prev_out = prev;
+			return entry;
+		}
+		prev = entry;
+	}
+	return NULL;
+}
+
+/* addr_cache_mutex must be held. */
+static void _mosquitto_addr_cache_unlink(struct _mosquitto_addr_cache *entry, struct _mosquitto_addr_cache *prev)
+{
+	if(prev){
+		prev->next = entry->next;
+	}else{
+		addr_cache = entry->next;
+	}
+	addr_cache_len--;
+	_mosquitto_addr_cache_free(entry);
+}
+
+/* Copy the cached addresses for host into addrs, with the last good address
+ * first. Returns the number of addresses, or 0 if there is no fresh entry. */
+static int _mosquitto_addr_cache_get(const char *host, struct _mosquitto_addr *addrs)
+{
+	struct _mosquitto_addr_cache *entry, *prev = NULL;
+	int count = 0;
+	int i;
+
+	pthread_mutex_lock(&addr_cache_mutex);
+	entry = _mosquitto_addr_cache_find(host, &prev);
+	if(entry){
+		if(entry->expires <= mosquitto_time_ms()){
+			_mosquitto_addr_cache_unlink(entry, prev);
+		}else{
+			if(entry->last_good >= 0){
+				addrs[count++] = entry->addrs[entry->last_good];
+			}
+			for(i=0; i<entry->count; i++){
+				if(i != entry->last_good){
+					addrs[count++] = entry->addrs[i];
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&addr_cache_mutex);
+
+	return count;
+}
+
+static void _mosquitto_addr_cache_put(const char *host, const struct _mosquitto_addr *addrs, int count)
+{
+	struct _mosquitto_addr_cache *entry, *prev, *old;
+
+	if(count == 0) return;
+
+	entry = _mosquitto_calloc(1, sizeof(struct _mosquitto_addr_cache));
+	if(!entry) return;
+	entry->host = _mosquitto_strdup(host);
+	if(!entry->host){
+		_mosquitto_free(entry);
+		return;
+	}
+	memcpy(entry->addrs, addrs, count*sizeof(struct _mosquitto_addr));
+	entry->count = count;
+	entry->last_good = -1;
+
+	pthread_mutex_lock(&addr_cache_mutex);
+	if(addr_cache_ttl == 0){
+		pthread_mutex_unlock(&addr_cache_mutex);
+		_mosquitto_addr_cache_free(entry);
+		return;
+	}
+	entry->expires = mosquitto_time_ms() + addr_cache_ttl;
+
+	old = _mosquitto_addr_cache_find(host, &prev);
+	if(old){
+		/* Another client resolved it at the same time. */
+		_mosquitto_addr_cache_unlink(old, prev);
+	}
+	while(addr_cache_len >= MOSQ_ADDR_CACHE_MAX){
+		/* New entries go on the front, so the last is the oldest. */
+		prev = NULL;
+		for(old = addr_cache; old->next; old = old->next){
+			prev = old;
+		}
+		_mosquitto_addr_cache_unlink(old, prev);
+	}
+	entry->next = addr_cache;
+	addr_cache = entry;
+	addr_cache_len++;
+	pthread_mutex_unlock(&addr_cache_mutex);
+}
+
+/* Record the result of a connection attempt to host. On success addr is the
+ * address that was used. On failure every cached address has been tried.
+ * The entry is kept until it expires, because a broker that is restarting
+ * would otherwise send every client in the process back to the resolver at
+ * once. The next attempt just starts one address further on. */
+static void _mosquitto_addr_cache_result(const char *host, const struct _mosquitto_addr *addr, bool success)
+{
+	struct _mosquitto_addr_cache *entry;
+	int i;
+
+	pthread_mutex_lock(&addr_cache_mutex);
+	entry = _mosquitto_addr_cache_find(host, NULL);
+	if(entry){
+		if(success){
+			for(i=0; i<entry->count; i++){
+				if(entry->addrs[i].len == addr->len && !memcmp(&entry->addrs[i].addr, &addr->addr, addr->len)){
+					entry->last_good = i;
+					break;
+				}
+			}
+		}else if(entry->last_good >= 0){
+			entry->last_good = (entry->last_good + 1) % entry->count;
+		}
+	}
+	pthread_mutex_unlock(&addr_cache_mutex);
+}
+
+void _mosquitto_addr_cache_cleanup(void)
+{
+	struct _mosquitto_addr_cache *entry;
+
+	pthread_mutex_lock(&addr_cache_mutex);
+	while(addr_cache){
+		entry = addr_cache;
+		addr_cache = entry->next;
+		_mosquitto_addr_cache_free(entry);
+	}
+	addr_cache_len = 0;
+	pthread_mutex_unlock(&addr_cache_mutex);
+}
+
+int mosquitto_address_cache_ttl_set(unsigned int ttl_ms)
+{
+	pthread_mutex_lock(&addr_cache_mutex);
+	addr_cache_ttl = ttl_ms;
+	pthread_mutex_unlock(&addr_cache_mutex);
+	if(ttl_ms == 0){
+		_mosquitto_addr_cache_cleanup();
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Order the resolved addresses as RFC 8305 suggests: alternate between
+ * address families, starting with the family of the first result, so that a
+ * broken path for one family is not tried repeatedly before the other. */
+static int _mosquitto_addr_order(struct addrinfo *ainfo, struct _mosquitto_addr *addrs, int max)
+{
+	struct addrinfo *primary[MOSQ_CONNECT_CANDIDATES_MAX];
+	struct addrinfo *secondary[MOSQ_CONNECT_CANDIDATES_MAX];
+	struct addrinfo *rp;
+	int np = 0, ns = 0;
+	int count = 0;
+	int i;
+
+	for(rp = ainfo; rp != NULL; rp = rp->ai_next){
+		if(rp->ai_family != PF_INET && rp->ai_family != PF_INET6) continue;
+		if(rp->ai_addrlen > sizeof(addrs[0].addr)) continue;
+
+		if(rp->ai_family == ainfo->ai_family){
+			if(np < MOSQ_CONNECT_CANDIDATES_MAX) primary[np++] = rp;
+		}else{
+			if(ns < MOSQ_CONNECT_CANDIDATES_MAX) secondary[ns++] = rp;
+		}
+	}
+	for(i=0; count < max && (i < np || i < ns); i++){
+		if(i < np){
+			rp = primary[i];
+			memcpy(&addrs[count].addr, rp->ai_addr, rp->ai_addrlen);
+			addrs[count].len = rp->ai_addrlen;
+			count++;
+		}
+		if(i < ns && count < max){
+			rp = secondary[i];
+			memcpy(&addrs[count].addr, rp->ai_addr, rp->ai_addrlen);
+			addrs[count].len = rp->ai_addrlen;
+			count++;
+		}
+	}
+	return count;
+}
+
+/* Start a non-blocking connection to a single address. On success *connected
+ * says whether the connection completed immediately, otherwise it is in
+ * progress. On failure errno is set and no socket is left open. */
+static int _mosquitto_try_connect_start(const struct _mosquitto_addr *candidate, uint16_t port, struct addrinfo *ainfo_bind, int *sock, bool *connected)
+{
+	struct _mosquitto_addr addr;
+	struct addrinfo *rp_bind;
+	int family;
+	int rc;
+#ifndef WIN32
+	int opt;
+#else
+	uint32_t val = 1;
+#endif
+
+	*sock = INVALID_SOCKET;
+	*connected = false;
+
+	addr = *candidate;
+	family = ((struct sockaddr *)&addr.addr)->sa_family;
+	if(family == PF_INET){
+		((struct sockaddr_in *)&addr.addr)->sin_port = htons(port);
+	}else if(family == PF_INET6){
+		((struct sockaddr_in6 *)&addr.addr)->sin6_port = htons(port);
+	}else{
+		errno = EAFNOSUPPORT;
+		return MOSQ_ERR_ERRNO;
+	}
+
+	*sock = socket(family, SOCK_STREAM, IPPROTO_TCP);
+	if(*sock == INVALID_SOCKET){
+#ifdef WIN32
+		errno = WSAGetLastError();
+#endif
+		return MOSQ_ERR_ERRNO;
+	}
+
+	if(ainfo_bind){
+		for(rp_bind = ainfo_bind; rp_bind != NULL; rp_bind = rp_bind->ai_next){
+			if(bind(*sock, rp_bind->ai_addr, rp_bind->ai_addrlen) == 0){
+				break;
+			}
+		}
+		if(!rp_bind){
+			COMPAT_CLOSE(*sock);
+			*sock = INVALID_SOCKET;
+			errno = EADDRNOTAVAIL;
+			return MOSQ_ERR_ERRNO;
+		}
+	}
+
+	/* Set non-blocking */
+#ifndef WIN32
+	opt = fcntl(*sock, F_GETFL, 0);
+	if(opt == -1 || fcntl(*sock, F_SETFL, opt | O_NONBLOCK) == -1){
+		COMPAT_CLOSE(*sock);
+		*sock = INVALID_SOCKET;
+		return MOSQ_ERR_ERRNO;
+	}
+#else
+	if(ioctlsocket(*sock, FIONBIO, &val)){
+		errno = WSAGetLastError();
+		COMPAT_CLOSE(*sock);
+		*sock = INVALID_SOCKET;
+		return MOSQ_ERR_ERRNO;
+	}
+#endif
+
+	rc = connect(*sock, (struct sockaddr *)&addr.addr, addr.len);
+#ifdef WIN32
+	errno = WSAGetLastError();
+#endif
+	if(rc == 0){
+		*connected = true;
+		return MOSQ_ERR_SUCCESS;
+	}else if(errno == EINPROGRESS || errno == COMPAT_EWOULDBLOCK){
+		return MOSQ_ERR_SUCCESS;
+	}
+	COMPAT_CLOSE(*sock);
+	*sock = INVALID_SOCKET;
+	return MOSQ_ERR_ERRNO;
+}
+
+/* A connection race to the candidate addresses of one host, in the manner of
+ * RFC 8305. A new attempt is started every connect_attempt_delay ms, or as
+ * soon as the previous one fails, and the first to complete wins. With
+ * connect_attempt_delay set to 0 the addresses are tried one after another.
+ * The blocking connect functions run the race to the end themselves, the
+ * non-blocking ones leave it on mosq->connect_race for the network loop.
+ * Those also leave the lookup of an uncached host to the network loop, and
+ * the race starts once it has finished. */
+struct _mosquitto_connect_race{
+	struct _mosquitto_addr cands[MOSQ_CONNECT_CANDIDATES_MAX];
+	int count;
+	int next;
+	int inflight[MOSQ_CONNECT_RACE_MAX];
+	int inflight_idx[MOSQ_CONNECT_RACE_MAX];
+	int n;
+	int64_t next_start;
+	int64_t deadline;
+	uint16_t port;
+	struct addrinfo *ainfo_bind;
+	int err;
+#if defined(WITH_THREADING) && !defined(WITH_BROKER)
+	struct _mosquitto_resolve_req *resolve;
+#endif
+};
+
+static void _mosquitto_connect_race_free(struct _mosquitto_connect_race *race)
 {
-	struct mosquitto *mosq;
-	int len;
+	int i;
 
-	mosq = SSL_get_ex_data(ssl, tls_ex_index_mosq);
-	if(!mosq) return 0;
+	for(i=0; i<race->n; i++){
+		COMPAT_CLOSE(race->inflight[i]);
+	}
+	if(race->ainfo_bind){
+		freeaddrinfo(race->ainfo_bind);
+	}
+#if defined(WITH_THREADING) && !defined(WITH_BROKER)
+	if(race->resolve){
+		_mosquitto_resolve_req_release(race->resolve);
+	}
+#endif
+	_mosquitto_free(race);
+}
 
-	snprintf(identity, max_identity_len, "%s", mosq->tls_psk_identity);
+/* Make the resolved addresses of host the race's candidates. */
+static void _mosquitto_connect_race_addrs(const char *host, struct _mosquitto_connect_race *race, struct addrinfo *ainfo)
+{
+	race->count = _mosquitto_addr_order(ainfo, race->cands, MOSQ_CONNECT_CANDIDATES_MAX);
+	freeaddrinfo(ainfo);
+	_mosquitto_addr_cache_put(host, race->cands, race->count);
+}
+
+/* What mosq->sock holds while the race is going: the lookup's wakeup until
+ * the host has been resolved, then the latest attempt. */
+static mosq_sock_t _mosquitto_connect_race_sock(struct _mosquitto_connect_race *race)
+{
+#if defined(WITH_THREADING) && !defined(WITH_BROKER)
+	if(race->resolve) return race->resolve->pairR;
+#endif
+	return race->inflight[race->n-1];
+}
+
+/* Record the outcome of a finished race in the address cache and free it. */
+static void _mosquitto_connect_race_finish(const char *host, struct _mosquitto_connect_race *race, int rc, int winner)
+{
+	int err = errno;
+
+	if(rc == MOSQ_ERR_SUCCESS){
+		_mosquitto_addr_cache_result(host, &race->cands[winner], true);
+	}else if(rc == MOSQ_ERR_ERRNO){
+		_mosquitto_addr_cache_result(host, NULL, false);
+	}
+	_mosquitto_connect_race_free(race);
+	errno = err;
+}
 
-	len = _mosquitto_hex2bin(mosq->tls_psk, psk, max_psk_len);
-	if (len < 0) return 0;
-	return len;
+/* Take a race as far as it will go without waiting: collect any attempts that
+ * have finished and start those that are due. Returns MOSQ_ERR_SUCCESS with
+ * *sock set to the winning socket and *winner to its candidate, or with *sock
+ * set to INVALID_SOCKET while the race is still going. Returns
+ * MOSQ_ERR_ERRNO once every attempt has failed or the race has run out of
+ * time. The attempts that did not win are closed. */
+static int _mosquitto_connect_race_advance(struct mosquitto *mosq, struct _mosquitto_connect_race *race, int *sock, int *winner)
+{
+	struct timeval local_timeout;
+	fd_set writefds, exceptfds;
+	mosq_sock_t maxfd = 0;
+	int64_t now;
+	int s;
+	int i, j;
+	bool connected;
+
+	*sock = INVALID_SOCKET;
+
+	if(race->n > 0){
+		FD_ZERO(&writefds);
+		FD_ZERO(&exceptfds);
+		for(i=0; i<race->n; i++){
+			FD_SET(race->inflight[i], &writefds);
+			FD_SET(race->inflight[i], &exceptfds);
+			if(race->inflight[i] > maxfd) maxfd = race->inflight[i];
+		}
+		local_timeout.tv_sec = 0;
+		local_timeout.tv_usec = 0;
+		if(select(maxfd+1, NULL, &writefds, &exceptfds, &local_timeout) == -1){
+#ifdef WIN32
+			errno = WSAGetLastError();
+#endif
+			if(errno != EINTR) return MOSQ_ERR_ERRNO;
+			FD_ZERO(&writefds);
+			FD_ZERO(&exceptfds);
+		}
+		now = mosquitto_time_ms();
+		for(i=0; i<race->n; i++){
+			if(!FD_ISSET(race->inflight[i], &writefds) && !FD_ISSET(race->inflight[i], &exceptfds)){
+				continue;
+			}
+			s = _mosquitto_socket_error(race->inflight[i]);
+			if(s == 0){
+				*sock = race->inflight[i];
+				*winner = race->inflight_idx[i];
+				for(j=0; j<race->n; j++){
+					if(j != i) COMPAT_CLOSE(race->inflight[j]);
+				}
+				race->n = 0;
+				return MOSQ_ERR_SUCCESS;
+			}
+			/* This one failed, so let the next candidate start now. */
+			race->err = s;
+			COMPAT_CLOSE(race->inflight[i]);
+			race->n--;
+			race->inflight[i] = race->inflight[race->n];
+			race->inflight_idx[i] = race->inflight_idx[race->n];
+			i--;
+			race->next_start = now;
+		}
+	}
+
+	now = mosquitto_time_ms();
+	while(race->next < race->count && race->n < MOSQ_CONNECT_RACE_MAX
+			&& (race->n == 0 || (mosq->connect_attempt_delay && now >= race->next_start))){
+
+		if(_mosquitto_try_connect_start(&race->cands[race->next], race->port, race->ainfo_bind, &s, &connected) == MOSQ_ERR_SUCCESS){
+			if(connected){
+				for(i=0; i<race->n; i++) COMPAT_CLOSE(race->inflight[i]);
+				race->n = 0;
+				*sock = s;
+				*winner = race->next;
+				return MOSQ_ERR_SUCCESS;
+			}
+			race->inflight[race->n] = s;
+			race->inflight_idx[race->n] = race->next;
+			race->n++;
+			race->next_start = now + mosq->connect_attempt_delay;
+		}else{
+			race->err = errno;
+		}
+		race->next++;
+	}
+	if(race->n == 0){
+		errno = race->err;
+		return MOSQ_ERR_ERRNO;
+	}
+	if(race->deadline && now >= race->deadline){
+		errno = ETIMEDOUT;
+		return MOSQ_ERR_ERRNO;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* The time, from mosquitto_time_ms(), at which the race next needs attention
+ * if none of its attempts finishes first, or -1 for never. */
+static int64_t _mosquitto_connect_race_timeout(struct mosquitto *mosq, struct _mosquitto_connect_race *race)
+{
+	int64_t timeout = race->deadline ? race->deadline : -1;
+
+	if(race->next < race->count && race->n < MOSQ_CONNECT_RACE_MAX && mosq->connect_attempt_delay){
+		if(timeout < 0 || race->next_start < timeout){
+			timeout = race->next_start;
+		}
+	}
+	return timeout;
+}
+
+/* Run a race to the end, waiting in select(). Can be interrupted by
+ * mosquitto_disconnect() or mosquitto_loop_stop(). */
+static int _mosquitto_try_connect_race(struct mosquitto *mosq, struct _mosquitto_connect_race *race, int *sock, int *winner)
+{
+	struct timeval local_timeout;
+	fd_set readfds, writefds, exceptfds;
+	mosq_sock_t maxfd;
+	int64_t timeout, wait;
+	int rc;
+	int i;
+
+	while(1){
+		rc = _mosquitto_connect_race_advance(mosq, race, sock, winner);
+		if(rc || *sock != INVALID_SOCKET){
+			return rc;
+		}
+
+		FD_ZERO(&readfds);
+		FD_ZERO(&writefds);
+		FD_ZERO(&exceptfds);
+		maxfd = 0;
+		for(i=0; i<race->n; i++){
+			FD_SET(race->inflight[i], &writefds);
+			FD_SET(race->inflight[i], &exceptfds);
+			if(race->inflight[i] > maxfd) maxfd = race->inflight[i];
+		}
+#ifndef WITH_BROKER
+		if(mosq->sockpairR != INVALID_SOCKET){
+			FD_SET(mosq->sockpairR, &readfds);
+			if(mosq->sockpairR > maxfd) maxfd = mosq->sockpairR;
+		}
+#endif
+		wait = 1000;
+		timeout = _mosquitto_connect_race_timeout(mosq, race);
+		if(timeout >= 0 && timeout - mosquitto_time_ms() < wait){
+			wait = timeout - mosquitto_time_ms();
+		}
+		if(wait < 0) wait = 0;
+		local_timeout.tv_sec = wait/1000;
+		local_timeout.tv_usec = (wait%1000)*1000;
+
+		if(select(maxfd+1, &readfds, &writefds, &exceptfds, &local_timeout) == -1){
+#ifdef WIN32
+			errno = WSAGetLastError();
+#endif
+			if(errno == EINTR) continue;
+			return MOSQ_ERR_ERRNO;
+		}
+#ifndef WITH_BROKER
+		if(mosq->sockpairR != INVALID_SOCKET && FD_ISSET(mosq->sockpairR, &readfds)){
+			_mosquitto_loop_wakeup_clear(mosq);
+			if(_mosquitto_loop_finished(mosq)){
+				return MOSQ_ERR_NO_CONN;
+			}
+		}
+#endif
+	}
 }
-#endif
 
-int _mosquitto_try_connect(const char *host, uint16_t port, int *sock, const char *bind_address, bool blocking)
+/* Look up host and start a race to its addresses. When blocking, *sock is
+ * the connected socket on success. Otherwise *sock is INVALID_SOCKET if no
+ * attempt has finished yet, or host is still being looked up, and the race is
+ * left on mosq->connect_race for _mosquitto_connect_race_step() to finish. */
+int _mosquitto_try_connect(struct mosquitto *mosq, const char *host, uint16_t port, int *sock, const char *bind_address, bool blocking)
 {
 	struct addrinfo hints;
-	struct addrinfo *ainfo, *rp;
-	struct addrinfo *ainfo_bind, *rp_bind;
-	int s;
+	struct addrinfo *ainfo;
+	struct _mosquitto_connect_race *race;
+	int winner = -1;
 	int rc;
-#ifndef WIN32
-	int opt;
-#endif
-#ifdef WIN32
-	uint32_t val = 1;
-#endif
 
 	*sock = INVALID_SOCKET;
 	memset(&hints, 0, sizeof(struct addrinfo));
@@ -235,235 +1219,102 @@ int _mosquitto_try_connect(const char *host, uint16_t port, int *sock, const cha
 	hints.ai_flags = AI_ADDRCONFIG;
 	hints.ai_socktype = SOCK_STREAM;
 
-	s = getaddrinfo(host, NULL, &hints, &ainfo);
-	if(s){
-		errno = s;
-		return MOSQ_ERR_EAI;
-	}
+	race = _mosquitto_calloc(1, sizeof(struct _mosquitto_connect_race));
+	if(!race) return MOSQ_ERR_NOMEM;
 
 	if(bind_address){
-		s = getaddrinfo(bind_address, NULL, &hints, &ainfo_bind);
-		if(s){
-			freeaddrinfo(ainfo);
-			errno = s;
-			return MOSQ_ERR_EAI;
+		rc = _mosquitto_resolve(mosq, bind_address, &hints, &race->ainfo_bind);
+		if(rc){
+			_mosquitto_connect_race_free(race);
+			return rc;
 		}
 	}
 
-	for(rp = ainfo; rp != NULL; rp = rp->ai_next){
-		*sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-		if(*sock == INVALID_SOCKET) continue;
-		
-		if(rp->ai_family == PF_INET){
-			((struct sockaddr_in *)rp->ai_addr)->sin_port = htons(port);
-		}else if(rp->ai_family == PF_INET6){
-			((struct sockaddr_in6 *)rp->ai_addr)->sin6_port = htons(port);
-		}else{
-			continue;
-		}
-
-		if(bind_address){
-			for(rp_bind = ainfo_bind; rp_bind != NULL; rp_bind = rp_bind->ai_next){
-				if(bind(*sock, rp_bind->ai_addr, rp_bind->ai_addrlen) == 0){
-					break;
-				}
-			}
-			if(!rp_bind){
-				COMPAT_CLOSE(*sock);
-				continue;
-			}
-		}
+	race->port = port;
+	race->err = ECONNREFUSED;
+	race->next_start = mosquitto_time_ms();
+	if(mosq->keepalive){
+		/* Give up on a connection that can't be made within the keepalive
+		 * interval, as the broker would have dropped us by then anyway. */
+		race->deadline = race->next_start + (int64_t)mosq->keepalive*1000;
+	}
 
+	race->count = _mosquitto_addr_cache_get(host, race->cands);
+	if(race->count == 0){
+#if defined(WITH_THREADING) && !defined(WITH_BROKER)
 		if(!blocking){
-			/* Set non-blocking */
-#ifndef WIN32
-			opt = fcntl(*sock, F_GETFL, 0);
-			if(opt == -1 || fcntl(*sock, F_SETFL, opt | O_NONBLOCK) == -1){
-				COMPAT_CLOSE(*sock);
-				continue;
-			}
-#else
-			if(ioctlsocket(*sock, FIONBIO, &val)){
-				COMPAT_CLOSE(*sock);
-				continue;
+			race->resolve = _mosquitto_resolve_start(host, &hints);
+			if(race->resolve){
+				mosq->connect_race = race;
+				MOSQ_ATOMIC_STORE_INT(&mosq->connect_resolving, 1);
+				return MOSQ_ERR_SUCCESS;
 			}
+		}
 #endif
+		rc = _mosquitto_resolve(mosq, host, &hints, &ainfo);
+		if(rc){
+			_mosquitto_connect_race_free(race);
+			return rc;
+		}
+		_mosquitto_connect_race_addrs(host, race, ainfo);
+	}
+
+	if(blocking){
+		rc = _mosquitto_try_connect_race(mosq, race, sock, &winner);
+	}else{
+		rc = _mosquitto_connect_race_advance(mosq, race, sock, &winner);
+		if(rc == MOSQ_ERR_SUCCESS && *sock == INVALID_SOCKET){
+			mosq->connect_race = race;
+			return MOSQ_ERR_SUCCESS;
 		}
+	}
+	_mosquitto_connect_race_finish(host, race, rc, winner);
+	return rc;
+}
+
+/* Return the pending error on a socket, e.g. the result of a non-blocking
+ * connect, or 0 if there is none. */
+int _mosquitto_socket_error(mosq_sock_t sock)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
 
-		rc = connect(*sock, rp->ai_addr, rp->ai_addrlen);
+	if(getsockopt(sock, SOL_SOCKET, SO_ERROR, (char *)&err, &len)){
 #ifdef WIN32
-		errno = WSAGetLastError();
-#endif
-		if(rc == 0 || errno == EINPROGRESS || errno == COMPAT_EWOULDBLOCK){
-			if(blocking){
-			/* Set non-blocking */
-#ifndef WIN32
-				opt = fcntl(*sock, F_GETFL, 0);
-				if(opt == -1 || fcntl(*sock, F_SETFL, opt | O_NONBLOCK) == -1){
-					COMPAT_CLOSE(*sock);
-					continue;
-				}
+		return WSAGetLastError();
 #else
-				if(ioctlsocket(*sock, FIONBIO, &val)){
-					COMPAT_CLOSE(*sock);
-					continue;
-				}
+		return errno;
 #endif
-			}
-			break;
-		}
-
-		COMPAT_CLOSE(*sock);
-		*sock = INVALID_SOCKET;
-	}
-	freeaddrinfo(ainfo);
-	if(bind_address){
-		freeaddrinfo(ainfo_bind);
 	}
-	if(!rp){
+	return err;
+}
+
+/* Turn Nagle's algorithm off (nodelay true) or on for a connected socket. */
+int _mosquitto_socket_nodelay(mosq_sock_t sock, bool nodelay)
+{
+	int opt = nodelay ? 1 : 0;
+
+	if(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&opt, sizeof(opt))){
 		return MOSQ_ERR_ERRNO;
 	}
 	return MOSQ_ERR_SUCCESS;
 }
 
-/* Create a socket and connect it to 'ip' on port 'port'.
- * Returns -1 on failure (ip is NULL, socket creation/connection error)
- * Returns sock number on success.
- */
-int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t port, const char *bind_address, bool blocking)
+/* Make sock, which has just connected, the client's socket and start the TLS
+ * handshake on it if needed. sock is closed on failure. */
+static int _mosquitto_socket_connected(struct mosquitto *mosq, int sock)
 {
-	int sock = INVALID_SOCKET;
-	int rc;
 #ifdef WITH_TLS
-	int ret;
 	BIO *bio;
-#endif
-
-	if(!mosq || !host || !port) return MOSQ_ERR_INVAL;
-
-#ifdef WITH_TLS
-	if(mosq->tls_cafile || mosq->tls_capath || mosq->tls_psk){
-		blocking = true;
-	}
-#endif
-
-	rc = _mosquitto_try_connect(host, port, &sock, bind_address, blocking);
-	if(rc != MOSQ_ERR_SUCCESS) return rc;
+	int rc;
 
-#ifdef WITH_TLS
 	if(mosq->tls_cafile || mosq->tls_capath || mosq->tls_psk){
-#if OPENSSL_VERSION_NUMBER >= 0x10001000L
-		if(!mosq->tls_version || !strcmp(mosq->tls_version, "tlsv1.2")){
-			mosq->ssl_ctx = SSL_CTX_new(TLSv1_2_client_method());
-		}else if(!strcmp(mosq->tls_version, "tlsv1.1")){
-			mosq->ssl_ctx = SSL_CTX_new(TLSv1_1_client_method());
-		}else if(!strcmp(mosq->tls_version, "tlsv1")){
-			mosq->ssl_ctx = SSL_CTX_new(TLSv1_client_method());
-		}else{
-			_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Protocol %s not supported.", mosq->tls_version);
-			COMPAT_CLOSE(sock);
-			return MOSQ_ERR_INVAL;
-		}
-#else
-		if(!mosq->tls_version || !strcmp(mosq->tls_version, "tlsv1")){
-			mosq->ssl_ctx = SSL_CTX_new(TLSv1_client_method());
-		}else{
-			_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Protocol %s not supported.", mosq->tls_version);
-			COMPAT_CLOSE(sock);
-			return MOSQ_ERR_INVAL;
-		}
-#endif
 		if(!mosq->ssl_ctx){
-			_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to create TLS context.");
-			COMPAT_CLOSE(sock);
-			return MOSQ_ERR_TLS;
-		}
-
-#if OPENSSL_VERSION_NUMBER >= 0x10000000
-		/* Disable compression */
-		SSL_CTX_set_options(mosq->ssl_ctx, SSL_OP_NO_COMPRESSION);
-#endif
-#ifdef SSL_MODE_RELEASE_BUFFERS
-			/* Use even less memory per SSL connection. */
-			SSL_CTX_set_mode(mosq->ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
-#endif
-
-		if(mosq->tls_ciphers){
-			ret = SSL_CTX_set_cipher_list(mosq->ssl_ctx, mosq->tls_ciphers);
-			if(ret == 0){
-				_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to set TLS ciphers. Check cipher list \"%s\".", mosq->tls_ciphers);
-				COMPAT_CLOSE(sock);
-				return MOSQ_ERR_TLS;
-			}
-		}
-		if(mosq->tls_cafile || mosq->tls_capath){
-			ret = SSL_CTX_load_verify_locations(mosq->ssl_ctx, mosq->tls_cafile, mosq->tls_capath);
-			if(ret == 0){
-#ifdef WITH_BROKER
-				if(mosq->tls_cafile && mosq->tls_capath){
-					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check bridge_cafile \"%s\" and bridge_capath \"%s\".", mosq->tls_cafile, mosq->tls_capath);
-				}else if(mosq->tls_cafile){
-					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check bridge_cafile \"%s\".", mosq->tls_cafile);
-				}else{
-					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check bridge_capath \"%s\".", mosq->tls_capath);
-				}
-#else
-				if(mosq->tls_cafile && mosq->tls_capath){
-					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check cafile \"%s\" and capath \"%s\".", mosq->tls_cafile, mosq->tls_capath);
-				}else if(mosq->tls_cafile){
-					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check cafile \"%s\".", mosq->tls_cafile);
-				}else{
-					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check capath \"%s\".", mosq->tls_capath);
-				}
-#endif
+			rc = _mosquitto_ssl_ctx_get(mosq);
+			if(rc){
 				COMPAT_CLOSE(sock);
-				return MOSQ_ERR_TLS;
-			}
-			if(mosq->tls_cert_reqs == 0){
-				SSL_CTX_set_verify(mosq->ssl_ctx, SSL_VERIFY_NONE, NULL);
-			}else{
-				SSL_CTX_set_verify(mosq->ssl_ctx, SSL_VERIFY_PEER, _mosquitto_server_certificate_verify);
-			}
-
-			if(mosq->tls_pw_callback){
-				SSL_CTX_set_default_passwd_cb(mosq->ssl_ctx, mosq->tls_pw_callback);
-				SSL_CTX_set_default_passwd_cb_userdata(mosq->ssl_ctx, mosq);
-			}
-
-			if(mosq->tls_certfile){
-				ret = SSL_CTX_use_certificate_chain_file(mosq->ssl_ctx, mosq->tls_certfile);
-				if(ret != 1){
-#ifdef WITH_BROKER
-					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load client certificate, check bridge_certfile \"%s\".", mosq->tls_certfile);
-#else
-					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load client certificate \"%s\".", mosq->tls_certfile);
-#endif
-					COMPAT_CLOSE(sock);
-					return MOSQ_ERR_TLS;
-				}
-			}
-			if(mosq->tls_keyfile){
-				ret = SSL_CTX_use_PrivateKey_file(mosq->ssl_ctx, mosq->tls_keyfile, SSL_FILETYPE_PEM);
-				if(ret != 1){
-#ifdef WITH_BROKER
-					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load client key file, check bridge_keyfile \"%s\".", mosq->tls_keyfile);
-#else
-					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load client key file \"%s\".", mosq->tls_keyfile);
-#endif
-					COMPAT_CLOSE(sock);
-					return MOSQ_ERR_TLS;
-				}
-				ret = SSL_CTX_check_private_key(mosq->ssl_ctx);
-				if(ret != 1){
-					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Client certificate/key are inconsistent.");
-					COMPAT_CLOSE(sock);
-					return MOSQ_ERR_TLS;
-				}
+				return rc;
 			}
-#ifdef REAL_WITH_TLS_PSK
-		}else if(mosq->tls_psk){
-			SSL_CTX_set_psk_client_callback(mosq->ssl_ctx, psk_client_callback);
-#endif
 		}
 
 		mosq->ssl = SSL_new(mosq->ssl_ctx);
@@ -479,25 +1330,218 @@ int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t
 		}
 		SSL_set_bio(mosq->ssl, bio, bio);
 
-		ret = SSL_connect(mosq->ssl);
-		if(ret != 1){
-			ret = SSL_get_error(mosq->ssl, ret);
-			if(ret == SSL_ERROR_WANT_READ){
-				/* We always try to read anyway */
-			}else if(ret == SSL_ERROR_WANT_WRITE){
-				mosq->want_write = true;
-			}else{
-				COMPAT_CLOSE(sock);
-				return MOSQ_ERR_TLS;
-			}
+		/* The handshake ends with our Finished message and CONNECT follows
+		 * straight after it, so with Nagle's algorithm CONNECT would wait
+		 * for the broker's delayed ACK of Finished. Nagle is turned back on
+		 * when CONNACK arrives. */
+		_mosquitto_socket_nodelay(sock, true);
+
+		/* The rest of the handshake is driven from the network loop. */
+		_mosquitto_tls_handshake_start(mosq);
+		rc = _mosquitto_tls_handshake(mosq);
+		if(rc){
+			SSL_free(mosq->ssl);
+			mosq->ssl = NULL;
+			COMPAT_CLOSE(sock);
+			return rc;
 		}
 	}
 #endif
 
 	mosq->sock = sock;
+	_mosquitto_interest_update(mosq);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Create a socket and connect it to 'ip' on port 'port'.
+ * Returns -1 on failure (ip is NULL, socket creation/connection error)
+ * Returns sock number on success.
+ */
+int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t port, const char *bind_address, bool blocking)
+{
+	int sock = INVALID_SOCKET;
+	int rc;
+
+	if(!mosq || !host || !port) return MOSQ_ERR_INVAL;
+
+	rc = _mosquitto_try_connect(mosq, host, port, &sock, bind_address, blocking);
+	if(rc != MOSQ_ERR_SUCCESS) return rc;
+
+	if(sock == INVALID_SOCKET){
+		/* Still connecting. Until the race is won mosq->sock stands in for
+		 * it, for anyone waiting on mosquitto_socket(). */
+		mosq->sock = _mosquitto_connect_race_sock(mosq->connect_race);
+		_mosquitto_interest_update(mosq);
+		return MOSQ_ERR_SUCCESS;
+	}
+	return _mosquitto_socket_connected(mosq, sock);
+}
+
+#ifndef WITH_BROKER
+#  ifdef WITH_THREADING
+/* Collect the lookup of the race's host if it has finished, and take the
+ * candidates from it. Returns MOSQ_ERR_SUCCESS with race->resolve still set
+ * while it is running. */
+static int _mosquitto_connect_race_resolved(struct mosquitto *mosq, struct _mosquitto_connect_race *race)
+{
+	struct addrinfo *ainfo;
+	bool done;
+	int rc;
+
+	rc = _mosquitto_resolve_poll(race->resolve, &ainfo, &done);
+	if(!done){
+		if(race->deadline && mosquitto_time_ms() >= race->deadline){
+			errno = ETIMEDOUT;
+			return MOSQ_ERR_ERRNO;
+		}
+		return MOSQ_ERR_SUCCESS;
+	}
+	/* mosq->sock was the lookup's wakeup, which goes with it. */
+	_mosquitto_resolve_req_release(race->resolve);
+	race->resolve = NULL;
+	mosq->sock = INVALID_SOCKET;
+	MOSQ_ATOMIC_STORE_INT(&mosq->connect_resolving, 0);
+	if(rc) return rc;
 
+	_mosquitto_connect_race_addrs(mosq->host, race, ainfo);
+	race->next_start = mosquitto_time_ms();
 	return MOSQ_ERR_SUCCESS;
 }
+#  endif
+
+/* Move on a race started by a non-blocking connect. Returns MOSQ_ERR_SUCCESS
+ * while it is still going, and once it has been won, when mosq->sock becomes
+ * the winning socket and connect_race is cleared. On failure, or with
+ * MOSQ_ERR_NO_CONN if the client is disconnecting, the race is dropped and
+ * mosq->sock is left invalid. */
+int _mosquitto_connect_race_step(struct mosquitto *mosq)
+{
+	struct _mosquitto_connect_race *race = mosq->connect_race;
+	int sock;
+	int winner = -1;
+	int rc;
+
+	if(!race) return MOSQ_ERR_SUCCESS;
+
+	if(MOSQ_ATOMIC_LOAD_INT(&mosq->state) == mosq_cs_disconnecting){
+		/* mosquitto_disconnect() was called before any attempt connected. */
+		_mosquitto_connect_race_cancel(mosq);
+		return MOSQ_ERR_NO_CONN;
+	}
+
+	sock = INVALID_SOCKET;
+	rc = MOSQ_ERR_SUCCESS;
+#  ifdef WITH_THREADING
+	if(race->resolve){
+		rc = _mosquitto_connect_race_resolved(mosq, race);
+		if(rc == MOSQ_ERR_SUCCESS && race->resolve){
+			/* Still looking up the host. */
+			return MOSQ_ERR_SUCCESS;
+		}
+	}
+#  endif
+	if(rc == MOSQ_ERR_SUCCESS){
+		rc = _mosquitto_connect_race_advance(mosq, race, &sock, &winner);
+	}
+	if(rc == MOSQ_ERR_SUCCESS && sock == INVALID_SOCKET){
+		if(mosq->sock != _mosquitto_connect_race_sock(race)){
+			mosq->sock = _mosquitto_connect_race_sock(race);
+			_mosquitto_interest_update(mosq);
+		}
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	/* mosq->sock belongs to the race, which has closed it if it lost. */
+	mosq->connect_race = NULL;
+	mosq->sock = INVALID_SOCKET;
+	_mosquitto_connect_race_finish(mosq->host, race, rc, winner);
+	if(rc){
+		_mosquitto_interest_update(mosq);
+		return rc;
+	}
+	return _mosquitto_socket_connected(mosq, sock);
+}
+
+/* Add every attempt of the client's connection race to fds, for
+ * mosquitto_loop(). */
+void _mosquitto_connect_race_fdset(struct mosquitto *mosq, fd_set *fds, mosq_sock_t *maxfd)
+{
+	struct _mosquitto_connect_race *race = mosq->connect_race;
+	int i;
+
+	if(!race) return;
+	for(i=0; i<race->n; i++){
+		FD_SET(race->inflight[i], fds);
+		if(race->inflight[i] > *maxfd) *maxfd = race->inflight[i];
+	}
+}
+
+/* When _mosquitto_connect_race_step() next needs calling if no attempt
+ * finishes first, or -1. */
+int64_t _mosquitto_connect_race_deadline(struct mosquitto *mosq)
+{
+	if(!mosq->connect_race) return -1;
+	return _mosquitto_connect_race_timeout(mosq, mosq->connect_race);
+}
+
+/* Abandon the client's connection race, closing every attempt. */
+void _mosquitto_connect_race_cancel(struct mosquitto *mosq)
+{
+	if(!mosq->connect_race) return;
+
+	_mosquitto_connect_race_free(mosq->connect_race);
+	mosq->connect_race = NULL;
+	MOSQ_ATOMIC_STORE_INT(&mosq->connect_resolving, 0);
+	mosq->sock = INVALID_SOCKET;
+	_mosquitto_interest_update(mosq);
+}
+#endif
+
+#ifdef WITH_TLS
+/* Take the client TLS handshake one step further. The socket is
+ * non-blocking, so this returns MOSQ_ERR_SUCCESS with errno set to EAGAIN
+ * while the handshake is still waiting for the network, and want_write set
+ * if OpenSSL is waiting to write rather than read. Nothing queued is sent
+ * until tls_handshake_done is set. */
+int _mosquitto_tls_handshake(struct mosquitto *mosq)
+{
+	int ret;
+	int err;
+	char ebuf[256];
+	unsigned long e;
+
+	assert(mosq);
+	assert(mosq->ssl);
+
+	errno = 0;
+	ret = SSL_connect(mosq->ssl);
+	if(ret == 1){
+		mosq->want_write = false;
+		_mosquitto_tls_handshake_check(mosq);
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	err = SSL_get_error(mosq->ssl, ret);
+	if(err == SSL_ERROR_WANT_READ){
+		mosq->want_write = false;
+		errno = EAGAIN;
+		return MOSQ_ERR_SUCCESS;
+	}else if(err == SSL_ERROR_WANT_WRITE){
+		mosq->want_write = true;
+		errno = EAGAIN;
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	e = ERR_get_error();
+	while(e){
+		_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "OpenSSL Error: %s", ERR_error_string(e, ebuf));
+		e = ERR_get_error();
+	}
+	errno = EPROTO;
+	return MOSQ_ERR_TLS;
+}
+#endif
 
 int _mosquitto_read_byte(struct _mosquitto_packet *packet, uint8_t *byte)
 {
@@ -687,30 +1731,149 @@ ssize_t _mosquitto_net_write(struct mosquitto *mosq, void *buf, size_t count)
 #endif
 }
 
+#if !defined(WIN32) || defined(WITH_TLS)
+/* Account for a write that went past the end of packet into the packets
+ * queued behind it. Returns the part of write_length that belongs to packet
+ * itself. */
+static ssize_t _mosquitto_packet_write_gathered(struct mosquitto *mosq, struct _mosquitto_packet *packet, ssize_t write_length)
+{
+	struct _mosquitto_packet *p;
+	ssize_t remaining;
+	uint32_t len;
+
+	if(write_length <= (ssize_t)packet->to_process){
+		return write_length;
+	}
+
+#  if defined(WITH_BROKER) && defined(WITH_SYS_TREE)
+	g_bytes_sent += write_length - packet->to_process;
+#  endif
+	/* Only this thread removes packets from the queue, so the packets that
+	 * were gathered are still at its head. */
+	remaining = write_length - packet->to_process;
+	for(p = _mosquitto_packet_queue_peek(mosq, NULL); p && remaining > 0; p = _mosquitto_packet_queue_peek(mosq, p)){
+		len = remaining < (ssize_t)p->to_process ? (uint32_t)remaining : p->to_process;
+		p->pos += len;
+		p->to_process -= len;
+		remaining -= len;
+	}
+
+	return packet->to_process;
+}
+#endif
+
+#ifdef WITH_TLS
+/* Copy packet and as many of the whole packets queued behind it as fit into
+ * the staging buffer, and write them with a single SSL_write(), so that a
+ * burst of small packets costs one TLS record rather than one each. Nothing
+ * is held back waiting for more data: only what is already queued is
+ * gathered.
+ *
+ * If SSL_write() has to be retried, the retry may be made from a different
+ * buffer and with more packets behind it. This is fine because nothing is
+ * accounted as written until SSL_write() succeeds, so the buffer always
+ * starts with the same bytes, and the context has
+ * SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER set. */
+static ssize_t _mosquitto_packet_write_tls(struct mosquitto *mosq, struct _mosquitto_packet *packet)
+{
+	struct _mosquitto_packet *p;
+	uint32_t len;
+
+	p = _mosquitto_packet_queue_peek(mosq, NULL);
+	if(!p || packet->to_process + p->to_process > MOSQ_TLS_RECORD_MAX){
+		return _mosquitto_net_write(mosq, &(packet->payload[packet->pos]), packet->to_process);
+	}
+	if(!mosq->tls_wbuf){
+		mosq->tls_wbuf = _mosquitto_malloc(MOSQ_TLS_RECORD_MAX);
+		if(!mosq->tls_wbuf){
+			return _mosquitto_net_write(mosq, &(packet->payload[packet->pos]), packet->to_process);
+		}
+	}
+
+	memcpy(mosq->tls_wbuf, &(packet->payload[packet->pos]), packet->to_process);
+	len = packet->to_process;
+	for(; p && len + p->to_process <= MOSQ_TLS_RECORD_MAX; p = _mosquitto_packet_queue_peek(mosq, p)){
+		memcpy(&(mosq->tls_wbuf[len]), &(p->payload[p->pos]), p->to_process);
+		len += p->to_process;
+	}
+
+	return _mosquitto_packet_write_gathered(mosq, packet, _mosquitto_net_write(mosq, mosq->tls_wbuf, len));
+}
+#endif
+
+/* Write as much of packet as possible. On platforms with writev() the
+ * packets queued behind packet are gathered into the same call, so that a
+ * burst of small packets costs a single system call. Bytes written from
+ * those packets are accounted for here; the return value only covers packet
+ * itself, as with _mosquitto_net_write(). The caller must hold
+ * current_out_packet_mutex. */
+static ssize_t _mosquitto_packet_write_gather(struct mosquitto *mosq, struct _mosquitto_packet *packet)
+{
+#ifndef WIN32
+	struct iovec iov[MOSQ_WRITEV_MAX];
+	struct _mosquitto_packet *p;
+	int count;
+#endif
+
+#ifdef WITH_TLS
+	if(mosq->ssl){
+		return _mosquitto_packet_write_tls(mosq, packet);
+	}
+#endif
+#ifndef WIN32
+	iov[0].iov_base = &(packet->payload[packet->pos]);
+	iov[0].iov_len = packet->to_process;
+	count = 1;
+
+	for(p = _mosquitto_packet_queue_peek(mosq, NULL); p && count < MOSQ_WRITEV_MAX; p = _mosquitto_packet_queue_peek(mosq, p)){
+		iov[count].iov_base = &(p->payload[p->pos]);
+		iov[count].iov_len = p->to_process;
+		count++;
+	}
+
+	if(count == 1){
+		return _mosquitto_net_write(mosq, &(packet->payload[packet->pos]), packet->to_process);
+	}
+
+	errno = 0;
+	return _mosquitto_packet_write_gathered(mosq, packet, writev(mosq->sock, iov, count));
+#else
+	return _mosquitto_net_write(mosq, &(packet->payload[packet->pos]), packet->to_process);
+#endif
+}
+
 int _mosquitto_packet_write(struct mosquitto *mosq)
 {
 	ssize_t write_length;
+#if defined(WITH_TLS) && !defined(WITH_BROKER)
+	int rc;
+#endif
 	struct _mosquitto_packet *packet;
 
 	if(!mosq) return MOSQ_ERR_INVAL;
 	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
+	if(mosq->connect_race){
+		/* Nothing moves until an attempt has won the race. */
+		errno = EAGAIN;
+		return MOSQ_ERR_SUCCESS;
+	}
+#if defined(WITH_TLS) && !defined(WITH_BROKER)
+	if(mosq->ssl && !mosq->tls_handshake_done){
+		rc = _mosquitto_tls_handshake(mosq);
+		if(rc || !mosq->tls_handshake_done) return rc;
+	}
+#endif
 
-	pthread_mutex_lock(&mosq->current_out_packet_mutex);
-	pthread_mutex_lock(&mosq->out_packet_mutex);
-	if(mosq->out_packet && !mosq->current_out_packet){
-		mosq->current_out_packet = mosq->out_packet;
-		mosq->out_packet = mosq->out_packet->next;
-		if(!mosq->out_packet){
-			mosq->out_packet_last = NULL;
-		}
+	_mosquitto_mutex_lock(mosq, &mosq->current_out_packet_mutex);
+	if(!mosq->current_out_packet){
+		mosq->current_out_packet = _mosquitto_packet_queue_pop(mosq);
 	}
-	pthread_mutex_unlock(&mosq->out_packet_mutex);
 
 	while(mosq->current_out_packet){
 		packet = mosq->current_out_packet;
 
 		while(packet->to_process > 0){
-			write_length = _mosquitto_net_write(mosq, &(packet->payload[packet->pos]), packet->to_process);
+			write_length = _mosquitto_packet_write_gather(mosq, packet);
 			if(write_length > 0){
 #if defined(WITH_BROKER) && defined(WITH_SYS_TREE)
 				g_bytes_sent += write_length;
@@ -722,10 +1885,10 @@ int _mosquitto_packet_write(struct mosquitto *mosq)
 				errno = WSAGetLastError();
 #endif
 				if(errno == EAGAIN || errno == COMPAT_EWOULDBLOCK){
-					pthread_mutex_unlock(&mosq->current_out_packet_mutex);
+					_mosquitto_mutex_unlock(mosq, &mosq->current_out_packet_mutex);
 					return MOSQ_ERR_SUCCESS;
 				}else{
-					pthread_mutex_unlock(&mosq->current_out_packet_mutex);
+					_mosquitto_mutex_unlock(mosq, &mosq->current_out_packet_mutex);
 					switch(errno){
 						case COMPAT_ECONNRESET:
 							return MOSQ_ERR_CONN_LOST;
@@ -745,36 +1908,26 @@ int _mosquitto_packet_write(struct mosquitto *mosq)
 #  endif
 #else
 		if(((packet->command)&0xF6) == PUBLISH){
-			pthread_mutex_lock(&mosq->callback_mutex);
+			_mosquitto_mutex_lock(mosq, &mosq->callback_mutex);
 			if(mosq->on_publish){
 				/* This is a QoS=0 message */
-				mosq->in_callback = true;
+				_mosquitto_callback_enter();
 				mosq->on_publish(mosq, mosq->userdata, packet->mid);
-				mosq->in_callback = false;
+				_mosquitto_callback_leave();
 			}
-			pthread_mutex_unlock(&mosq->callback_mutex);
+			_mosquitto_mutex_unlock(mosq, &mosq->callback_mutex);
 		}
 #endif
 
 		/* Free data and reset values */
-		pthread_mutex_lock(&mosq->out_packet_mutex);
-		mosq->current_out_packet = mosq->out_packet;
-		if(mosq->out_packet){
-			mosq->out_packet = mosq->out_packet->next;
-			if(!mosq->out_packet){
-				mosq->out_packet_last = NULL;
-			}
-		}
-		pthread_mutex_unlock(&mosq->out_packet_mutex);
+		mosq->current_out_packet = _mosquitto_packet_queue_pop(mosq);
 
 		_mosquitto_packet_cleanup(packet);
 		_mosquitto_free(packet);
 
-		pthread_mutex_lock(&mosq->msgtime_mutex);
-		mosq->last_msg_out = mosquitto_time();
-		pthread_mutex_unlock(&mosq->msgtime_mutex);
+		MOSQ_ATOMIC_STORE_I64(&mosq->last_msg_out, mosquitto_time_ms());
 	}
-	pthread_mutex_unlock(&mosq->current_out_packet_mutex);
+	_mosquitto_mutex_unlock(mosq, &mosq->current_out_packet_mutex);
 	return MOSQ_ERR_SUCCESS;
 }
 
@@ -790,6 +1943,17 @@ int _mosquitto_packet_read(struct mosquitto *mosq)
 
 	if(!mosq) return MOSQ_ERR_INVAL;
 	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
+	if(mosq->connect_race){
+		/* Nothing moves until an attempt has won the race. */
+		errno = EAGAIN;
+		return MOSQ_ERR_SUCCESS;
+	}
+#if defined(WITH_TLS) && !defined(WITH_BROKER)
+	if(mosq->ssl && !mosq->tls_handshake_done){
+		rc = _mosquitto_tls_handshake(mosq);
+		if(rc || !mosq->tls_handshake_done) return rc;
+	}
+#endif
 	/* This gets called if pselect() indicates that there is network data
 	 * available - ie. at least one byte.  What we do depends on what data we
 	 * already have.
@@ -813,7 +1977,7 @@ int _mosquitto_packet_read(struct mosquitto *mosq)
 			g_bytes_received++;
 #  endif
 			/* Clients must send CONNECT as their first command. */
-			if(!(mosq->bridge) && mosq->state == mosq_cs_new && (byte&0xF0) != CONNECT) return MOSQ_ERR_PROTOCOL;
+			if(!(mosq->bridge) && MOSQ_ATOMIC_LOAD_INT(&mosq->state) == mosq_cs_new && (byte&0xF0) != CONNECT) return MOSQ_ERR_PROTOCOL;
 #endif
 		}else{
 			if(read_length == 0) return MOSQ_ERR_CONN_LOST; /* EOF */
@@ -918,9 +2082,7 @@ int _mosquitto_packet_read(struct mosquitto *mosq)
 	/* Free data and reset values */
 	_mosquitto_packet_cleanup(&mosq->in_packet);
 
-	pthread_mutex_lock(&mosq->msgtime_mutex);
-	mosq->last_msg_in = mosquitto_time();
-	pthread_mutex_unlock(&mosq->msgtime_mutex);
+	MOSQ_ATOMIC_STORE_I64(&mosq->last_msg_in, mosquitto_time_ms());
 	return rc;
 }
 
@@ -30,6 +30,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #define _NET_MOSQ_H_
 
 #ifndef WIN32
+#include <sys/select.h>
 #include <unistd.h>
 #else
 #include <winsock2.h>
@@ -62,18 +63,59 @@ struct mosquitto_db;
 #define INVALID_SOCKET -1
 #endif
 
+/* Maximum number of queued packets gathered into a single writev() call. */
+#define MOSQ_WRITEV_MAX 32
+
+/* Largest amount of data gathered into a single TLS record. This is the
+ * maximum TLS plaintext record size. */
+#define MOSQ_TLS_RECORD_MAX 16384
+
+/* Maximum number of resolved addresses tried per connection, and how many of
+ * them may be connecting at once. */
+#define MOSQ_CONNECT_CANDIDATES_MAX 16
+#define MOSQ_CONNECT_RACE_MAX 4
+
+/* Resolved address cache limits. The TTL is in ms and can be changed with
+ * mosquitto_address_cache_ttl_set(). */
+#define MOSQ_ADDR_CACHE_MAX 64
+#define MOSQ_ADDR_CACHE_TTL_DEFAULT 60000
+
 /* Macros for accessing the MSB and LSB of a uint16_t */
 #define MOSQ_MSB(A) (uint8_t)((A & 0xFF00) >> 8)
 #define MOSQ_LSB(A) (uint8_t)(A & 0x00FF)
 
 void _mosquitto_net_init(void);
 void _mosquitto_net_cleanup(void);
+void _mosquitto_addr_cache_cleanup(void);
 
 void _mosquitto_packet_cleanup(struct _mosquitto_packet *packet);
+void _mosquitto_packet_queue_init(struct mosquitto *mosq);
 int _mosquitto_packet_queue(struct mosquitto *mosq, struct _mosquitto_packet *packet);
+int _mosquitto_packet_queue_chain(struct mosquitto *mosq, struct _mosquitto_packet *packet);
+struct _mosquitto_packet *_mosquitto_packet_queue_pop(struct mosquitto *mosq);
+struct _mosquitto_packet *_mosquitto_packet_queue_peek(struct mosquitto *mosq, struct _mosquitto_packet *prev);
+bool _mosquitto_packet_queue_empty(struct mosquitto *mosq);
+void _mosquitto_packet_queue_clear(struct mosquitto *mosq);
+#ifndef WITH_BROKER
+int _mosquitto_socketpair(mosq_sock_t *pairR, mosq_sock_t *pairW);
+void _mosquitto_loop_wakeup(struct mosquitto *mosq);
+void _mosquitto_loop_wakeup_clear(struct mosquitto *mosq);
+void _mosquitto_interest_update(struct mosquitto *mosq);
+#endif
 int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t port, const char *bind_address, bool blocking);
+#ifndef WITH_BROKER
+int _mosquitto_connect_race_step(struct mosquitto *mosq);
+void _mosquitto_connect_race_fdset(struct mosquitto *mosq, fd_set *fds, mosq_sock_t *maxfd);
+int64_t _mosquitto_connect_race_deadline(struct mosquitto *mosq);
+void _mosquitto_connect_race_cancel(struct mosquitto *mosq);
+#endif
 int _mosquitto_socket_close(struct mosquitto *mosq);
-int _mosquitto_try_connect(const char *host, uint16_t port, int *sock, const char *bind_address, bool blocking);
+int _mosquitto_try_connect(struct mosquitto *mosq, const char *host, uint16_t port, int *sock, const char *bind_address, bool blocking);
+int _mosquitto_socket_error(mosq_sock_t sock);
+int _mosquitto_socket_nodelay(mosq_sock_t sock, bool nodelay);
+#ifdef WITH_TLS
+int _mosquitto_tls_handshake(struct mosquitto *mosq);
+#endif
 
 int _mosquitto_read_byte(struct _mosquitto_packet *packet, uint8_t *byte);
 int _mosquitto_read_bytes(struct _mosquitto_packet *packet, void *bytes, uint32_t count);
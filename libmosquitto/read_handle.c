@@ -32,6 +32,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <string.h>
 
 #include "mosquitto.h"
+#include "dispatch_mosq.h"
 #include "logging_mosq.h"
 #include "memory_mosq.h"
 #include "messages_mosq.h"
@@ -80,6 +81,7 @@ int _mosquitto_handle_publish(struct mosquitto *mosq)
 	struct mosquitto_message_all *message;
 	int rc = 0;
 	uint16_t mid;
+	uint32_t topic_pos;
 
 	assert(mosq);
 
@@ -93,11 +95,18 @@ int _mosquitto_handle_publish(struct mosquitto *mosq)
 	message->msg.qos = (header & 0x06)>>1;
 	message->msg.retain = (header & 0x01);
 
+	topic_pos = mosq->in_packet.pos;
 	rc = _mosquitto_read_string(&mosq->in_packet, &message->msg.topic);
 	if(rc){
 		_mosquitto_message_cleanup(&message);
 		return rc;
 	}
+	/* Check the length that was on the wire, strlen() would stop at a NUL. */
+	if(_mosquitto_topic_check(message->msg.topic, mosq->in_packet.pos - topic_pos - 2, false)){
+		_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Invalid topic in PUBLISH from broker.");
+		_mosquitto_message_cleanup(&message);
+		return MOSQ_ERR_PROTOCOL;
+	}
 	rc = _mosquitto_fix_sub_topic(&message->msg.topic);
 	if(rc){
 		_mosquitto_message_cleanup(&message);
@@ -136,35 +145,21 @@ int _mosquitto_handle_publish(struct mosquitto *mosq)
 			message->msg.mid, message->msg.topic,
 			(long)message->msg.payloadlen);
 
-	message->timestamp = mosquitto_time();
+	message->timestamp = mosquitto_time_ms();
 	switch(message->msg.qos){
 		case 0:
-			pthread_mutex_lock(&mosq->callback_mutex);
-			if(mosq->on_message){
-				mosq->in_callback = true;
-				mosq->on_message(mosq, mosq->userdata, &message->msg);
-				mosq->in_callback = false;
-			}
-			pthread_mutex_unlock(&mosq->callback_mutex);
-			_mosquitto_message_cleanup(&message);
+			_mosquitto_message_deliver(mosq, message);
 			return MOSQ_ERR_SUCCESS;
 		case 1:
 			rc = _mosquitto_send_puback(mosq, message->msg.mid);
-			pthread_mutex_lock(&mosq->callback_mutex);
-			if(mosq->on_message){
-				mosq->in_callback = true;
-				mosq->on_message(mosq, mosq->userdata, &message->msg);
-				mosq->in_callback = false;
-			}
-			pthread_mutex_unlock(&mosq->callback_mutex);
-			_mosquitto_message_cleanup(&message);
+			_mosquitto_message_deliver(mosq, message);
 			return rc;
 		case 2:
 			rc = _mosquitto_send_pubrec(mosq, message->msg.mid);
-			pthread_mutex_lock(&mosq->message_mutex);
+			_mosquitto_mutex_lock(mosq, &mosq->message_mutex);
 			message->state = mosq_ms_wait_for_pubrel;
 			_mosquitto_message_queue(mosq, message, true);
-			pthread_mutex_unlock(&mosq->message_mutex);
+			_mosquitto_mutex_unlock(mosq, &mosq->message_mutex);
 			return rc;
 		default:
 			_mosquitto_message_cleanup(&message);
@@ -30,10 +30,13 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <assert.h>
 
 #include "mosquitto.h"
+#include "atomic_mosq.h"
 #include "logging_mosq.h"
 #include "memory_mosq.h"
 #include "net_mosq.h"
 #include "read_handle.h"
+#include "session_mosq.h"
+#include "util_mosq.h"
 
 int _mosquitto_handle_connack(struct mosquitto *mosq)
 {
@@ -52,16 +55,27 @@ int _mosquitto_handle_connack(struct mosquitto *mosq)
 	if(rc) return rc;
 	rc = _mosquitto_read_byte(&mosq->in_packet, &result);
 	if(rc) return rc;
-	pthread_mutex_lock(&mosq->callback_mutex);
+#ifdef WITH_TLS
+	if(mosq->ssl){
+		/* Nagle is off for the handshake and CONNECT, see
+		 * _mosquitto_socket_connect(). */
+		_mosquitto_socket_nodelay(mosq->sock, false);
+	}
+#endif
+	if(result != 0 && mosq->pipeline){
+		_mosquitto_session_refused(mosq);
+	}
+	_mosquitto_mutex_lock(mosq, &mosq->callback_mutex);
 	if(mosq->on_connect){
-		mosq->in_callback = true;
+		_mosquitto_callback_enter();
 		mosq->on_connect(mosq, mosq->userdata, result);
-		mosq->in_callback = false;
+		_mosquitto_callback_leave();
 	}
-	pthread_mutex_unlock(&mosq->callback_mutex);
+	_mosquitto_mutex_unlock(mosq, &mosq->callback_mutex);
 	switch(result){
 		case 0:
-			mosq->state = mosq_cs_connected;
+			MOSQ_ATOMIC_STORE_INT(&mosq->state, mosq_cs_connected);
+			mosq->reconnect_attempts = 0;
 			return MOSQ_ERR_SUCCESS;
 		case 1:
 		case 2:
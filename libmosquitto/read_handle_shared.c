@@ -32,6 +32,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <string.h>
 
 #include "mosquitto.h"
+#include "atomic_mosq.h"
+#include "dispatch_mosq.h"
 #include "logging_mosq.h"
 #include "memory_mosq.h"
 #include "messages_mosq.h"
@@ -102,13 +104,13 @@ int _mosquitto_handle_pubackcomp(struct mosquitto *mosq, const char *type)
 
 	if(!_mosquitto_message_delete(mosq, mid, mosq_md_out)){
 		/* Only inform the client the message has been sent once. */
-		pthread_mutex_lock(&mosq->callback_mutex);
+		_mosquitto_mutex_lock(mosq, &mosq->callback_mutex);
 		if(mosq->on_publish){
-			mosq->in_callback = true;
+			_mosquitto_callback_enter();
 			mosq->on_publish(mosq, mosq->userdata, mid);
-			mosq->in_callback = false;
+			_mosquitto_callback_leave();
 		}
-		pthread_mutex_unlock(&mosq->callback_mutex);
+		_mosquitto_mutex_unlock(mosq, &mosq->callback_mutex);
 	}
 #endif
 
@@ -173,14 +175,7 @@ int _mosquitto_handle_pubrel(struct mosquitto_db *db, struct mosquitto *mosq)
 	if(!_mosquitto_message_remove(mosq, mid, mosq_md_in, &message)){
 		/* Only pass the message on if we have removed it from the queue - this
 		 * prevents multiple callbacks for the same message. */
-		pthread_mutex_lock(&mosq->callback_mutex);
-		if(mosq->on_message){
-			mosq->in_callback = true;
-			mosq->on_message(mosq, mosq->userdata, &message->msg);
-			mosq->in_callback = false;
-		}
-		pthread_mutex_unlock(&mosq->callback_mutex);
-		_mosquitto_message_cleanup(&message);
+		_mosquitto_message_deliver(mosq, message);
 	}
 #endif
 	rc = _mosquitto_send_pubcomp(mosq, mid);
@@ -220,13 +215,13 @@ int _mosquitto_handle_suback(struct mosquitto *mosq)
 		i++;
 	}
 #ifndef WITH_BROKER
-	pthread_mutex_lock(&mosq->callback_mutex);
+	_mosquitto_mutex_lock(mosq, &mosq->callback_mutex);
 	if(mosq->on_subscribe){
-		mosq->in_callback = true;
+		_mosquitto_callback_enter();
 		mosq->on_subscribe(mosq, mosq->userdata, mid, qos_count, granted_qos);
-		mosq->in_callback = false;
+		_mosquitto_callback_leave();
 	}
-	pthread_mutex_unlock(&mosq->callback_mutex);
+	_mosquitto_mutex_unlock(mosq, &mosq->callback_mutex);
 #endif
 	_mosquitto_free(granted_qos);
 
@@ -252,13 +247,13 @@ int _mosquitto_handle_unsuback(struct mosquitto *mosq)
 	rc = _mosquitto_read_uint16(&mosq->in_packet, &mid);
 	if(rc) return rc;
 #ifndef WITH_BROKER
-	pthread_mutex_lock(&mosq->callback_mutex);
+	_mosquitto_mutex_lock(mosq, &mosq->callback_mutex);
 	if(mosq->on_unsubscribe){
-		mosq->in_callback = true;
+		_mosquitto_callback_enter();
 	   	mosq->on_unsubscribe(mosq, mosq->userdata, mid);
-		mosq->in_callback = false;
+		_mosquitto_callback_leave();
 	}
-	pthread_mutex_unlock(&mosq->callback_mutex);
+	_mosquitto_mutex_unlock(mosq, &mosq->callback_mutex);
 #endif
 
 	return MOSQ_ERR_SUCCESS;
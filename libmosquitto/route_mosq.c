@@ -0,0 +1,747 @@
+/*
+Copyright (c) 2013 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <assert.h>
+#include <string.h>
+
+#include "mosquitto.h"
+#include "mosquitto_internal.h"
+#include "atomic_mosq.h"
+#include "memory_mosq.h"
+#include "route_mosq.h"
+#include "util_mosq.h"
+
+/* Per-subscription message callbacks.
+ *
+ * Callbacks added with mosquitto_message_callback_add() are kept in a trie
+ * with one node per topic level. The children of a node are held in an open
+ * addressed hash table, so looking up a level costs the same whether it has
+ * two siblings or a hundred thousand, and the "+" child is kept to one side
+ * so that it is always followed. Finding the callbacks for a message
+ * therefore depends on the depth of its topic and on how many "+" filters
+ * could match it, not on how many callbacks have been added.
+ *
+ * The trie is protected by route_mutex, but callbacks are not run with it
+ * held so that they can add and remove callbacks themselves. Each matching
+ * route is referenced while the lock is held and released once its callback
+ * has returned, so a route removed in the meantime is not freed under a
+ * delivery that is still using it. */
+
+/* Matches collected on the stack before moving to the heap. */
+#define ROUTE_MATCH_STACK 16
+
+struct _mosquitto_route{
+	struct _mosquitto_route *next;
+	void (*on_message)(struct mosquitto *, void *, const struct mosquitto_message *);
+	void *obj;
+	int refs; /* Deliveries using this route, protected by route_mutex. */
+	int removed; /* atomic */
+};
+
+struct _mosquitto_route_node{
+	struct _mosquitto_route_node *parent;
+	/* Children other than "+", with linear probing. */
+	struct _mosquitto_route_node **children;
+	unsigned int child_count;
+	unsigned int child_mask;
+	struct _mosquitto_route_node *plus;
+	/* Filters that end at this node, and filters that end with a "#" after
+	 * it. */
+	struct _mosquitto_route *routes;
+	struct _mosquitto_route *hash_routes;
+	unsigned int hash;
+	size_t len;
+	char level[1];
+};
+
+struct _mosquitto_route_match{
+	struct _mosquitto_route **routes;
+	int count;
+	int size;
+	struct _mosquitto_route *stack[ROUTE_MATCH_STACK];
+};
+
+/* Split topics into levels the way mosquitto_sub_topic_tokenise() does: a
+ * leading slash starts an empty level, otherwise runs of slashes count as
+ * one and trailing slashes are ignored. Returns the length of the level that
+ * starts at *pos and moves *pos on to the next level, or to NULL after the
+ * last one. */
+static size_t _mosquitto_route_level(const char **pos, const char *end, const char **level)
+{
+	const char *s = *pos;
+	const char *e = s;
+	size_t len;
+
+	while(e < end && *e != '/') e++;
+	len = e - s;
+	while(e < end && *e == '/') e++;
+
+	*level = s;
+	*pos = e < end ? e : NULL;
+	return len;
+}
+
+/* FNV-1a */
+static unsigned int _mosquitto_route_hash(const char *level, size_t len)
+{
+	unsigned int hash = 2166136261U;
+	size_t i;
+
+	for(i=0; i<len; i++){
+		hash ^= (unsigned char)level[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static struct _mosquitto_route_node *_mosquitto_route_child(struct _mosquitto_route_node *node, const char *level, size_t len, unsigned int hash)
+{
+	struct _mosquitto_route_node *child;
+	unsigned int i;
+
+	if(!node->children) return NULL;
+
+	i = hash & node->child_mask;
+	while((child = node->children[i])){
+		if(child->hash == hash && child->len == len && !memcmp(child->level, level, len)){
+			return child;
+		}
+		i = (i+1) & node->child_mask;
+	}
+	return NULL;
+}
+
+static int _mosquitto_route_child_insert(struct _mosquitto_route_node *node, struct _mosquitto_route_node *child)
+{
+	struct _mosquitto_route_node **children;
+	unsigned int size, mask;
+	unsigned int i, j;
+
+	/* Keep the table no more than three quarters full. */
+	if(!node->children || (node->child_count+1)*4 > (node->child_mask+1)*3){
+		size = node->children ? (node->child_mask+1)*2 : 4;
+		children = _mosquitto_calloc(size, sizeof(struct _mosquitto_route_node *));
+		if(!children) return MOSQ_ERR_NOMEM;
+		mask = size-1;
+		if(node->children){
+			for(i=0; i<=node->child_mask; i++){
+				if(node->children[i]){
+					j = node->children[i]->hash & mask;
+					while(children[j]) j = (j+1) & mask;
+					children[j] = node->children[i];
+				}
+			}
+			_mosquitto_free(node->children);
+		}
+		node->children = children;
+		node->child_mask = mask;
+	}
+
+	i = child->hash & node->child_mask;
+	while(node->children[i]) i = (i+1) & node->child_mask;
+	node->children[i] = child;
+	node->child_count++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void _mosquitto_route_child_remove(struct _mosquitto_route_node *node, struct _mosquitto_route_node *child)
+{
+	struct _mosquitto_route_node *c;
+	unsigned int mask = node->child_mask;
+	unsigned int i, j, k;
+
+	i = child->hash & mask;
+	while(node->children[i] != child) i = (i+1) & mask;
+	node->children[i] = NULL;
+	node->child_count--;
+
+	if(node->child_count == 0){
+		_mosquitto_free(node->children);
+		node->children = NULL;
+		node->child_mask = 0;
+		return;
+	}
+
+	/* Move back any entries that probed past the slot just emptied, so that
+	 * lookups never stop short of them. */
+	j = i;
+	while(1){
+		j = (j+1) & mask;
+		c = node->children[j];
+		if(!c) break;
+		k = c->hash & mask;
+		if(((j-k) & mask) >= ((j-i) & mask)){
+			node->children[i] = c;
+			node->children[j] = NULL;
+			i = j;
+		}
+	}
+}
+
+static struct _mosquitto_route_node *_mosquitto_route_node_new(struct _mosquitto_route_node *parent, const char *level, size_t len, unsigned int hash)
+{
+	struct _mosquitto_route_node *node;
+
+	node = _mosquitto_calloc(1, sizeof(struct _mosquitto_route_node) + len);
+	if(!node) return NULL;
+
+	node->parent = parent;
+	node->hash = hash;
+	node->len = len;
+	memcpy(node->level, level, len);
+	return node;
+}
+
+static void _mosquitto_route_node_free(struct _mosquitto_route_node *node)
+{
+	struct _mosquitto_route *route, *next;
+	unsigned int i;
+
+	if(node->children){
+		for(i=0; i<=node->child_mask; i++){
+			if(node->children[i]) _mosquitto_route_node_free(node->children[i]);
+		}
+		_mosquitto_free(node->children);
+	}
+	if(node->plus) _mosquitto_route_node_free(node->plus);
+	for(route=node->routes; route; route=next){
+		next = route->next;
+		_mosquitto_free(route);
+	}
+	for(route=node->hash_routes; route; route=next){
+		next = route->next;
+		_mosquitto_free(route);
+	}
+	_mosquitto_free(node);
+}
+
+/* Free nodes that no longer lead to any route, working up from node. */
+static void _mosquitto_route_prune(struct _mosquitto_route_node **root, struct _mosquitto_route_node *node)
+{
+	struct _mosquitto_route_node *parent;
+
+	while(node && !node->routes && !node->hash_routes && !node->plus && !node->child_count){
+		parent = node->parent;
+		if(!parent){
+			*root = NULL;
+		}else if(parent->plus == node){
+			parent->plus = NULL;
+		}else{
+			_mosquitto_route_child_remove(parent, node);
+		}
+		_mosquitto_free(node);
+		node = parent;
+	}
+}
+
+/* "+" and "#" must each be a whole level, and "#" must be the last. */
+static int _mosquitto_route_sub_check(const char *sub)
+{
+	const char *c;
+
+	if(!sub[0]) return MOSQ_ERR_INVAL;
+
+	for(c=sub; *c; c++){
+		if(*c == '+' || *c == '#'){
+			if(c > sub && c[-1] != '/') return MOSQ_ERR_INVAL;
+			if(c[1] && (c[1] != '/' || *c == '#')) return MOSQ_ERR_INVAL;
+		}
+	}
+	if(c - sub > 65535) return MOSQ_ERR_INVAL;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Find the list that routes for a filter belong on, and the node that holds
+ * it, in the trie at *root. If create is set, missing nodes are added. */
+static int _mosquitto_route_find(struct _mosquitto_route_node **root, const char *sub, bool create, struct _mosquitto_route_node **node_out, struct _mosquitto_route ***list)
+{
+	struct _mosquitto_route_node *node, *child;
+	const char *pos = sub;
+	const char *end = sub + strlen(sub);
+	const char *level;
+	size_t len;
+	unsigned int hash;
+
+	if(!*root){
+		if(!create) return MOSQ_ERR_NOT_FOUND;
+		*root = _mosquitto_route_node_new(NULL, "", 0, 0);
+		if(!*root) return MOSQ_ERR_NOMEM;
+	}
+
+	node = *root;
+	while(pos){
+		len = _mosquitto_route_level(&pos, end, &level);
+		if(len == 1 && level[0] == '#'){
+			*node_out = node;
+			*list = &node->hash_routes;
+			return MOSQ_ERR_SUCCESS;
+		}else if(len == 1 && level[0] == '+'){
+			child = node->plus;
+			if(!child && create){
+				child = _mosquitto_route_node_new(node, level, len, 0);
+				if(!child){
+					_mosquitto_route_prune(root, node);
+					return MOSQ_ERR_NOMEM;
+				}
+				node->plus = child;
+			}
+		}else{
+			hash = _mosquitto_route_hash(level, len);
+			child = _mosquitto_route_child(node, level, len, hash);
+			if(!child && create){
+				child = _mosquitto_route_node_new(node, level, len, hash);
+				if(!child || _mosquitto_route_child_insert(node, child)){
+					if(child) _mosquitto_free(child);
+					_mosquitto_route_prune(root, node);
+					return MOSQ_ERR_NOMEM;
+				}
+			}
+		}
+		if(!child) return MOSQ_ERR_NOT_FOUND;
+		node = child;
+	}
+	*node_out = node;
+	*list = &node->routes;
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_message_callback_add(struct mosquitto *mosq, const char *sub, void (*on_message)(struct mosquitto *, void *, const struct mosquitto_message *), void *obj)
+{
+	struct _mosquitto_route_node *node;
+	struct _mosquitto_route **list;
+	struct _mosquitto_route *route;
+	int rc;
+
+	if(!mosq || !sub || !on_message) return MOSQ_ERR_INVAL;
+	if(_mosquitto_route_sub_check(sub)) return MOSQ_ERR_INVAL;
+
+	_mosquitto_mutex_lock(mosq, &mosq->route_mutex);
+	rc = _mosquitto_route_find(&mosq->routes, sub, true, &node, &list);
+	if(rc == MOSQ_ERR_SUCCESS){
+		/* Adding the same callback twice is not an error, but it is only
+		 * called once. */
+		while(*list){
+			if((*list)->on_message == on_message && (*list)->obj == obj) break;
+			list = &(*list)->next;
+		}
+		if(!*list){
+			route = _mosquitto_calloc(1, sizeof(struct _mosquitto_route));
+			if(route){
+				route->on_message = on_message;
+				route->obj = obj;
+				*list = route;
+				MOSQ_ATOMIC_ADD_INT(&mosq->route_count, 1);
+			}else{
+				_mosquitto_route_prune(&mosq->routes, node);
+				rc = MOSQ_ERR_NOMEM;
+			}
+		}
+	}
+	_mosquitto_mutex_unlock(mosq, &mosq->route_mutex);
+
+	return rc;
+}
+
+int mosquitto_message_callback_remove(struct mosquitto *mosq, const char *sub, void (*on_message)(struct mosquitto *, void *, const struct mosquitto_message *), void *obj)
+{
+	struct _mosquitto_route_node *node;
+	struct _mosquitto_route **list;
+	struct _mosquitto_route *route;
+	int rc;
+
+	if(!mosq || !sub || !on_message) return MOSQ_ERR_INVAL;
+	if(_mosquitto_route_sub_check(sub)) return MOSQ_ERR_INVAL;
+
+	_mosquitto_mutex_lock(mosq, &mosq->route_mutex);
+	rc = _mosquitto_route_find(&mosq->routes, sub, false, &node, &list);
+	if(rc == MOSQ_ERR_SUCCESS){
+		while(*list){
+			if((*list)->on_message == on_message && (*list)->obj == obj) break;
+			list = &(*list)->next;
+		}
+		route = *list;
+		if(route){
+			*list = route->next;
+			MOSQ_ATOMIC_STORE_INT(&route->removed, 1);
+			if(route->refs == 0){
+				_mosquitto_free(route);
+			}
+			MOSQ_ATOMIC_ADD_INT(&mosq->route_count, -1);
+			_mosquitto_route_prune(&mosq->routes, node);
+		}else{
+			rc = MOSQ_ERR_NOT_FOUND;
+		}
+	}
+	_mosquitto_mutex_unlock(mosq, &mosq->route_mutex);
+
+	return rc;
+}
+
+static void _mosquitto_route_match_add(struct _mosquitto_route_match *match, struct _mosquitto_route *route)
+{
+	struct _mosquitto_route **routes;
+
+	for(; route; route=route->next){
+		if(match->count == match->size){
+			if(match->routes == match->stack){
+				routes = _mosquitto_malloc(match->size*2*sizeof(struct _mosquitto_route *));
+				if(routes) memcpy(routes, match->stack, match->count*sizeof(struct _mosquitto_route *));
+			}else{
+				routes = _mosquitto_realloc(match->routes, match->size*2*sizeof(struct _mosquitto_route *));
+			}
+			/* Out of memory, deliver to what has been found so far. */
+			if(!routes) return;
+			match->routes = routes;
+			match->size *= 2;
+		}
+		route->refs++;
+		match->routes[match->count++] = route;
+	}
+}
+
+/* Collect the routes under node that match the topic from pos onwards. Only
+ * "+" needs a second path to be followed, so this recurses once for each "+"
+ * that could match and otherwise walks down one level at a time. */
+static void _mosquitto_route_match(struct _mosquitto_route_node *node, const char *pos, const char *end, struct _mosquitto_route_match *match)
+{
+	const char *level;
+	size_t len;
+	bool dollar;
+
+	while(node){
+		/* As the spec requires, a wildcard first level doesn't match topics
+		 * starting with "$", such as "$SYS/...". */
+		dollar = !node->parent && pos && *pos == '$';
+		if(!dollar){
+			/* "a/#" matches "a" as well as everything below it. */
+			_mosquitto_route_match_add(match, node->hash_routes);
+		}
+		if(!pos){
+			_mosquitto_route_match_add(match, node->routes);
+			return;
+		}
+		len = _mosquitto_route_level(&pos, end, &level);
+		if(node->plus && !dollar){
+			_mosquitto_route_match(node->plus, pos, end, match);
+		}
+		node = _mosquitto_route_child(node, level, len, _mosquitto_route_hash(level, len));
+	}
+}
+
+/* Run the callbacks whose filters match a received message. Returns the
+ * number of matching callbacks, so that the caller can pass the message to
+ * the message callback instead if there were none. */
+int _mosquitto_route_message(struct mosquitto *mosq, const struct mosquitto_message *message)
+{
+	struct _mosquitto_route_match match;
+	struct _mosquitto_route *route;
+	int i;
+
+	assert(mosq);
+	assert(message);
+
+	if(MOSQ_ATOMIC_LOAD_INT(&mosq->route_count) == 0 || !message->topic) return 0;
+
+	match.routes = match.stack;
+	match.count = 0;
+	match.size = ROUTE_MATCH_STACK;
+
+	_mosquitto_mutex_lock(mosq, &mosq->route_mutex);
+	if(mosq->routes){
+		_mosquitto_route_match(mosq->routes, message->topic, message->topic + strlen(message->topic), &match);
+	}
+	_mosquitto_mutex_unlock(mosq, &mosq->route_mutex);
+
+	if(match.count == 0) return 0;
+
+	for(i=0; i<match.count; i++){
+		route = match.routes[i];
+		if(!MOSQ_ATOMIC_LOAD_INT(&route->removed)){
+			route->on_message(mosq, route->obj, message);
+		}
+	}
+
+	_mosquitto_mutex_lock(mosq, &mosq->route_mutex);
+	for(i=0; i<match.count; i++){
+		route = match.routes[i];
+		route->refs--;
+		if(route->refs == 0 && route->removed){
+			_mosquitto_free(route);
+		}
+	}
+	_mosquitto_mutex_unlock(mosq, &mosq->route_mutex);
+
+	if(match.routes != match.stack){
+		_mosquitto_free(match.routes);
+	}
+	return match.count;
+}
+
+void _mosquitto_route_cleanup(struct mosquitto *mosq)
+{
+	assert(mosq);
+
+	if(mosq->routes){
+		_mosquitto_route_node_free(mosq->routes);
+		mosq->routes = NULL;
+	}
+	mosq->route_count = 0;
+}
+
+/* Compiled filter sets.
+ *
+ * mosquitto_filter_set_compile() builds a trie of the filters in the same
+ * way as the callbacks above, with each route holding the index of its
+ * filter, and then flattens it into a single block. The result is never
+ * changed, so it can be matched against from any number of threads at once
+ * without locking. */
+
+struct _mosquitto_filter_node{
+	unsigned int hash;
+	unsigned int level; /* Offset into levels. */
+	unsigned int len;
+	unsigned int plus; /* Node index, 0 for none as the root is never a child. */
+	unsigned int children; /* Offset into children. */
+	unsigned int child_slots; /* 0, or a power of two. */
+	unsigned int ends; /* Offset into indices. */
+	unsigned int end_count;
+	unsigned int hashes; /* Offset into indices. */
+	unsigned int hash_count;
+};
+
+struct mosquitto_filter_set{
+	int filter_count;
+	struct _mosquitto_filter_node *nodes;
+	unsigned int *children;
+	int *indices;
+	char *levels;
+};
+
+struct _mosquitto_filter_flatten{
+	struct mosquitto_filter_set *set;
+	unsigned int node_count;
+	unsigned int child_count;
+	unsigned int index_count;
+	unsigned int level_count;
+};
+
+static void _mosquitto_filter_set_measure(struct _mosquitto_route_node *node, struct _mosquitto_filter_flatten *f)
+{
+	unsigned int i;
+
+	f->node_count++;
+	f->level_count += node->len;
+	if(node->children){
+		f->child_count += node->child_mask+1;
+		for(i=0; i<=node->child_mask; i++){
+			if(node->children[i]) _mosquitto_filter_set_measure(node->children[i], f);
+		}
+	}
+	if(node->plus) _mosquitto_filter_set_measure(node->plus, f);
+}
+
+static unsigned int _mosquitto_filter_set_flatten(struct _mosquitto_route_node *node, struct _mosquitto_filter_flatten *f)
+{
+	struct mosquitto_filter_set *set = f->set;
+	struct _mosquitto_filter_node *fn;
+	struct _mosquitto_route *route;
+	unsigned int idx, children, i;
+
+	idx = f->node_count++;
+	fn = &set->nodes[idx];
+	fn->hash = node->hash;
+	fn->level = f->level_count;
+	fn->len = node->len;
+	memcpy(&set->levels[f->level_count], node->level, node->len);
+	f->level_count += node->len;
+
+	fn->ends = f->index_count;
+	for(route=node->routes; route; route=route->next){
+		set->indices[f->index_count++] = (int)(intptr_t)route->obj;
+	}
+	fn->end_count = f->index_count - fn->ends;
+	fn->hashes = f->index_count;
+	for(route=node->hash_routes; route; route=route->next){
+		set->indices[f->index_count++] = (int)(intptr_t)route->obj;
+	}
+	fn->hash_count = f->index_count - fn->hashes;
+
+	/* Children keep the slots they had, so the table needs no rehashing. */
+	children = f->child_count;
+	fn->children = children;
+	fn->child_slots = node->children ? node->child_mask+1 : 0;
+	f->child_count += fn->child_slots;
+	for(i=0; i<fn->child_slots; i++){
+		if(node->children[i]){
+			set->children[children+i] = _mosquitto_filter_set_flatten(node->children[i], f);
+		}else{
+			set->children[children+i] = 0;
+		}
+	}
+	if(node->plus){
+		set->nodes[idx].plus = _mosquitto_filter_set_flatten(node->plus, f);
+	}else{
+		set->nodes[idx].plus = 0;
+	}
+	return idx;
+}
+
+int mosquitto_filter_set_compile(struct mosquitto_filter_set **set_out, const char *const *filters, int filter_count)
+{
+	struct _mosquitto_route_node *root = NULL;
+	struct _mosquitto_route_node *node;
+	struct _mosquitto_route **list;
+	struct _mosquitto_route *route;
+	struct _mosquitto_filter_flatten f;
+	struct mosquitto_filter_set *set;
+	size_t size;
+	int rc = MOSQ_ERR_SUCCESS;
+	int i;
+
+	if(!set_out || filter_count < 0 || (filter_count > 0 && !filters)) return MOSQ_ERR_INVAL;
+	*set_out = NULL;
+
+	for(i=0; i<filter_count; i++){
+		if(!filters[i] || _mosquitto_route_sub_check(filters[i])) return MOSQ_ERR_INVAL;
+	}
+
+	for(i=0; i<filter_count; i++){
+		rc = _mosquitto_route_find(&root, filters[i], true, &node, &list);
+		if(rc) break;
+		while(*list) list = &(*list)->next;
+		route = _mosquitto_calloc(1, sizeof(struct _mosquitto_route));
+		if(!route){
+			_mosquitto_route_prune(&root, node);
+			rc = MOSQ_ERR_NOMEM;
+			break;
+		}
+		route->obj = (void *)(intptr_t)i;
+		*list = route;
+	}
+
+	if(rc == MOSQ_ERR_SUCCESS){
+		memset(&f, 0, sizeof(f));
+		if(root) _mosquitto_filter_set_measure(root, &f);
+
+		size = sizeof(struct mosquitto_filter_set)
+				+ f.node_count*sizeof(struct _mosquitto_filter_node)
+				+ f.child_count*sizeof(unsigned int)
+				+ filter_count*sizeof(int)
+				+ f.level_count;
+		set = _mosquitto_calloc(1, size);
+		if(set){
+			set->filter_count = filter_count;
+			set->nodes = (struct _mosquitto_filter_node *)&set[1];
+			set->children = (unsigned int *)&set->nodes[f.node_count];
+			set->indices = (int *)&set->children[f.child_count];
+			set->levels = (char *)&set->indices[filter_count];
+			if(root){
+				memset(&f, 0, sizeof(f));
+				f.set = set;
+				_mosquitto_filter_set_flatten(root, &f);
+			}
+			*set_out = set;
+		}else{
+			rc = MOSQ_ERR_NOMEM;
+		}
+	}
+
+	if(root) _mosquitto_route_node_free(root);
+	return rc;
+}
+
+void mosquitto_filter_set_free(struct mosquitto_filter_set *set)
+{
+	if(set) _mosquitto_free(set);
+}
+
+static void _mosquitto_filter_set_mark(const struct mosquitto_filter_set *set, unsigned int first, unsigned int count, unsigned char *bitmap)
+{
+	unsigned int i;
+	int index;
+
+	for(i=first; i<first+count; i++){
+		index = set->indices[i];
+		bitmap[index/8] |= (unsigned char)(1 << (index%8));
+	}
+}
+
+/* The same walk as _mosquitto_route_match(), over the flattened trie. */
+static void _mosquitto_filter_set_walk(const struct mosquitto_filter_set *set, unsigned int idx, const char *pos, const char *end, unsigned char *bitmap)
+{
+	const struct _mosquitto_filter_node *node, *child;
+	const char *level;
+	size_t len;
+	unsigned int hash, mask, i, c;
+	bool dollar;
+
+	while(1){
+		node = &set->nodes[idx];
+		/* The root is never anyone's child, so idx is only 0 at the start. */
+		dollar = idx == 0 && pos && pos < end && *pos == '$';
+		if(!dollar){
+			_mosquitto_filter_set_mark(set, node->hashes, node->hash_count, bitmap);
+		}
+		if(!pos){
+			_mosquitto_filter_set_mark(set, node->ends, node->end_count, bitmap);
+			return;
+		}
+		len = _mosquitto_route_level(&pos, end, &level);
+		if(node->plus && !dollar){
+			_mosquitto_filter_set_walk(set, node->plus, pos, end, bitmap);
+		}
+		if(!node->child_slots) return;
+
+		hash = _mosquitto_route_hash(level, len);
+		mask = node->child_slots-1;
+		i = hash & mask;
+		while(1){
+			c = set->children[node->children+i];
+			if(!c) return;
+			child = &set->nodes[c];
+			if(child->hash == hash && child->len == len && !memcmp(&set->levels[child->level], level, len)){
+				break;
+			}
+			i = (i+1) & mask;
+		}
+		idx = c;
+	}
+}
+
+int mosquitto_filter_set_match(const struct mosquitto_filter_set *set, const char *topic, size_t topiclen, unsigned char *bitmap)
+{
+	if(!set || !topic || (set->filter_count > 0 && !bitmap)) return MOSQ_ERR_INVAL;
+
+	if(set->filter_count > 0){
+		memset(bitmap, 0, (set->filter_count+7)/8);
+		_mosquitto_filter_set_walk(set, 0, topic, topic+topiclen, bitmap);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
@@ -138,22 +138,33 @@ int _mosquitto_send_disconnect(struct mosquitto *mosq)
 	return _mosquitto_send_simple_command(mosq, DISCONNECT);
 }
 
-int _mosquitto_send_subscribe(struct mosquitto *mosq, int *mid, bool dup, const char *topic, uint8_t topic_qos)
+int _mosquitto_send_subscribe(struct mosquitto *mosq, int *mid, bool dup, int topic_count, char *const *topic, const int *topic_qos)
 {
-	/* FIXME - only deals with a single topic */
 	struct _mosquitto_packet *packet = NULL;
 	uint32_t packetlen;
 	uint16_t local_mid;
+	size_t tlen;
 	int rc;
+	int i;
 
 	assert(mosq);
+	assert(topic_count > 0);
 	assert(topic);
+	assert(topic_qos);
+
+	packetlen = 2;
+	for(i=0; i<topic_count; i++){
+		tlen = strlen(topic[i]);
+		if(tlen > 65535) return MOSQ_ERR_INVAL;
+		/* Stop well short of wrapping; _mosquitto_packet_alloc() rejects
+		 * anything over the protocol limit of 268,435,455 bytes. */
+		if(packetlen > 0x10000000) return MOSQ_ERR_PAYLOAD_SIZE;
+		packetlen += 2+tlen + 1;
+	}
 
 	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
 	if(!packet) return MOSQ_ERR_NOMEM;
 
-	packetlen = 2 + 2+strlen(topic) + 1;
-
 	packet->command = SUBSCRIBE | (dup<<3) | (1<<1);
 	packet->remaining_length = packetlen;
 	rc = _mosquitto_packet_alloc(packet);
@@ -168,37 +179,47 @@ int _mosquitto_send_subscribe(struct mosquitto *mosq, int *mid, bool dup, const
 	_mosquitto_write_uint16(packet, local_mid);
 
 	/* Payload */
-	_mosquitto_write_string(packet, topic, strlen(topic));
-	_mosquitto_write_byte(packet, topic_qos);
+	for(i=0; i<topic_count; i++){
+		_mosquitto_write_string(packet, topic[i], strlen(topic[i]));
+		_mosquitto_write_byte(packet, (uint8_t)topic_qos[i]);
 
 #ifdef WITH_BROKER
 # ifdef WITH_BRIDGE
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Bridge %s sending SUBSCRIBE (Mid: %d, Topic: %s, QoS: %d)", mosq->id, local_mid, topic, topic_qos);
+		_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Bridge %s sending SUBSCRIBE (Mid: %d, Topic: %s, QoS: %d)", mosq->id, local_mid, topic[i], topic_qos[i]);
 # endif
 #else
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s sending SUBSCRIBE (Mid: %d, Topic: %s, QoS: %d)", mosq->id, local_mid, topic, topic_qos);
+		_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s sending SUBSCRIBE (Mid: %d, Topic: %s, QoS: %d)", mosq->id, local_mid, topic[i], topic_qos[i]);
 #endif
+	}
 
 	return _mosquitto_packet_queue(mosq, packet);
 }
 
 
-int _mosquitto_send_unsubscribe(struct mosquitto *mosq, int *mid, bool dup, const char *topic)
+int _mosquitto_send_unsubscribe(struct mosquitto *mosq, int *mid, bool dup, int topic_count, char *const *topic)
 {
-	/* FIXME - only deals with a single topic */
 	struct _mosquitto_packet *packet = NULL;
 	uint32_t packetlen;
 	uint16_t local_mid;
+	size_t tlen;
 	int rc;
+	int i;
 
 	assert(mosq);
+	assert(topic_count > 0);
 	assert(topic);
 
+	packetlen = 2;
+	for(i=0; i<topic_count; i++){
+		tlen = strlen(topic[i]);
+		if(tlen > 65535) return MOSQ_ERR_INVAL;
+		if(packetlen > 0x10000000) return MOSQ_ERR_PAYLOAD_SIZE;
+		packetlen += 2+tlen;
+	}
+
 	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
 	if(!packet) return MOSQ_ERR_NOMEM;
 
-	packetlen = 2 + 2+strlen(topic);
-
 	packet->command = UNSUBSCRIBE | (dup<<3) | (1<<1);
 	packet->remaining_length = packetlen;
 	rc = _mosquitto_packet_alloc(packet);
@@ -213,15 +234,18 @@ int _mosquitto_send_unsubscribe(struct mosquitto *mosq, int *mid, bool dup, cons
 	_mosquitto_write_uint16(packet, local_mid);
 
 	/* Payload */
-	_mosquitto_write_string(packet, topic, strlen(topic));
+	for(i=0; i<topic_count; i++){
+		_mosquitto_write_string(packet, topic[i], strlen(topic[i]));
 
 #ifdef WITH_BROKER
 # ifdef WITH_BRIDGE
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Bridge %s sending UNSUBSCRIBE (Mid: %d, Topic: %s)", mosq->id, local_mid, topic);
+		_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Bridge %s sending UNSUBSCRIBE (Mid: %d, Topic: %s)", mosq->id, local_mid, topic[i]);
 # endif
 #else
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s sending UNSUBSCRIBE (Mid: %d, Topic: %s)", mosq->id, local_mid, topic);
+		_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s sending UNSUBSCRIBE (Mid: %d, Topic: %s)", mosq->id, local_mid, topic[i]);
 #endif
+	}
+
 	return _mosquitto_packet_queue(mosq, packet);
 }
 
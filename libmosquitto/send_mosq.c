@@ -59,7 +59,7 @@ int _mosquitto_send_pingreq(struct mosquitto *mosq)
 #endif
 	rc = _mosquitto_send_simple_command(mosq, PINGREQ);
 	if(rc == MOSQ_ERR_SUCCESS){
-		mosq->ping_t = mosquitto_time();
+		mosq->ping_t = mosquitto_time_ms();
 	}
 	return rc;
 }
@@ -254,12 +254,27 @@ int _mosquitto_send_simple_command(struct mosquitto *mosq, uint8_t command)
 int _mosquitto_send_real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup)
 {
 	struct _mosquitto_packet *packet = NULL;
-	int packetlen;
 	int rc;
 
 	assert(mosq);
 	assert(topic);
 
+	rc = _mosquitto_packet_publish_build(&packet, mid, topic, payloadlen, payload, qos, retain, dup);
+	if(rc) return rc;
+
+	return _mosquitto_packet_queue(mosq, packet);
+}
+
+/* Allocate and fill a PUBLISH packet without queuing it. */
+int _mosquitto_packet_publish_build(struct _mosquitto_packet **packet_out, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup)
+{
+	struct _mosquitto_packet *packet = NULL;
+	int packetlen;
+	int rc;
+
+	assert(packet_out);
+	assert(topic);
+
 	packetlen = 2+strlen(topic) + payloadlen;
 	if(qos > 0) packetlen += 2; /* For message id */
 	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
@@ -284,5 +299,6 @@ int _mosquitto_send_real_publish(struct mosquitto *mosq, uint16_t mid, const cha
 		_mosquitto_write_bytes(packet, payload, payloadlen);
 	}
 
-	return _mosquitto_packet_queue(mosq, packet);
+	*packet_out = packet;
+	return MOSQ_ERR_SUCCESS;
 }
@@ -29,11 +29,13 @@ POSSIBILITY OF SUCH DAMAGE.
 #ifndef _SEND_MOSQ_H_
 #define _SEND_MOSQ_H_
 
+#include "mosquitto_internal.h"
 #include "mosquitto.h"
 
 int _mosquitto_send_simple_command(struct mosquitto *mosq, uint8_t command);
 int _mosquitto_send_command_with_mid(struct mosquitto *mosq, uint8_t command, uint16_t mid, bool dup);
 int _mosquitto_send_real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup);
+int _mosquitto_packet_publish_build(struct _mosquitto_packet **packet_out, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup);
 
 int _mosquitto_send_connect(struct mosquitto *mosq, uint16_t keepalive, bool clean_session);
 int _mosquitto_send_disconnect(struct mosquitto *mosq);
@@ -44,7 +46,7 @@ int _mosquitto_send_pubcomp(struct mosquitto *mosq, uint16_t mid);
 int _mosquitto_send_publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup);
 int _mosquitto_send_pubrec(struct mosquitto *mosq, uint16_t mid);
 int _mosquitto_send_pubrel(struct mosquitto *mosq, uint16_t mid, bool dup);
-int _mosquitto_send_subscribe(struct mosquitto *mosq, int *mid, bool dup, const char *topic, uint8_t topic_qos);
-int _mosquitto_send_unsubscribe(struct mosquitto *mosq, int *mid, bool dup, const char *topic);
+int _mosquitto_send_subscribe(struct mosquitto *mosq, int *mid, bool dup, int topic_count, char *const *topic, const int *topic_qos);
+int _mosquitto_send_unsubscribe(struct mosquitto *mosq, int *mid, bool dup, int topic_count, char *const *topic);
 
 #endif
@@ -0,0 +1,208 @@
+/*
+Copyright (c) 2013 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <assert.h>
+#include <string.h>
+
+#include "mosquitto.h"
+#include "mosquitto_internal.h"
+#include "logging_mosq.h"
+#include "memory_mosq.h"
+#include "messages_mosq.h"
+#include "net_mosq.h"
+#include "send_mosq.h"
+#include "session_mosq.h"
+
+/* Pipelined session setup.
+ *
+ * With pipelining enabled the client remembers the subscriptions the
+ * application has asked for. When a connection is made it sends CONNECT,
+ * then straight away a single SUBSCRIBE for all of them and any messages
+ * that are still waiting to be delivered, without waiting for CONNACK. The
+ * session is usable one round trip sooner, which matters on high latency
+ * links.
+ *
+ * If the broker refuses the connection it discards everything that followed
+ * the CONNECT. The client drops whatever it had not yet written and keeps
+ * its messages and subscriptions to send again on the next connection. */
+
+int mosquitto_pipeline_set(struct mosquitto *mosq, bool pipeline)
+{
+	if(!mosq) return MOSQ_ERR_INVAL;
+
+	_mosquitto_mutex_lock(mosq, &mosq->message_mutex);
+	mosq->pipeline = pipeline;
+	if(!pipeline){
+		_mosquitto_session_cleanup(mosq);
+	}
+	_mosquitto_mutex_unlock(mosq, &mosq->message_mutex);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Remember a set of subscriptions for the next connection. A topic that is
+ * already known has its QoS updated. */
+int _mosquitto_session_sub_add(struct mosquitto *mosq, int sub_count, char *const *sub, const int *qos)
+{
+	struct _mosquitto_session_sub *s;
+	int rc = MOSQ_ERR_SUCCESS;
+	int i;
+
+	assert(mosq);
+
+	_mosquitto_mutex_lock(mosq, &mosq->message_mutex);
+	for(i=0; i<sub_count; i++){
+		for(s=mosq->session_subs; s; s=s->next){
+			if(!strcmp(s->topic, sub[i])) break;
+		}
+		if(!s){
+			s = _mosquitto_calloc(1, sizeof(struct _mosquitto_session_sub));
+			if(!s){
+				rc = MOSQ_ERR_NOMEM;
+				break;
+			}
+			s->topic = _mosquitto_strdup(sub[i]);
+			if(!s->topic){
+				_mosquitto_free(s);
+				rc = MOSQ_ERR_NOMEM;
+				break;
+			}
+			s->next = mosq->session_subs;
+			mosq->session_subs = s;
+			mosq->session_sub_count++;
+		}
+		s->qos = qos[i];
+	}
+	_mosquitto_mutex_unlock(mosq, &mosq->message_mutex);
+
+	return rc;
+}
+
+void _mosquitto_session_sub_remove(struct mosquitto *mosq, int sub_count, char *const *sub)
+{
+	struct _mosquitto_session_sub *s, *prev;
+	int i;
+
+	assert(mosq);
+
+	_mosquitto_mutex_lock(mosq, &mosq->message_mutex);
+	for(i=0; i<sub_count; i++){
+		prev = NULL;
+		for(s=mosq->session_subs; s; s=s->next){
+			if(!strcmp(s->topic, sub[i])){
+				if(prev){
+					prev->next = s->next;
+				}else{
+					mosq->session_subs = s->next;
+				}
+				mosq->session_sub_count--;
+				_mosquitto_free(s->topic);
+				_mosquitto_free(s);
+				break;
+			}
+			prev = s;
+		}
+	}
+	_mosquitto_mutex_unlock(mosq, &mosq->message_mutex);
+}
+
+/* Called once CONNECT has been queued. Queues the remembered subscriptions as
+ * one SUBSCRIBE and resends every message left over from the last
+ * connection, so that they go out in the same flight as the CONNECT. */
+int _mosquitto_session_resume(struct mosquitto *mosq)
+{
+	struct _mosquitto_session_sub *s;
+	char **topics = NULL;
+	int *qos = NULL;
+	int count = 0;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	assert(mosq);
+
+	_mosquitto_mutex_lock(mosq, &mosq->message_mutex);
+	if(mosq->session_sub_count > 0){
+		topics = _mosquitto_malloc(mosq->session_sub_count*sizeof(char *));
+		qos = _mosquitto_malloc(mosq->session_sub_count*sizeof(int));
+		if(topics && qos){
+			for(s=mosq->session_subs; s; s=s->next){
+				/* The list is kept newest first, subscribe oldest first. */
+				count++;
+				topics[mosq->session_sub_count-count] = s->topic;
+				qos[mosq->session_sub_count-count] = s->qos;
+			}
+			rc = _mosquitto_send_subscribe(mosq, NULL, false, count, topics, qos);
+		}else{
+			rc = MOSQ_ERR_NOMEM;
+		}
+		_mosquitto_free(topics);
+		_mosquitto_free(qos);
+	}
+	_mosquitto_mutex_unlock(mosq, &mosq->message_mutex);
+	if(rc) return rc;
+
+	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s pipelined %d subscription(s) after CONNECT", mosq->id, count);
+
+	/* _mosquitto_messages_reconnect_reset() has zeroed every timestamp, so
+	 * this resends everything that is in flight. */
+	_mosquitto_message_retry_check(mosq);
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* The broker refused the connection and will have ignored everything sent
+ * after CONNECT. Drop anything still waiting to be written rather than send
+ * it into a connection that is about to close. The message list and the
+ * remembered subscriptions are untouched and are sent again by the next
+ * _mosquitto_session_resume(). */
+void _mosquitto_session_refused(struct mosquitto *mosq)
+{
+	assert(mosq);
+
+	_mosquitto_mutex_lock(mosq, &mosq->current_out_packet_mutex);
+	_mosquitto_packet_queue_clear(mosq);
+	_mosquitto_mutex_unlock(mosq, &mosq->current_out_packet_mutex);
+}
+
+/* Forget the tracked subscriptions. The caller must hold message_mutex, or
+ * be destroying the client. */
+void _mosquitto_session_cleanup(struct mosquitto *mosq)
+{
+	struct _mosquitto_session_sub *s, *next;
+
+	assert(mosq);
+
+	s = mosq->session_subs;
+	while(s){
+		next = s->next;
+		_mosquitto_free(s->topic);
+		_mosquitto_free(s);
+		s = next;
+	}
+	mosq->session_subs = NULL;
+	mosq->session_sub_count = 0;
+}
@@ -34,15 +34,23 @@ POSSIBILITY OF SUCH DAMAGE.
 #endif
 
 #include "mosquitto_internal.h"
+#include "atomic_mosq.h"
+#include "net_mosq.h"
 
 void *_mosquitto_thread_main(void *obj);
 
 int mosquitto_loop_start(struct mosquitto *mosq)
 {
 #ifdef WITH_THREADING
-	if(!mosq) return MOSQ_ERR_INVAL;
+	if(!mosq || mosq->single_threaded) return MOSQ_ERR_INVAL;
 
-	pthread_create(&mosq->thread_id, NULL, _mosquitto_thread_main, mosq);
+	/* Set before the thread exists so that packets queued from now on are
+	 * left for the network thread. */
+	mosq->threaded = true;
+	if(pthread_create(&mosq->thread_id, NULL, _mosquitto_thread_main, mosq)){
+		mosq->threaded = false;
+		return MOSQ_ERR_ERRNO;
+	}
 	return MOSQ_ERR_SUCCESS;
 #else
 	return MOSQ_ERR_NOT_SUPPORTED;
@@ -55,10 +63,16 @@ int mosquitto_loop_stop(struct mosquitto *mosq, bool force)
 	if(!mosq) return MOSQ_ERR_INVAL;
 	
 	if(force){
-		pthread_cancel(mosq->thread_id);
+		MOSQ_ATOMIC_STORE_INT(&mosq->loop_stop_requested, 1);
 	}
+	/* Break the thread out of select() so it sees the request, or the
+	 * disconnect, straight away. */
+	_mosquitto_loop_wakeup(mosq);
 	pthread_join(mosq->thread_id, NULL);
 	mosq->thread_id = pthread_self();
+	mosq->threaded = false;
+
+	MOSQ_ATOMIC_STORE_INT(&mosq->loop_stop_requested, 0);
 
 	return MOSQ_ERR_SUCCESS;
 #else
@@ -73,18 +87,10 @@ void *_mosquitto_thread_main(void *obj)
 
 	if(!mosq) return NULL;
 
-	mosq->threaded = true;
-	pthread_mutex_lock(&mosq->state_mutex);
-	if(mosq->state == mosq_cs_connect_async){
-		pthread_mutex_unlock(&mosq->state_mutex);
-		mosquitto_reconnect(mosq);
-	}else{
-		pthread_mutex_unlock(&mosq->state_mutex);
-	}
-
+	/* If mosquitto_connect_async() failed to start the connection,
+	 * mosquitto_loop_forever() will retry it. */
 	mosquitto_loop_forever(mosq, -1, 1);
 
-	mosq->threaded = false;
 	return obj;
 }
 #endif
@@ -62,34 +62,38 @@ void _windows_time_version_check(void)
 }
 #endif
 
-time_t mosquitto_time(void)
+int64_t mosquitto_time_ms(void)
 {
 #ifdef WIN32
 	if(tick64){
-		return GetTickCount64()/1000;
+		return (int64_t)GetTickCount64();
 	}else{
-		return GetTickCount()/1000; /* FIXME - need to deal with overflow. */
+		return (int64_t)GetTickCount(); /* FIXME - need to deal with overflow. */
 	}
 #elif _POSIX_TIMERS>0 && defined(_POSIX_MONOTONIC_CLOCK)
 	struct timespec tp;
 
 	clock_gettime(CLOCK_MONOTONIC, &tp);
-	return tp.tv_sec;
+	return (int64_t)tp.tv_sec*1000 + tp.tv_nsec/1000000;
 #elif defined(__APPLE__)
 	static mach_timebase_info_data_t tb;
-    uint64_t ticks;
-	uint64_t sec;
+	uint64_t ticks;
 
 	ticks = mach_absolute_time();
 
 	if(tb.denom == 0){
 		mach_timebase_info(&tb);
 	}
-	sec = (ticks/1000000000)*(tb.numer/tb.denom);
-
-	return (time_t)sec;
+	/* The timebase ratio is not always an integer (125/3 on ARM), so it must
+	 * be applied before dividing down to milliseconds. */
+	return (int64_t)(ticks*tb.numer/tb.denom/1000000);
 #else
-	return time(NULL);
+	return (int64_t)time(NULL)*1000;
 #endif
 }
 
+time_t mosquitto_time(void)
+{
+	return (time_t)(mosquitto_time_ms()/1000);
+}
+
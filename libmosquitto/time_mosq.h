@@ -30,6 +30,10 @@ POSSIBILITY OF SUCH DAMAGE.
 #ifndef _TIME_MOSQ_H_
 #define _TIME_MOSQ_H_
 
+#include "mosquitto_internal.h"
+
 time_t mosquitto_time(void);
+/* Monotonic time in milliseconds, with an arbitrary origin. */
+int64_t mosquitto_time_ms(void);
 
 #endif
@@ -36,6 +36,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #  include <arpa/inet.h>
 #endif
 
+#include <assert.h>
 #include <string.h>
 #include <openssl/conf.h>
 #include <openssl/x509v3.h>
@@ -45,7 +46,12 @@ POSSIBILITY OF SUCH DAMAGE.
 #  include "mosquitto_broker.h"
 #endif
 #include "mosquitto_internal.h"
+#include "atomic_mosq.h"
+#include "logging_mosq.h"
+#include "memory_mosq.h"
+#include "time_mosq.h"
 #include "tls_mosq.h"
+#include "util_mosq.h"
 
 extern int tls_ex_index_mosq;
 
@@ -82,6 +88,406 @@ int _mosquitto_server_certificate_verify(int preverify_ok, X509_STORE_CTX *ctx)
 	}
 }
 
+#ifdef REAL_WITH_TLS_PSK
+static unsigned int psk_client_callback(SSL *ssl, const char *hint,
+		char *identity, unsigned int max_identity_len,
+		unsigned char *psk, unsigned int max_psk_len)
+{
+	struct mosquitto *mosq;
+	int len;
+
+	mosq = SSL_get_ex_data(ssl, tls_ex_index_mosq);
+	if(!mosq) return 0;
+
+	snprintf(identity, max_identity_len, "%s", mosq->tls_psk_identity);
+
+	len = _mosquitto_hex2bin(mosq->tls_psk, psk, max_psk_len);
+	if (len < 0) return 0;
+	return len;
+}
+#endif
+
+/* Process wide cache of client TLS contexts. Loading CA certificates, the
+ * certificate chain and the private key is expensive, so clients with the
+ * same TLS configuration share one SSL_CTX. Each client holds a reference
+ * from its first TLS connection until its TLS options change or it is
+ * destroyed, so reconnecting doesn't rebuild the context either. Per
+ * connection state such as the hostname to verify and the PSK is looked up
+ * through the SSL ex data, so doesn't belong in the key. */
+struct _mosquitto_ssl_ctx_cache{
+	struct _mosquitto_ssl_ctx_cache *next;
+	SSL_CTX *ctx;
+	int refcount;
+	char *tls_version;
+	char *tls_ciphers;
+	char *tls_cafile;
+	char *tls_capath;
+	char *tls_certfile;
+	char *tls_keyfile;
+	int (*tls_pw_callback)(char *buf, int size, int rwflag, void *userdata);
+	int tls_cert_reqs;
+	bool tls_psk;
+};
+
+static struct _mosquitto_ssl_ctx_cache *ssl_ctx_cache = NULL;
+#if defined(WITH_THREADING) && !defined(WITH_BROKER)
+static pthread_mutex_t ssl_ctx_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static bool _mosquitto_tls_str_eq(const char *a, const char *b)
+{
+	if(!a || !b) return a == b;
+	return !strcmp(a, b);
+}
+
+static void _mosquitto_ssl_ctx_cache_free(struct _mosquitto_ssl_ctx_cache *entry)
+{
+	if(entry->ctx) SSL_CTX_free(entry->ctx);
+	if(entry->tls_version) _mosquitto_free(entry->tls_version);
+	if(entry->tls_ciphers) _mosquitto_free(entry->tls_ciphers);
+	if(entry->tls_cafile) _mosquitto_free(entry->tls_cafile);
+	if(entry->tls_capath) _mosquitto_free(entry->tls_capath);
+	if(entry->tls_certfile) _mosquitto_free(entry->tls_certfile);
+	if(entry->tls_keyfile) _mosquitto_free(entry->tls_keyfile);
+	_mosquitto_free(entry);
+}
+
+static int _mosquitto_tls_strdup(char **dest, const char *src)
+{
+	if(src){
+		*dest = _mosquitto_strdup(src);
+		if(!*dest) return MOSQ_ERR_NOMEM;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Called by OpenSSL when the broker issues a session, either during the
+ * handshake or, with TLS 1.3, in a ticket after it. Keep the newest one for
+ * the next connect. Returning 1 tells OpenSSL that we hold the reference. */
+static int _mosquitto_tls_session_new(SSL *ssl, SSL_SESSION *session)
+{
+	struct mosquitto *mosq;
+
+	mosq = SSL_get_ex_data(ssl, tls_ex_index_mosq);
+	if(!mosq) return 0;
+
+	if(mosq->tls_session){
+		SSL_SESSION_free(mosq->tls_session);
+	}
+	mosq->tls_session = session;
+	return 1;
+}
+
+/* Build a new context from the TLS options of mosq. */
+static int _mosquitto_ssl_ctx_build(struct mosquitto *mosq, SSL_CTX **ctx_out)
+{
+	SSL_CTX *ctx;
+	int ret;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10001000L
+	if(!mosq->tls_version || !strcmp(mosq->tls_version, "tlsv1.2")){
+		ctx = SSL_CTX_new(TLSv1_2_client_method());
+	}else if(!strcmp(mosq->tls_version, "tlsv1.1")){
+		ctx = SSL_CTX_new(TLSv1_1_client_method());
+	}else if(!strcmp(mosq->tls_version, "tlsv1")){
+		ctx = SSL_CTX_new(TLSv1_client_method());
+	}else{
+		_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Protocol %s not supported.", mosq->tls_version);
+		return MOSQ_ERR_INVAL;
+	}
+#else
+	if(!mosq->tls_version || !strcmp(mosq->tls_version, "tlsv1")){
+		ctx = SSL_CTX_new(TLSv1_client_method());
+	}else{
+		_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Protocol %s not supported.", mosq->tls_version);
+		return MOSQ_ERR_INVAL;
+	}
+#endif
+	if(!ctx){
+		_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to create TLS context.");
+		return MOSQ_ERR_TLS;
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10000000
+	/* Disable compression */
+	SSL_CTX_set_options(ctx, SSL_OP_NO_COMPRESSION);
+#endif
+#ifdef SSL_MODE_RELEASE_BUFFERS
+	/* Use even less memory per SSL connection. */
+	SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+#endif
+	/* A write that has to be retried may be retried from the staging buffer,
+	 * with more data behind it. See _mosquitto_packet_write_tls(). */
+	SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	if(mosq->tls_ciphers){
+		ret = SSL_CTX_set_cipher_list(ctx, mosq->tls_ciphers);
+		if(ret == 0){
+			_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to set TLS ciphers. Check cipher list \"%s\".", mosq->tls_ciphers);
+			SSL_CTX_free(ctx);
+			return MOSQ_ERR_TLS;
+		}
+	}
+	if(mosq->tls_cafile || mosq->tls_capath){
+		ret = SSL_CTX_load_verify_locations(ctx, mosq->tls_cafile, mosq->tls_capath);
+		if(ret == 0){
+#ifdef WITH_BROKER
+			if(mosq->tls_cafile && mosq->tls_capath){
+				_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check bridge_cafile \"%s\" and bridge_capath \"%s\".", mosq->tls_cafile, mosq->tls_capath);
+			}else if(mosq->tls_cafile){
+				_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check bridge_cafile \"%s\".", mosq->tls_cafile);
+			}else{
+				_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check bridge_capath \"%s\".", mosq->tls_capath);
+			}
+#else
+			if(mosq->tls_cafile && mosq->tls_capath){
+				_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check cafile \"%s\" and capath \"%s\".", mosq->tls_cafile, mosq->tls_capath);
+			}else if(mosq->tls_cafile){
+				_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check cafile \"%s\".", mosq->tls_cafile);
+			}else{
+				_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check capath \"%s\".", mosq->tls_capath);
+			}
+#endif
+			SSL_CTX_free(ctx);
+			return MOSQ_ERR_TLS;
+		}
+		if(mosq->tls_cert_reqs == 0){
+			SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+		}else{
+			SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, _mosquitto_server_certificate_verify);
+		}
+
+		if(mosq->tls_pw_callback){
+			SSL_CTX_set_default_passwd_cb(ctx, mosq->tls_pw_callback);
+			SSL_CTX_set_default_passwd_cb_userdata(ctx, mosq);
+		}
+
+		if(mosq->tls_certfile){
+			ret = SSL_CTX_use_certificate_chain_file(ctx, mosq->tls_certfile);
+			if(ret != 1){
+#ifdef WITH_BROKER
+				_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load client certificate, check bridge_certfile \"%s\".", mosq->tls_certfile);
+#else
+				_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load client certificate \"%s\".", mosq->tls_certfile);
+#endif
+				SSL_CTX_free(ctx);
+				return MOSQ_ERR_TLS;
+			}
+		}
+		if(mosq->tls_keyfile){
+			ret = SSL_CTX_use_PrivateKey_file(ctx, mosq->tls_keyfile, SSL_FILETYPE_PEM);
+			if(ret != 1){
+#ifdef WITH_BROKER
+				_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load client key file, check bridge_keyfile \"%s\".", mosq->tls_keyfile);
+#else
+				_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load client key file \"%s\".", mosq->tls_keyfile);
+#endif
+				SSL_CTX_free(ctx);
+				return MOSQ_ERR_TLS;
+			}
+			ret = SSL_CTX_check_private_key(ctx);
+			if(ret != 1){
+				_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Client certificate/key are inconsistent.");
+				SSL_CTX_free(ctx);
+				return MOSQ_ERR_TLS;
+			}
+		}
+#ifdef REAL_WITH_TLS_PSK
+	}else if(mosq->tls_psk){
+		SSL_CTX_set_psk_client_callback(ctx, psk_client_callback);
+#endif
+	}
+
+	/* Sessions are kept per client rather than in the shared context, so
+	 * that a client only ever offers a session from its own broker. */
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, _mosquitto_tls_session_new);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	/* Brokers commonly close the connection after DISCONNECT without a TLS
+	 * close_notify. OpenSSL 3 treats that as an error and marks the session
+	 * as not resumable. MQTT packets carry their own lengths, so a truncated
+	 * stream is detected anyway. */
+	SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+	/* The password callback is only needed while the key is loaded above.
+	 * Don't leave the context pointing at this client once it is shared. */
+	SSL_CTX_set_default_passwd_cb_userdata(ctx, NULL);
+
+	*ctx_out = ctx;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Set mosq->ssl_ctx to a context matching its TLS options, building one if
+ * no other client has the same configuration. */
+int _mosquitto_ssl_ctx_get(struct mosquitto *mosq)
+{
+	struct _mosquitto_ssl_ctx_cache *entry;
+	bool psk;
+	int rc;
+
+	assert(mosq);
+	assert(!mosq->ssl_ctx);
+
+	psk = !mosq->tls_cafile && !mosq->tls_capath && mosq->tls_psk;
+
+	pthread_mutex_lock(&ssl_ctx_cache_mutex);
+	for(entry=ssl_ctx_cache; entry; entry=entry->next){
+		if(entry->tls_cert_reqs == mosq->tls_cert_reqs
+				&& entry->tls_pw_callback == mosq->tls_pw_callback
+				&& entry->tls_psk == psk
+				&& _mosquitto_tls_str_eq(entry->tls_version, mosq->tls_version)
+				&& _mosquitto_tls_str_eq(entry->tls_ciphers, mosq->tls_ciphers)
+				&& _mosquitto_tls_str_eq(entry->tls_cafile, mosq->tls_cafile)
+				&& _mosquitto_tls_str_eq(entry->tls_capath, mosq->tls_capath)
+				&& _mosquitto_tls_str_eq(entry->tls_certfile, mosq->tls_certfile)
+				&& _mosquitto_tls_str_eq(entry->tls_keyfile, mosq->tls_keyfile)){
+
+			entry->refcount++;
+			mosq->ssl_ctx = entry->ctx;
+			pthread_mutex_unlock(&ssl_ctx_cache_mutex);
+			return MOSQ_ERR_SUCCESS;
+		}
+	}
+
+	/* Build while holding the lock, so that a reconnect storm builds each
+	 * context once rather than once per client. */
+	entry = _mosquitto_calloc(1, sizeof(struct _mosquitto_ssl_ctx_cache));
+	if(!entry){
+		pthread_mutex_unlock(&ssl_ctx_cache_mutex);
+		return MOSQ_ERR_NOMEM;
+	}
+	entry->tls_cert_reqs = mosq->tls_cert_reqs;
+	entry->tls_pw_callback = mosq->tls_pw_callback;
+	entry->tls_psk = psk;
+	if(_mosquitto_tls_strdup(&entry->tls_version, mosq->tls_version)
+			|| _mosquitto_tls_strdup(&entry->tls_ciphers, mosq->tls_ciphers)
+			|| _mosquitto_tls_strdup(&entry->tls_cafile, mosq->tls_cafile)
+			|| _mosquitto_tls_strdup(&entry->tls_capath, mosq->tls_capath)
+			|| _mosquitto_tls_strdup(&entry->tls_certfile, mosq->tls_certfile)
+			|| _mosquitto_tls_strdup(&entry->tls_keyfile, mosq->tls_keyfile)){
+
+		_mosquitto_ssl_ctx_cache_free(entry);
+		pthread_mutex_unlock(&ssl_ctx_cache_mutex);
+		return MOSQ_ERR_NOMEM;
+	}
+
+	rc = _mosquitto_ssl_ctx_build(mosq, &entry->ctx);
+	if(rc){
+		_mosquitto_ssl_ctx_cache_free(entry);
+		pthread_mutex_unlock(&ssl_ctx_cache_mutex);
+		return rc;
+	}
+	entry->refcount = 1;
+	entry->next = ssl_ctx_cache;
+	ssl_ctx_cache = entry;
+	mosq->ssl_ctx = entry->ctx;
+	pthread_mutex_unlock(&ssl_ctx_cache_mutex);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Drop the reference mosq holds on its context, freeing the context if no
+ * other client is using it. A connection already using the context keeps it
+ * alive through OpenSSL's own reference. */
+void _mosquitto_ssl_ctx_release(struct mosquitto *mosq)
+{
+	struct _mosquitto_ssl_ctx_cache *entry, *prev = NULL;
+
+	assert(mosq);
+
+	_mosquitto_tls_session_clear(mosq);
+	if(!mosq->ssl_ctx) return;
+
+	pthread_mutex_lock(&ssl_ctx_cache_mutex);
+	for(entry=ssl_ctx_cache; entry; entry=entry->next){
+		if(entry->ctx == mosq->ssl_ctx){
+			entry->refcount--;
+			if(entry->refcount == 0){
+				if(prev){
+					prev->next = entry->next;
+				}else{
+					ssl_ctx_cache = entry->next;
+				}
+				_mosquitto_ssl_ctx_cache_free(entry);
+			}
+			break;
+		}
+		prev = entry;
+	}
+	pthread_mutex_unlock(&ssl_ctx_cache_mutex);
+
+	mosq->ssl_ctx = NULL;
+}
+
+/* Called just before SSL_connect(). Offers the session from the last
+ * connection, if there is one, and starts timing the handshake. */
+void _mosquitto_tls_handshake_start(struct mosquitto *mosq)
+{
+	assert(mosq);
+	assert(mosq->ssl);
+
+	if(mosq->tls_session){
+		SSL_set_session(mosq->ssl, mosq->tls_session);
+	}
+#ifdef REAL_WITH_TLS_KTLS
+	if(mosq->tls_ktls){
+		SSL_set_options(mosq->ssl, SSL_OP_ENABLE_KTLS);
+	}
+#endif
+	mosq->tls_ktls_send = false;
+	mosq->tls_ktls_recv = false;
+	mosq->tls_handshake_start = mosquitto_time_ms();
+	mosq->tls_handshake_done = false;
+}
+
+/* Called by _mosquitto_tls_handshake() once SSL_connect() has succeeded. */
+void _mosquitto_tls_handshake_check(struct mosquitto *mosq)
+{
+	int64_t elapsed;
+	bool resumed;
+
+	assert(mosq);
+
+	if(mosq->tls_handshake_done || !mosq->ssl || !SSL_is_init_finished(mosq->ssl)){
+		return;
+	}
+	mosq->tls_handshake_done = true;
+
+	elapsed = mosquitto_time_ms() - mosq->tls_handshake_start;
+	resumed = SSL_session_reused(mosq->ssl) != 0;
+	MOSQ_ATOMIC_ADD_INT(&mosq->tls_handshakes, 1);
+	if(resumed){
+		MOSQ_ATOMIC_ADD_INT(&mosq->tls_resumed, 1);
+	}
+	MOSQ_ATOMIC_STORE_I64(&mosq->tls_handshake_ms_last, elapsed);
+	MOSQ_ATOMIC_STORE_I64(&mosq->tls_handshake_ms_total, MOSQ_ATOMIC_LOAD_I64(&mosq->tls_handshake_ms_total) + elapsed);
+
+	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s TLS handshake %s in %ld ms", mosq->id, resumed?"resumed":"completed", (long)elapsed);
+
+#ifdef REAL_WITH_TLS_KTLS
+	/* OpenSSL hands the keys to the kernel as they are installed, and
+	 * quietly stays in user space if the kernel or the negotiated cipher
+	 * can't do it. */
+	if(mosq->tls_ktls){
+		mosq->tls_ktls_send = BIO_get_ktls_send(SSL_get_wbio(mosq->ssl)) != 0;
+		mosq->tls_ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(mosq->ssl)) != 0;
+		_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s kernel TLS send %s, receive %s", mosq->id,
+				mosq->tls_ktls_send?"on":"off", mosq->tls_ktls_recv?"on":"off");
+	}
+#endif
+}
+
+void _mosquitto_tls_session_clear(struct mosquitto *mosq)
+{
+	assert(mosq);
+
+	if(mosq->tls_session){
+		SSL_SESSION_free(mosq->tls_session);
+		mosq->tls_session = NULL;
+	}
+}
+
 /* This code is based heavily on the example provided in "Secure Programming
  * Cookbook for C and C++".
  */
@@ -33,6 +33,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #ifdef WITH_TLS
 
 #include <openssl/ssl.h>
+#include "mosquitto_internal.h"
+
 #ifdef WITH_TLS_PSK
 #  if OPENSSL_VERSION_NUMBER >= 0x10000000
 #    define REAL_WITH_TLS_PSK
@@ -41,8 +43,19 @@ POSSIBILITY OF SUCH DAMAGE.
 #  endif
 #endif
 
+/* Kernel TLS needs OpenSSL 3.0 built with enable-ktls, and a kernel with the
+ * tls module. Only the first of these can be checked here. */
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#  define REAL_WITH_TLS_KTLS
+#endif
+
 int _mosquitto_server_certificate_verify(int preverify_ok, X509_STORE_CTX *ctx);
 int _mosquitto_verify_certificate_hostname(X509 *cert, const char *hostname);
+int _mosquitto_ssl_ctx_get(struct mosquitto *mosq);
+void _mosquitto_ssl_ctx_release(struct mosquitto *mosq);
+void _mosquitto_tls_handshake_start(struct mosquitto *mosq);
+void _mosquitto_tls_handshake_check(struct mosquitto *mosq);
+void _mosquitto_tls_session_clear(struct mosquitto *mosq);
 
 #endif /* WITH_TLS */
 
@@ -34,8 +34,22 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <winsock2.h>
 #endif
 
+/* Topic checking looks at a block of bytes at once where the instruction
+ * set allows it. SSE2 is always there on x86-64 and NEON on arm64, so no
+ * run time detection is needed. */
+#if defined(__AVX2__)
+#  include <immintrin.h>
+#  define MOSQ_TOPIC_BLOCK 32
+#elif defined(__SSE2__)
+#  include <emmintrin.h>
+#  define MOSQ_TOPIC_BLOCK 16
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#  include <arm_neon.h>
+#  define MOSQ_TOPIC_BLOCK 16
+#endif
 
 #include "mosquitto.h"
+#include "atomic_mosq.h"
 #include "memory_mosq.h"
 #include "net_mosq.h"
 #include "send_mosq.h"
@@ -82,11 +96,106 @@ int _mosquitto_packet_alloc(struct _mosquitto_packet *packet)
 	return MOSQ_ERR_SUCCESS;
 }
 
+#ifndef WITH_BROKER
+/* True once the client should give up on connecting, because
+ * mosquitto_disconnect() or mosquitto_loop_stop() has been called. */
+bool _mosquitto_loop_finished(struct mosquitto *mosq)
+{
+	return MOSQ_ATOMIC_LOAD_INT(&mosq->state) == mosq_cs_disconnecting
+			|| MOSQ_ATOMIC_LOAD_INT(&mosq->loop_stop_requested);
+}
+
+/* The time, from mosquitto_time_ms(), at which mosquitto_loop_misc() next has
+ * work to do: a PINGREQ to send, a PINGRESP that is overdue, a message to
+ * retry or expire or a connection attempt to start. Returns -1 if there is
+ * no connection. */
+int64_t _mosquitto_loop_deadline(struct mosquitto *mosq)
+{
+	int64_t keepalive_ms = (int64_t)mosq->keepalive*1000;
+	int64_t last_msg_out;
+	int64_t last_msg_in;
+	int64_t next_retry_check;
+	int64_t race_deadline;
+	int64_t deadline;
+
+	if(mosq->sock == INVALID_SOCKET) return -1;
+
+	last_msg_out = MOSQ_ATOMIC_LOAD_I64(&mosq->last_msg_out);
+	last_msg_in = MOSQ_ATOMIC_LOAD_I64(&mosq->last_msg_in);
+	deadline = (last_msg_out < last_msg_in ? last_msg_out : last_msg_in) + keepalive_ms;
+	if(mosq->ping_t && mosq->ping_t + keepalive_ms < deadline){
+		deadline = mosq->ping_t + keepalive_ms;
+	}
+	next_retry_check = MOSQ_ATOMIC_LOAD_I64(&mosq->next_retry_check);
+	if(next_retry_check >= 0 && next_retry_check < deadline){
+		deadline = next_retry_check;
+	}
+	race_deadline = _mosquitto_connect_race_deadline(mosq);
+	if(race_deadline >= 0 && race_deadline < deadline){
+		deadline = race_deadline;
+	}
+	return deadline;
+}
+
+/* The number of client callbacks that the calling thread is inside. While it
+ * is non-zero, packets the thread queues are left to the network loop rather
+ * than written straight away, as the callback may have been called from
+ * _mosquitto_packet_write() itself. It is kept per thread so that a slow
+ * callback does not stop other threads from writing. */
+#ifdef WITH_THREADING
+#  ifdef WIN32
+static __declspec(thread) int callback_depth = 0;
+#  else
+static __thread int callback_depth = 0;
+#  endif
+#else
+static int callback_depth = 0;
+#endif
+
+void _mosquitto_callback_enter(void)
+{
+	callback_depth++;
+}
+
+void _mosquitto_callback_leave(void)
+{
+	callback_depth--;
+}
+
+bool _mosquitto_callback_active(void)
+{
+	return callback_depth > 0;
+}
+#endif
+
+#if defined(WITH_THREADING) && !defined(WITH_BROKER) && !defined(NDEBUG)
+/* Stand in for the per-client mutexes of a MOSQ_NEW_SINGLE_THREADED client.
+ * Nested locking from one thread is fine, and the client may move to another
+ * thread between calls, but a second thread arriving while the first still
+ * holds a "lock" means the application is using the client concurrently. */
+void _mosquitto_single_thread_enter(struct mosquitto *mosq)
+{
+	if(mosq->single_thread_depth == 0){
+		mosq->single_thread_owner = pthread_self();
+	}else{
+		assert(pthread_equal(mosq->single_thread_owner, pthread_self()));
+	}
+	mosq->single_thread_depth++;
+}
+
+void _mosquitto_single_thread_leave(struct mosquitto *mosq)
+{
+	assert(mosq->single_thread_depth > 0);
+	mosq->single_thread_depth--;
+}
+#endif
+
 void _mosquitto_check_keepalive(struct mosquitto *mosq)
 {
-	time_t last_msg_out;
-	time_t last_msg_in;
-	time_t now = mosquitto_time();
+	int64_t last_msg_out;
+	int64_t last_msg_in;
+	int64_t keepalive_ms = (int64_t)mosq->keepalive*1000;
+	int64_t now = mosquitto_time_ms();
 #ifndef WITH_BROKER
 	int rc;
 #endif
@@ -96,27 +205,23 @@ void _mosquitto_check_keepalive(struct mosquitto *mosq)
 	/* Check if a lazy bridge should be timed out due to idle. */
 	if(mosq->bridge && mosq->bridge->start_type == bst_lazy
 				&& mosq->sock != INVALID_SOCKET
-				&& now - mosq->last_msg_out >= mosq->bridge->idle_timeout){
+				&& now - mosq->last_msg_out >= (int64_t)mosq->bridge->idle_timeout*1000){
 
 		_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Bridge connection %s has exceeded idle timeout, disconnecting.", mosq->id);
 		_mosquitto_socket_close(mosq);
 		return;
 	}
 #endif
-	pthread_mutex_lock(&mosq->msgtime_mutex);
-	last_msg_out = mosq->last_msg_out;
-	last_msg_in = mosq->last_msg_in;
-	pthread_mutex_unlock(&mosq->msgtime_mutex);
+	last_msg_out = MOSQ_ATOMIC_LOAD_I64(&mosq->last_msg_out);
+	last_msg_in = MOSQ_ATOMIC_LOAD_I64(&mosq->last_msg_in);
 	if(mosq->sock != INVALID_SOCKET &&
-			(now - last_msg_out >= mosq->keepalive || now - last_msg_in >= mosq->keepalive)){
+			(now - last_msg_out >= keepalive_ms || now - last_msg_in >= keepalive_ms)){
 
-		if(mosq->state == mosq_cs_connected && mosq->ping_t == 0){
+		if(MOSQ_ATOMIC_LOAD_INT(&mosq->state) == mosq_cs_connected && mosq->ping_t == 0){
 			_mosquitto_send_pingreq(mosq);
 			/* Reset last msg times to give the server time to send a pingresp */
-			pthread_mutex_lock(&mosq->msgtime_mutex);
-			mosq->last_msg_in = now;
-			mosq->last_msg_out = now;
-			pthread_mutex_unlock(&mosq->msgtime_mutex);
+			MOSQ_ATOMIC_STORE_I64(&mosq->last_msg_in, now);
+			MOSQ_ATOMIC_STORE_I64(&mosq->last_msg_out, now);
 		}else{
 #ifdef WITH_BROKER
 			if(mosq->listener){
@@ -127,20 +232,18 @@ void _mosquitto_check_keepalive(struct mosquitto *mosq)
 #endif
 			_mosquitto_socket_close(mosq);
 #ifndef WITH_BROKER
-			pthread_mutex_lock(&mosq->state_mutex);
-			if(mosq->state == mosq_cs_disconnecting){
+			if(MOSQ_ATOMIC_LOAD_INT(&mosq->state) == mosq_cs_disconnecting){
 				rc = MOSQ_ERR_SUCCESS;
 			}else{
 				rc = 1;
 			}
-			pthread_mutex_unlock(&mosq->state_mutex);
-			pthread_mutex_lock(&mosq->callback_mutex);
+			_mosquitto_mutex_lock(mosq, &mosq->callback_mutex);
 			if(mosq->on_disconnect){
-				mosq->in_callback = true;
+				_mosquitto_callback_enter();
 				mosq->on_disconnect(mosq, mosq->userdata, rc);
-				mosq->in_callback = false;
+				_mosquitto_callback_leave();
 			}
-			pthread_mutex_unlock(&mosq->callback_mutex);
+			_mosquitto_mutex_unlock(mosq, &mosq->callback_mutex);
 #endif
 		}
 	}
@@ -182,119 +285,233 @@ int _mosquitto_fix_sub_topic(char **subtopic)
 
 uint16_t _mosquitto_mid_generate(struct mosquitto *mosq)
 {
+	uint16_t last_mid;
+	uint16_t mid;
+
 	assert(mosq);
 
-	mosq->last_mid++;
-	if(mosq->last_mid == 0) mosq->last_mid++;
-	
-	return mosq->last_mid;
+	/* Several threads may be publishing through the same client. */
+	do{
+		last_mid = mosq->last_mid;
+		mid = last_mid + 1;
+		if(mid == 0) mid++;
+	}while(!MOSQ_ATOMIC_CAS_U16(&mosq->last_mid, last_mid, mid));
+
+	return mid;
 }
 
-/* Search for + or # in a topic. Return MOSQ_ERR_INVAL if found.
- * Also returns MOSQ_ERR_INVAL if the topic string is too long.
- * Returns MOSQ_ERR_SUCCESS if everything is fine.
- */
-int _mosquitto_topic_wildcard_len_check(const char *str)
+/* Check one character of a topic. It must not be NUL, and must be well
+ * formed UTF-8, which rules out overlong forms, surrogates and anything
+ * above U+10FFFF. "+" and "#" are only allowed if wildcards is set, and then
+ * only as a whole level, with "#" as the last level. Returns the start of
+ * the next character, or NULL if this one is not valid. */
+static const unsigned char *_mosquitto_topic_check_char(const unsigned char *start, const unsigned char *p, const unsigned char *end, bool wildcards)
 {
-	int len = 0;
-	while(str && str[0]){
-		if(str[0] == '+' || str[0] == '#'){
-			return MOSQ_ERR_INVAL;
+	unsigned char lo = 0x80, hi = 0xBF;
+	int n, i;
+
+	if(p[0] < 0x80){
+		if(p[0] == 0) return NULL;
+		if(p[0] == '+' || p[0] == '#'){
+			if(!wildcards) return NULL;
+			if(p > start && p[-1] != '/') return NULL;
+			if(p[0] == '+' && p+1 < end && p[1] != '/') return NULL;
+			if(p[0] == '#' && p+1 != end) return NULL;
 		}
-		len++;
-		str = &str[1];
+		return p+1;
+	}else if(p[0] >= 0xC2 && p[0] <= 0xDF){
+		n = 1;
+	}else if(p[0] >= 0xE0 && p[0] <= 0xEF){
+		n = 2;
+		if(p[0] == 0xE0) lo = 0xA0;
+		if(p[0] == 0xED) hi = 0x9F;
+	}else if(p[0] >= 0xF0 && p[0] <= 0xF4){
+		n = 3;
+		if(p[0] == 0xF0) lo = 0x90;
+		if(p[0] == 0xF4) hi = 0x8F;
+	}else{
+		return NULL;
 	}
-	if(len > 65535) return MOSQ_ERR_INVAL;
 
-	return MOSQ_ERR_SUCCESS;
+	if(end - p <= n) return NULL;
+	if(p[1] < lo || p[1] > hi) return NULL;
+	for(i=2; i<=n; i++){
+		if((p[i] & 0xC0) != 0x80) return NULL;
+	}
+	return p+n+1;
 }
 
-/* Does a topic match a subscription? */
-int mosquitto_topic_matches_sub(const char *sub, const char *topic, bool *result)
+#ifdef MOSQ_TOPIC_BLOCK
+/* How many bytes at the start of a block are plain ASCII, other than NUL,
+ * "+" and "#"? */
+static int _mosquitto_topic_plain_len(const unsigned char *p)
 {
-	char *local_sub, *local_topic;
-	int slen, tlen;
-	int spos, tpos;
-	int rc;
-	bool multilevel_wildcard = false;
+#  if defined(__AVX2__)
+	__m256i v = _mm256_loadu_si256((const __m256i *)p);
+	__m256i special = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_setzero_si256()),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('+')),
+				_mm256_cmpeq_epi8(v, _mm256_set1_epi8('#'))));
+	/* The top bit of v marks bytes that are not ASCII. */
+	unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(v, special));
+
+	return mask ? __builtin_ctz(mask) : 32;
+#  elif defined(__SSE2__)
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+	__m128i special = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_setzero_si128()),
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('+')),
+				_mm_cmpeq_epi8(v, _mm_set1_epi8('#'))));
+	/* The top bit of v marks bytes that are not ASCII. */
+	unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(v, special));
+
+	return mask ? __builtin_ctz(mask) : 16;
+#  else
+	uint8x16_t v = vld1q_u8(p);
+	uint8x16_t special = vorrq_u8(vcgeq_u8(v, vdupq_n_u8(0x80)),
+			vorrq_u8(vceqq_u8(v, vdupq_n_u8(0)),
+				vorrq_u8(vceqq_u8(v, vdupq_n_u8('+')), vceqq_u8(v, vdupq_n_u8('#')))));
+	/* NEON has no movemask, so narrow each byte of the mask to a nibble. */
+	uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(special), 4)), 0);
+
+	return mask ? __builtin_ctzll(mask)/4 : 16;
+#  endif
+}
+#endif
 
-	if(!sub || !topic || !result) return MOSQ_ERR_INVAL;
+/* Check a topic that is to be published or has been received in a PUBLISH,
+ * or with wildcards set, a subscription. It must be no longer than 65535
+ * bytes, must be valid UTF-8 and must not contain NUL. A topic must not
+ * contain "+" or "#", and a subscription may only use them as whole levels.
+ * len is passed in so that a NUL in a received topic is seen. Topics are
+ * nearly always ASCII, so that is checked for a block at a time, and only
+ * the bytes that are not are looked at one character at a time.
+ * Returns MOSQ_ERR_INVAL if the topic is not valid.
+ */
+int _mosquitto_topic_check(const char *str, size_t len, bool wildcards)
+{
+	const unsigned char *start = (const unsigned char *)str;
+	const unsigned char *p = start;
+	const unsigned char *end = p + len;
+#ifdef MOSQ_TOPIC_BLOCK
+	int plain;
+#endif
 
-	local_sub = _mosquitto_strdup(sub);
-	if(!local_sub) return MOSQ_ERR_NOMEM;
-	rc = _mosquitto_fix_sub_topic(&local_sub);
-	if(rc){
-		_mosquitto_free(local_sub);
-		return rc;
+	if(len > 65535) return MOSQ_ERR_INVAL;
+
+#ifdef MOSQ_TOPIC_BLOCK
+	while(end - p >= MOSQ_TOPIC_BLOCK){
+		plain = _mosquitto_topic_plain_len(p);
+		p += plain;
+		if(plain < MOSQ_TOPIC_BLOCK){
+			/* Take a run of multi-byte characters in one go. */
+			do{
+				p = _mosquitto_topic_check_char(start, p, end, wildcards);
+				if(!p) return MOSQ_ERR_INVAL;
+			}while(p < end && *p >= 0x80);
+		}
 	}
+#endif
+	while(p < end){
+		p = _mosquitto_topic_check_char(start, p, end, wildcards);
+		if(!p) return MOSQ_ERR_INVAL;
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
 
-	local_topic = _mosquitto_strdup(topic);
-	if(!local_topic){
-		_mosquitto_free(local_sub);
-		return MOSQ_ERR_NOMEM;
+/* Topics are matched in place as if _mosquitto_fix_sub_topic() had been run
+ * on them: a run of slashes counts as a single slash, and slashes with no
+ * level after them are ignored. A position in the topic is kept on a
+ * character that is part of that fixed topic, so a slash position is always
+ * the last slash of its run. */
+static const char *_mosquitto_topic_fix_pos(const char *p, const char *end)
+{
+	if(p < end && *p == '/'){
+		while(p+1 < end && p[1] == '/'){
+			p++;
+		}
+		if(p+1 == end){
+			return end;
+		}
 	}
-	rc = _mosquitto_fix_sub_topic(&local_topic);
-	if(rc){
-		_mosquitto_free(local_sub);
-		_mosquitto_free(local_topic);
-		return rc;
+	return p;
+}
+
+static const char *_mosquitto_topic_next(const char *p, const char *end)
+{
+	p++;
+	if(p < end && *p != '/'){
+		return p;
 	}
+	return _mosquitto_topic_fix_pos(p, end);
+}
 
-	slen = strlen(local_sub);
-	tlen = strlen(local_topic);
+/* Does a topic match a subscription? */
+int mosquitto_topic_matches_sub(const char *sub, const char *topic, bool *result)
+{
+	if(!sub || !topic || !result) return MOSQ_ERR_INVAL;
 
-	spos = 0;
-	tpos = 0;
+	return mosquitto_topic_matches_sub2(sub, strlen(sub), topic, strlen(topic), result);
+}
+
+int mosquitto_topic_matches_sub2(const char *sub, size_t sublen, const char *topic, size_t topiclen, bool *result)
+{
+	const char *spos, *send;
+	const char *tpos, *tend;
+	const char *next;
+	bool multilevel_wildcard = false;
+
+	if(!sub || !topic || !result) return MOSQ_ERR_INVAL;
 
-	while(spos < slen && tpos < tlen){
-		if(local_sub[spos] == local_topic[tpos]){
-			spos++;
-			tpos++;
-			if(spos == slen && tpos == tlen){
+	*result = false;
+	send = sub + sublen;
+	tend = topic + topiclen;
+	spos = _mosquitto_topic_fix_pos(sub, send);
+	tpos = _mosquitto_topic_fix_pos(topic, tend);
+
+	while(spos < send && tpos < tend){
+		if(*spos == *tpos){
+			spos = _mosquitto_topic_next(spos, send);
+			tpos = _mosquitto_topic_next(tpos, tend);
+			if(spos == send && tpos == tend){
 				*result = true;
 				break;
 			}
 		}else{
-			if(local_sub[spos] == '+'){
-				spos++;
-				while(tpos < tlen && local_topic[tpos] != '/'){
-					tpos++;
+			if(*spos == '+'){
+				spos = _mosquitto_topic_next(spos, send);
+				while(tpos < tend && *tpos != '/'){
+					tpos = _mosquitto_topic_next(tpos, tend);
 				}
-				if(tpos == tlen && spos == slen){
+				if(tpos == tend && spos == send){
 					*result = true;
 					break;
 				}
-			}else if(local_sub[spos] == '#'){
+			}else if(*spos == '#'){
 				multilevel_wildcard = true;
-				if(spos+1 != slen){
-					*result = false;
-					break;
-				}else{
-					*result = true;
-					break;
-				}
+				*result = _mosquitto_topic_next(spos, send) == send;
+				break;
 			}else{
 				*result = false;
 				break;
 			}
 		}
-		if(tpos == tlen-1){
+		if(tpos < tend && _mosquitto_topic_next(tpos, tend) == tend && spos < send){
 			/* Check for e.g. foo matching foo/# */
-			if(spos == slen-3 
-					&& local_sub[spos+1] == '/'
-					&& local_sub[spos+2] == '#'){
-				*result = true;
-				multilevel_wildcard = true;
-				break;
+			next = _mosquitto_topic_next(spos, send);
+			if(next < send && *next == '/'){
+				next = _mosquitto_topic_next(next, send);
+				if(next < send && *next == '#' && _mosquitto_topic_next(next, send) == send){
+					*result = true;
+					multilevel_wildcard = true;
+					break;
+				}
 			}
 		}
 	}
-	if(multilevel_wildcard == false && (tpos < tlen || spos < slen)){
+	if(multilevel_wildcard == false && (tpos < tend || spos < send)){
 		*result = false;
 	}
 
-	_mosquitto_free(local_sub);
-	_mosquitto_free(local_topic);
 	return MOSQ_ERR_SUCCESS;
 }
 
@@ -36,9 +36,16 @@ POSSIBILITY OF SUCH DAMAGE.
 
 int _mosquitto_packet_alloc(struct _mosquitto_packet *packet);
 void _mosquitto_check_keepalive(struct mosquitto *mosq);
+#ifndef WITH_BROKER
+bool _mosquitto_loop_finished(struct mosquitto *mosq);
+int64_t _mosquitto_loop_deadline(struct mosquitto *mosq);
+void _mosquitto_callback_enter(void);
+void _mosquitto_callback_leave(void);
+bool _mosquitto_callback_active(void);
+#endif
 int _mosquitto_fix_sub_topic(char **subtopic);
 uint16_t _mosquitto_mid_generate(struct mosquitto *mosq);
-int _mosquitto_topic_wildcard_len_check(const char *str);
+int _mosquitto_topic_check(const char *str, size_t len, bool wildcards);
 FILE *_mosquitto_fopen(const char *path, const char *mode);
 
 #ifdef REAL_WITH_TLS_PSK